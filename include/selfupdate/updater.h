@@ -1,8 +1,11 @@
 #pragma once
 
+#include <atomic>
 #include <functional>
 #include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 #ifdef _WIN32
 #include <tchar.h>
@@ -14,6 +17,54 @@
 
 namespace selfupdate {
 
+// Copies share the same state, so that a copy given to a call can be cancelled from any thread. A cancelled transfer
+// stops at the next received chunk, keeping what is needed to resume it.
+class CancellationToken {
+public:
+  CancellationToken() : cancelled_(std::make_shared<std::atomic<bool>>(false)) {
+  }
+
+  void Cancel() const {
+    *cancelled_ = true;
+  }
+  bool IsCancelled() const {
+    return *cancelled_;
+  }
+
+private:
+  std::shared_ptr<std::atomic<bool>> cancelled_;
+};
+
+// Token bucket that caps how fast the transfers it is given to receive, all together. Copies share the same bucket, so
+// that the limit can be changed from any thread while downloading.
+class BandwidthLimit {
+public:
+  BandwidthLimit();
+
+  // 0 for unlimited, the default. Takes effect from the next received chunk.
+  void SetBytesPerSecond(unsigned long long bytes_per_second) const;
+  unsigned long long BytesPerSecond() const;
+  // Waits until size more bytes may be received, called by the library as data arrives.
+  void Acquire(size_t size) const;
+
+private:
+  struct State;
+  std::shared_ptr<State> state_;
+};
+
+// A file of a manifest package.
+struct PackageFile {
+  // Relative to the install location, '/' separated.
+  std::string path;
+  unsigned long long size = 0;
+  std::map<std::string, std::string> hash;
+  bool executable = false;
+  // Where to fetch the file from. If url is empty, the file is stored uncompressed at offset in package_url, and is
+  // fetched with a Range request.
+  std::string url;
+  unsigned long long offset = 0;
+};
+
 struct PackageInfo {
   std::string package_name;
   bool has_new_version = false;
@@ -23,23 +74,198 @@ struct PackageInfo {
   unsigned long long package_size = 0;
   std::string package_format;
   std::map<std::string, std::string> package_hash;
+  // Optional. Hashes of every package_chunk_size bytes of the package, so that a corrupted download only fetches the
+  // chunks that do not match again.
+  unsigned long long package_chunk_size = 0;
+  std::string package_chunk_hash_algo;
+  std::vector<std::string> package_chunk_hashes;
+  // Delta packages only, optional. The full package to install instead, if the delta package could not be applied to
+  // the current installation. Install() fails then, and the next Download(), Stage() and Install() take the full
+  // package.
+  std::string full_package_url;
+  unsigned long long full_package_size = 0;
+  std::map<std::string, std::string> full_package_hash;
+  // Manifest packages only. Every file of the new version, only the ones that differ from the installed files are
+  // downloaded.
+  std::vector<PackageFile> package_files;
   std::string update_title;
   std::string update_description;
+  // Optional, to spread the load of a release over time. Only installations whose stable bucket, in [0, 100), is below
+  // rollout_percentage are offered the new version, others get has_new_version false. 0 pauses the rollout, offering it
+  // to none, 100 when missing.
+  unsigned rollout_percentage = 100;
+  // Seconds the server asks not to be queried again. Query() answers from this response until then.
+  unsigned retry_after = 0;
+  // Download() waits a random time within this many seconds before starting a download that has not started yet.
+  unsigned download_window = 0;
 };
 
+// Timings, in milliseconds, and counters of an update, for fleet dashboards. Durations are -1 for phases that have not
+// run, or could not be measured.
+struct UpdateMetrics {
+  struct ThroughputSample {
+    long long elapsed_ms = 0;
+    unsigned long long downloaded_bytes = 0;
+  };
+
+  // Query()
+  long long query_ms = -1;
+  // Answered from the query cache, without asking the server, or by a 304 response.
+  bool query_from_cache = false;
+  bool query_not_modified = false;
+
+  // Download(). xl::http does not report connecting apart, so first_byte_ms includes resolving and connecting.
+  long long download_first_byte_ms = -1;
+  long long download_ms = -1;
+  unsigned long long bytes_resumed = 0;
+  unsigned long long bytes_fetched = 0;
+  // Bytes downloaded since the transfer started, about every second.
+  std::vector<ThroughputSample> throughput;
+  // Time spent in each hash algorithm, while downloading and verifying.
+  std::map<std::string, long long> hash_ms;
+
+  // Stage(), extracting or building the new installation ahead of Install().
+  long long stage_ms = -1;
+
+  // Installer, see LoadUpdateMetrics(). extracted_entries counts the entries of the package written out, files and
+  // directories, wherever it was extracted: while downloading, by Stage(), or by the installer. Files left in place by
+  // incremental installs are not counted.
+  long long extract_ms = -1;
+  unsigned long long extracted_entries = 0;
+  unsigned rename_retries = 0;
+  // From the main process exiting, or releasing its files, to the new version being launched.
+  long long downtime_ms = -1;
+  // The main process called NotifyFilesReleased() before it exited.
+  bool files_released = false;
+};
+
+enum UpdatePhase {
+  UPDATE_PHASE_QUERY,
+  UPDATE_PHASE_DOWNLOAD,
+  UPDATE_PHASE_INSTALL,
+  UPDATE_PHASE_STAGE,
+};
+
+// Called with the metrics of the update so far after each phase, on the thread that ran it. The metrics are kept for
+// the life of the process, Install() hands them to the installer, which adds its own and passes them on to the new
+// version in a trace file.
+typedef std::function<void(UpdatePhase phase, const UpdateMetrics &metrics)> UpdateMetricsCallback;
+void SetUpdateMetricsCallback(UpdateMetricsCallback callback);
+
 bool Query(const std::string &query_url,
            const std::multimap<std::string, std::string> &headers,
            const std::string &query_body,
            PackageInfo &package_info);
+bool Query(const std::string &query_url,
+           const std::multimap<std::string, std::string> &headers,
+           const std::string &query_body,
+           PackageInfo &package_info,
+           const CancellationToken &cancellation_token);
 
 typedef std::function<void(unsigned long long downloaded_bytes, unsigned long long total_bytes)>
     DownloadProgressMonitor;
+
+struct DownloadOptions {
+  // Number of concurrent HTTP Range connections. 1 downloads the package over a single connection. With more, progress
+  // is reported from the threads of the connections, one report at a time.
+  unsigned connection_count = 1;
+  // Size of the byte range a connection fetches at a time, when connection_count is greater than 1.
+  unsigned long long segment_size = 4 * 1024 * 1024;
+  // The installation the package is for, compared with for manifest packages, and extracted next to with
+  // stream_extract. Default to the installation of the executable.
+  const TCHAR *install_location = nullptr;
+  // Zip packages only. Extract into install_location + ".staging" while downloading, which becomes the staged
+  // installation at install_location + ".new" once the whole package is verified, so that the installer only has to
+  // swap it in. Falls back to extracting in the installer if the package could not be streamed, e.g. when resumed.
+  bool stream_extract = false;
+  // Cancel to stop the download, a later Download() resumes it.
+  CancellationToken cancellation_token;
+  // Shared by all connections of the download.
+  BandwidthLimit bandwidth_limit;
+  // Run the download and the verification on a thread of their own, with background CPU and I/O priority, so that they
+  // do not compete with the application. Progress is reported on that thread then.
+  bool background = false;
+  // Minimum time between two progress reports. The last one, with all bytes downloaded, is always reported.
+  unsigned progress_interval_ms = 100;
+  // Zip and delta packages are downloaded once into a store, named after the package hash. A Download() of a package
+  // another process is downloading waits for it, for a while, instead of downloading it again. Default to a directory
+  // in the temp directory that only the current user can access. Set to share the store with all users that can write
+  // to this directory, packages are then copied out of it and verified again before they are used.
+  const TCHAR *package_store_dir = nullptr;
+  // The least recently used packages are removed from the store beyond this size.
+  unsigned long long package_store_max_size = 1024ULL * 1024 * 1024;
+};
+
 bool Download(const PackageInfo &package_info, DownloadProgressMonitor download_progress_monitor);
+bool Download(const PackageInfo &package_info,
+              const DownloadOptions &download_options,
+              DownloadProgressMonitor download_progress_monitor);
+
+// Asynchronous versions of Query() and Download(), run on threads owned by the library. The callback is called on one
+// of those threads, also when cancelled. Download progress is reported on them too. download_options.install_location
+// must stay valid until the callback is called. Calls still running at exit are waited for, cancel them before
+// returning from main(). A stalled connection is only given up after a few minutes, cancellation included.
+typedef std::function<void(bool succeeded, const PackageInfo &package_info)> QueryCallback;
+typedef std::function<void(bool succeeded)> DownloadCallback;
+
+void QueryAsync(const std::string &query_url,
+                const std::multimap<std::string, std::string> &headers,
+                const std::string &query_body,
+                QueryCallback callback,
+                const CancellationToken &cancellation_token = CancellationToken());
+void DownloadAsync(const PackageInfo &package_info,
+                   const DownloadOptions &download_options,
+                   DownloadProgressMonitor download_progress_monitor,
+                   DownloadCallback callback);
+
+// installer_path is copied, or where possible cloned or hard linked, next to the package to run the installer from. The
+// installer_stub target builds a small one, for applications that are not merged with the installer.
+bool Install(const PackageInfo &package_info,
+             const TCHAR *installer_path = nullptr,    // default to the executable path
+             const TCHAR *install_location = nullptr); // default to the executable directory
+
+struct InstallOptions {
+  // Threads the installer extracts a zip package with. 0 for one per processor, 1 for the serial xl::zip extractor.
+  // With incremental, 1 extracts on one thread with the own extractor instead, xl::zip can not link unchanged files.
+  unsigned extract_thread_count = 0;
+  // Link files that are unchanged since the installed version into the new installation, instead of extracting them.
+  bool incremental = false;
+  // Install each version side by side in install_location + ".versions/<package_version>", and make install_location a
+  // symlink to the active one, switched with a single rename. Keeps this many versions, the active one included, at
+  // least 2 for Rollback(). 0 replaces the installation in place. Not supported on Windows, installs in place there.
+  unsigned keep_versions = 0;
+};
 
 bool Install(const PackageInfo &package_info,
+             const InstallOptions &install_options,
              const TCHAR *installer_path = nullptr,    // default to the executable path
              const TCHAR *install_location = nullptr); // default to the executable directory
 
+// Extracts the downloaded package next to the installation, at a background priority, while the application keeps
+// running. Install() then finds it staged, and the installer only has to swap it in, which shortens the downtime. Zip
+// packages downloaded with DownloadOptions::stream_extract may already be staged, returns true at once then.
+bool Stage(const PackageInfo &package_info,
+           const InstallOptions &install_options,
+           const TCHAR *install_location = nullptr); // default to the installation of the executable
+
+// Asynchronous version of Stage(), run on a thread of its own, apart from queries and downloads. install_location must
+// stay valid until the callback is called.
+typedef std::function<void(bool succeeded)> StageCallback;
+void StageAsync(const PackageInfo &package_info,
+                const InstallOptions &install_options,
+                const TCHAR *install_location,
+                StageCallback callback);
+
+// Tells the installer started by Install() that this process holds no more files in the installation, so that it can
+// replace them without waiting for the process to exit, e.g. when the process still has to upload logs after closing.
+// The new version may be launched before this process exits. Optional, the installer otherwise starts the moment the
+// process exits.
+void NotifyFilesReleased();
+
+// Switches an installation done with InstallOptions::keep_versions back to the version that was active before the
+// current one, for the next launch. Running processes are not affected. Returns false if there is no earlier version.
+bool Rollback(const TCHAR *install_location = nullptr); // default to the installation of the executable
+
 #ifdef _WIN32
 bool IsNewVersionFirstLaunched(int argc, const TCHAR *argv[]);
 bool IsNewVersionFirstLaunched(const TCHAR *command_line);
@@ -50,6 +276,15 @@ bool IsNewVersionFirstLaunched(int argc, const char *argv[]);
 bool IsForceUpdated(int argc, const char *argv[]);
 #endif
 
+// Reads the metrics of the update that launched this new version, including the installer ones, from the trace file
+// the installer wrote. The trace file is deleted if it is one in the cache directory, returns false if there is none.
+#ifdef _WIN32
+bool LoadUpdateMetrics(int argc, const TCHAR *argv[], UpdateMetrics &metrics);
+bool LoadUpdateMetrics(const TCHAR *command_line, UpdateMetrics &metrics);
+#else
+bool LoadUpdateMetrics(int argc, const char *argv[], UpdateMetrics &metrics);
+#endif
+
 } // namespace selfupdate
 
 #ifndef SELFUPDATE_USER_AGENT
@@ -0,0 +1,168 @@
+#include "crc32.h"
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CRC32_PCLMUL
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define CRC32_PCLMUL_TARGET
+#else
+#define CRC32_PCLMUL_TARGET __attribute__((target("sse2,pclmul")))
+#endif
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace selfupdate {
+
+namespace {
+
+const size_t CRC32_FILE_BUFFER_SIZE = 1024 * 1024;
+
+struct Crc32Table {
+  uint32_t table[256];
+
+  Crc32Table() {
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      table[i] = c;
+    }
+  }
+};
+
+// Works on the inverted crc.
+uint32_t Crc32Bytes(uint32_t crc, const uint8_t *p, size_t size) {
+  static const Crc32Table crc32_table;
+  for (size_t i = 0; i < size; ++i) {
+    crc = crc32_table.table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#ifdef CRC32_PCLMUL
+
+bool HasPclmul() {
+#ifdef _MSC_VER
+  int info[4] = {};
+  __cpuid(info, 1);
+  return (info[2] & (1 << 1)) != 0 && (info[3] & (1 << 26)) != 0;
+#else
+  return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2");
+#endif
+}
+
+// Folds 64 bytes at a time with carry-less multiplication, then reduces to 32 bits, see Intel's "Fast CRC Computation
+// for Generic Polynomials Using PCLMULQDQ Instruction". Works on the inverted crc, size is at least 64 and a multiple
+// of 16.
+CRC32_PCLMUL_TARGET uint32_t Crc32Pclmul(uint32_t crc, const uint8_t *p, size_t size) {
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+  const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+  const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+  const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+  const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+  __m128i x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+  __m128i x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+  __m128i x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+  __m128i x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+  p += 64;
+  size -= 64;
+
+  while (size >= 64) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+    __m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+    __m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+    __m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+    x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+    x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+    x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128((const __m128i *)(p + 0x00)));
+    x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128((const __m128i *)(p + 0x10)));
+    x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128((const __m128i *)(p + 0x20)));
+    x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128((const __m128i *)(p + 0x30)));
+    p += 64;
+    size -= 64;
+  }
+
+  // Fold the four lanes, then any remaining 16 bytes blocks, into one.
+  for (__m128i x : {x2, x3, x4}) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x), x5);
+  }
+  while (size >= 16) {
+    __m128i x5 = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)p)), x5);
+    p += 16;
+    size -= 16;
+  }
+
+  // 128 bits to 64 bits.
+  __m128i y = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), y);
+  y = _mm_srli_si128(x1, 4);
+  x1 = _mm_and_si128(x1, mask32);
+  x1 = _mm_clmulepi64_si128(x1, k5k0, 0x00);
+  x1 = _mm_xor_si128(x1, y);
+
+  // Barrett reduction to 32 bits.
+  y = _mm_and_si128(x1, mask32);
+  y = _mm_clmulepi64_si128(y, poly, 0x10);
+  y = _mm_and_si128(y, mask32);
+  y = _mm_clmulepi64_si128(y, poly, 0x00);
+  x1 = _mm_xor_si128(x1, y);
+  return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+
+#endif
+
+} // namespace
+
+uint32_t Crc32(uint32_t crc, const void *data, size_t size) {
+  const uint8_t *p = (const uint8_t *)data;
+  crc = ~crc;
+#if defined(CRC32_PCLMUL)
+  static const bool has_pclmul = HasPclmul();
+  if (has_pclmul && size >= 64) {
+    size_t folded = size & ~(size_t)15;
+    crc = Crc32Pclmul(crc, p, folded);
+    p += folded;
+    size -= folded;
+  }
+#elif defined(__ARM_FEATURE_CRC32)
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t value;
+    memcpy(&value, p, sizeof(value));
+    crc = __crc32d(crc, value);
+  }
+#endif
+  return ~Crc32Bytes(crc, p, size);
+}
+
+bool Crc32File(const xl::native_string &path, uint32_t &crc) {
+  FILE *f = _tfopen(path.c_str(), _T("rb"));
+  if (f == nullptr) {
+    return false;
+  }
+  std::unique_ptr<char[]> buffer(new char[CRC32_FILE_BUFFER_SIZE]);
+  crc = 0;
+  size_t size = 0;
+  while ((size = fread(buffer.get(), 1, CRC32_FILE_BUFFER_SIZE, f)) > 0) {
+    crc = Crc32(crc, buffer.get(), size);
+  }
+  bool ok = ferror(f) == 0;
+  fclose(f);
+  return ok;
+}
+
+} // namespace selfupdate
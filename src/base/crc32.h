@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// CRC-32 as used by zip and zlib. Start with crc = 0, pass the previous result to continue. Uses PCLMULQDQ or the ARMv8
+// CRC instructions where available.
+uint32_t Crc32(uint32_t crc, const void *data, size_t size);
+
+bool Crc32File(const xl::native_string &path, uint32_t &crc);
+
+} // namespace selfupdate
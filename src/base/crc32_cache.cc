@@ -0,0 +1,139 @@
+#include "crc32_cache.h"
+#include "../common.h"
+#include "crc32.h"
+#include "hash.h"
+#include <cstdio>
+#include <xl/encoding>
+#include <xl/file>
+#include <xl/log>
+
+namespace selfupdate {
+
+namespace {
+
+const char CRC32_CACHE_MAGIC[] = "SUCRC1";
+// Hex digits of the location hash a cache file is named after.
+const size_t CRC32_CACHE_NAME_LENGTH = 32;
+
+} // namespace
+
+xl::native_string Crc32Cache::GetCacheFile(const xl::native_string &install_location) {
+  xl::native_string cache_dir = GetPrivateTempDir(_T(CRC32_CACHE_DIR_NAME));
+  if (cache_dir.empty()) {
+    return {};
+  }
+  auto hasher = FindHashAlgorithm(PACKAGEINFO_PACKAGE_HASH_ALGO_SHA256)->create();
+  hasher->Update(install_location.data(), install_location.size() * sizeof(install_location[0]));
+  return xl::path::join(cache_dir, xl::encoding::utf8_to_native(hasher->Final().substr(0, CRC32_CACHE_NAME_LENGTH) +
+                                                                CRC32_CACHE_FILE_EXT));
+}
+
+void Crc32Cache::Load(const xl::native_string &cache_file) {
+  cache_file_.clear();
+  loaded_.clear();
+  recorded_.clear();
+  if (cache_file.empty()) {
+    return;
+  }
+  if (xl::fs::exists(cache_file.c_str()) && !IsOwnedByCurrentUser(cache_file)) {
+    XL_LOG_WARN("Crc cache file not owned by the current user, ignored: ", cache_file);
+    return;
+  }
+  cache_file_ = cache_file;
+  FILE *f = _tfopen(cache_file.c_str(), _T("rb"));
+  if (f == nullptr) {
+    return;
+  }
+  std::string content;
+  char buffer[4096];
+  size_t size = 0;
+  while ((size = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    content.append(buffer, size);
+  }
+  fclose(f);
+
+  size_t begin = content.find('\n');
+  if (content.compare(0, begin, CRC32_CACHE_MAGIC) != 0) {
+    XL_LOG_WARN("Unknown crc cache file: ", cache_file);
+    return;
+  }
+  while (begin != std::string::npos && begin + 1 < content.size()) {
+    size_t end = content.find('\n', begin + 1);
+    std::string line = content.substr(begin + 1, end == std::string::npos ? std::string::npos : end - begin - 1);
+    begin = end;
+    Entry entry;
+    unsigned long crc = 0;
+    int path_offset = 0;
+    if (sscanf(line.c_str(), "%lx %llu %llu %lld %n", &crc, &entry.identity.id, &entry.identity.size,
+               &entry.identity.mtime, &path_offset) != 4 ||
+        path_offset == 0 || (size_t)path_offset >= line.size()) {
+      continue;
+    }
+    entry.crc = (uint32_t)crc;
+    loaded_[line.substr(path_offset)] = entry;
+  }
+  XL_LOG_INFO("Crc cache loaded, entries: ", loaded_.size());
+}
+
+bool Crc32Cache::Save() const {
+  if (cache_file_.empty()) {
+    return false;
+  }
+  xl::native_string temp_file = cache_file_ + _T(".tmp");
+  FILE *f = _tfopen(temp_file.c_str(), _T("wb"));
+  if (f == nullptr) {
+    return false;
+  }
+  bool ok = fprintf(f, "%s\n", CRC32_CACHE_MAGIC) > 0;
+  for (const auto &item : recorded_) {
+    ok = ok && fprintf(f, "%08lx %llu %llu %lld %s\n", (unsigned long)item.second.crc, item.second.identity.id,
+                       item.second.identity.size, item.second.identity.mtime, item.first.c_str()) > 0;
+  }
+  ok = fclose(f) == 0 && ok;
+  // A reader never sees a partial cache, at worst none.
+  if (ok) {
+    xl::fs::remove(cache_file_.c_str());
+  }
+  if (!ok || !xl::fs::move(temp_file.c_str(), cache_file_.c_str())) {
+    xl::fs::remove(temp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool Crc32Cache::Get(const std::string &key, const xl::native_string &path, uint32_t &crc) {
+  FileIdentity identity;
+  if (!GetFileIdentity(path, identity)) {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = loaded_.find(key);
+    if (it != loaded_.end() && it->second.identity == identity) {
+      crc = it->second.crc;
+      return true;
+    }
+  }
+  if (!Crc32File(path, crc)) {
+    return false;
+  }
+  // The file may have changed while it was being read.
+  FileIdentity after;
+  if (!GetFileIdentity(path, after) || !(after == identity)) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  loaded_[key] = {identity, crc};
+  return true;
+}
+
+void Crc32Cache::Put(const std::string &key, const xl::native_string &path, uint32_t crc) {
+  FileIdentity identity;
+  if (!GetFileIdentity(path, identity)) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  recorded_[key] = {identity, crc};
+}
+
+} // namespace selfupdate
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "file_util.h"
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// CRC-32 of installed files, kept between updates so that unchanged files are not read again. An entry is only trusted
+// while the file keeps the FileIdentity it had when the entry was recorded. Entries are keyed by the '/' separated
+// package path.
+//
+// The cache file is a text file, "SUCRC1" followed by one line per file: crc, id, size, mtime, path.
+class Crc32Cache {
+public:
+  // Returns the cache file of install_location, in a private directory of the user, named after a hash of the location.
+  // Returns an empty string if there is no such directory.
+  static xl::native_string GetCacheFile(const xl::native_string &install_location);
+
+  // A missing or unreadable cache file leaves the cache empty, and so does one owned by another user, which is never
+  // written over either.
+  void Load(const xl::native_string &cache_file);
+  // Writes the entries recorded by Put() since Load(), entries that were only loaded are dropped.
+  bool Save() const;
+
+  // Returns the CRC-32 of the file at path, from the cache, or by reading the file.
+  bool Get(const std::string &key, const xl::native_string &path, uint32_t &crc);
+  // Records that the file at path, as it is now, has the CRC-32 crc.
+  void Put(const std::string &key, const xl::native_string &path, uint32_t crc);
+
+private:
+  struct Entry {
+    FileIdentity identity;
+    uint32_t crc = 0;
+  };
+
+  xl::native_string cache_file_;
+  std::mutex mutex_;
+  std::map<std::string, Entry> loaded_;
+  std::map<std::string, Entry> recorded_;
+};
+
+} // namespace selfupdate
@@ -0,0 +1,633 @@
+#include "file_util.h"
+
+#include <cstdint>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <xl/encoding>
+#include <xl/file>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <io.h>
+#include <tchar.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/fs.h>
+#include <sys/sendfile.h>
+#elif defined(__APPLE__)
+#include <sys/clonefile.h>
+#endif
+#endif
+
+namespace selfupdate {
+
+bool SyncFile(FILE *f) {
+  if (fflush(f) != 0) {
+    return false;
+  }
+#if defined(_WIN32)
+  return _commit(_fileno(f)) == 0;
+#elif defined(__linux__)
+  return fdatasync(fileno(f)) == 0;
+#else
+  return fsync(fileno(f)) == 0;
+#endif
+}
+
+namespace {
+
+#ifdef _WIN32
+
+// SetFileInformationByHandle() is only there since Vista, it is looked up at run time for the XP build, which does not
+// declare it, nor FILE_ALLOCATION_INFO and FileAllocationInfo.
+typedef BOOL(WINAPI *SetFileInformationByHandleFunc)(HANDLE handle, int info_class, LPVOID info, DWORD size);
+const int FILE_ALLOCATION_INFO_CLASS = 5;
+struct FileAllocationInformation {
+  LARGE_INTEGER AllocationSize;
+};
+
+bool ReserveSpace(HANDLE handle, unsigned long long size) {
+  static const SetFileInformationByHandleFunc set_file_information_by_handle =
+      (SetFileInformationByHandleFunc)::GetProcAddress(::GetModuleHandle(_T("kernel32.dll")),
+                                                       "SetFileInformationByHandle");
+  if (set_file_information_by_handle == nullptr) {
+    return true;
+  }
+  FileAllocationInformation info = {};
+  info.AllocationSize.QuadPart = (LONGLONG)size;
+  return set_file_information_by_handle(handle, FILE_ALLOCATION_INFO_CLASS, &info, sizeof(info)) != FALSE ||
+         (::GetLastError() != ERROR_DISK_FULL && ::GetLastError() != ERROR_HANDLE_DISK_FULL);
+}
+
+#else
+
+bool ReserveSpace(int fd, unsigned long long size) {
+  int error = 0;
+#if defined(__linux__)
+  error = fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == 0 ? 0 : errno;
+#elif defined(__APPLE__)
+  // F_PEOFPOSMODE allocates from the end of what is allocated already, e.g. by the download being resumed.
+  struct stat st = {};
+  unsigned long long allocated = fstat(fd, &st) == 0 ? (unsigned long long)st.st_blocks * 512 : 0;
+  if (allocated >= size) {
+    return true;
+  }
+  fstore_t store = {F_ALLOCATECONTIG | F_ALLOCATEALL, F_PEOFPOSMODE, 0, (off_t)(size - allocated), 0};
+  if (fcntl(fd, F_PREALLOCATE, &store) != 0) {
+    // Fragmented free space.
+    store.fst_flags = F_ALLOCATEALL;
+    error = fcntl(fd, F_PREALLOCATE, &store) == 0 ? 0 : errno;
+  }
+#endif
+  return error != ENOSPC && error != EDQUOT;
+}
+
+#endif
+
+} // namespace
+
+bool ReserveFileSpace(FILE *f, unsigned long long size) {
+#ifdef _WIN32
+  return ReserveSpace((HANDLE)_get_osfhandle(_fileno(f)), size);
+#else
+  return ReserveSpace(fileno(f), size);
+#endif
+}
+
+long long GetFileSize(const xl::native_string &path) {
+#ifdef _WIN32
+  struct _stat64 st = {};
+  if (_tstat64(path.c_str(), &st) != 0) {
+    return -1;
+  }
+#else
+  struct stat st = {};
+  if (stat(path.c_str(), &st) != 0) {
+    return -1;
+  }
+#endif
+  return (long long)st.st_size;
+}
+
+bool IsDirectory(const xl::native_string &path) {
+#ifdef _WIN32
+  struct _stat64 st = {};
+  if (_tstat64(path.c_str(), &st) != 0) {
+    return false;
+  }
+  return (st.st_mode & _S_IFDIR) != 0;
+#else
+  struct stat st = {};
+  if (stat(path.c_str(), &st) != 0) {
+    return false;
+  }
+  return S_ISDIR(st.st_mode);
+#endif
+}
+
+unsigned long long CountDirectoryEntries(const xl::native_string &dir) {
+  unsigned long long count = 0;
+  xl::fs::enum_dir(
+      dir.c_str(),
+      [&count](const xl::native_string &path, bool is_dir) -> bool {
+        ++count;
+        return true;
+      },
+      true);
+  return count;
+}
+
+long long GetFileModifiedTime(const xl::native_string &path) {
+#ifdef _WIN32
+  struct _stat64 st = {};
+  if (_tstat64(path.c_str(), &st) != 0) {
+    return -1;
+  }
+#else
+  struct stat st = {};
+  if (stat(path.c_str(), &st) != 0) {
+    return -1;
+  }
+#endif
+  return (long long)st.st_mtime;
+}
+
+bool TouchFile(const xl::native_string &path) {
+#ifdef _WIN32
+  HANDLE handle = ::CreateFile(path.c_str(), FILE_WRITE_ATTRIBUTES,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                               FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  FILETIME now = {};
+  ::GetSystemTimeAsFileTime(&now);
+  bool ok = ::SetFileTime(handle, nullptr, nullptr, &now) != FALSE;
+  ::CloseHandle(handle);
+  return ok;
+#else
+  return utimensat(AT_FDCWD, path.c_str(), nullptr, 0) == 0;
+#endif
+}
+
+bool GetFileIdentity(const xl::native_string &path, FileIdentity &identity) {
+#ifdef _WIN32
+  HANDLE handle = ::CreateFile(path.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                               OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  BY_HANDLE_FILE_INFORMATION info = {};
+  bool ok = ::GetFileInformationByHandle(handle, &info) != FALSE;
+  ::CloseHandle(handle);
+  if (!ok) {
+    return false;
+  }
+  identity.id = ((unsigned long long)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+  identity.size = ((unsigned long long)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+  identity.mtime = (long long)(((unsigned long long)info.ftLastWriteTime.dwHighDateTime << 32) |
+                               info.ftLastWriteTime.dwLowDateTime);
+#else
+  struct stat st = {};
+  if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  identity.id = (unsigned long long)st.st_ino;
+  identity.size = (unsigned long long)st.st_size;
+#ifdef __APPLE__
+  identity.mtime = (long long)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+  identity.mtime = (long long)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+  return true;
+}
+
+bool ToRelativeNativePath(const std::string &path, xl::native_string &native_path) {
+  if (path.empty() || path.find('\\') != std::string::npos || path.find(':') != std::string::npos) {
+    return false;
+  }
+  for (size_t begin = 0; begin <= path.size();) {
+    size_t end = path.find('/', begin);
+    if (end == std::string::npos) {
+      end = path.size();
+    }
+    std::string component = path.substr(begin, end - begin);
+    if (component.empty() || component == "." || component == "..") {
+      return false;
+    }
+    begin = end + 1;
+  }
+  native_path = xl::encoding::utf8_to_native(path);
+#ifdef _WIN32
+  for (auto &c : native_path) {
+    if (c == _T('/')) {
+      c = _T('\\');
+    }
+  }
+#endif
+  return true;
+}
+
+void AddPathWithParents(xl::native_string path, std::unordered_set<xl::native_string> &paths) {
+  while (!path.empty() && paths.insert(path).second) {
+#ifdef _WIN32
+    size_t pos = path.find_last_of(_T('\\'));
+#else
+    size_t pos = path.find_last_of('/');
+#endif
+    path.resize(pos == xl::native_string::npos ? 0 : pos);
+  }
+}
+
+namespace {
+
+bool CloneFile(const xl::native_string &from_path, const xl::native_string &to_path) {
+#if defined(__linux__) && defined(FICLONE)
+  int from = open(from_path.c_str(), O_RDONLY);
+  if (from < 0) {
+    return false;
+  }
+  struct stat st = {};
+  int to = fstat(from, &st) == 0 ? open(to_path.c_str(), O_WRONLY | O_CREAT | O_EXCL, st.st_mode & 0777) : -1;
+  bool cloned = to >= 0 && ioctl(to, FICLONE, from) == 0;
+  if (to >= 0) {
+    close(to);
+    if (!cloned) {
+      unlink(to_path.c_str());
+    }
+  }
+  close(from);
+  return cloned;
+#elif defined(__APPLE__)
+  return clonefile(from_path.c_str(), to_path.c_str(), 0) == 0;
+#else
+  return false;
+#endif
+}
+
+bool HardLinkFile(const xl::native_string &from_path, const xl::native_string &to_path) {
+#ifdef _WIN32
+  return ::CreateHardLink(to_path.c_str(), from_path.c_str(), nullptr) != FALSE;
+#else
+  return link(from_path.c_str(), to_path.c_str()) == 0;
+#endif
+}
+
+} // namespace
+
+bool LinkOrCopyFile(const xl::native_string &from_path, const xl::native_string &to_path) {
+  return CloneFile(from_path, to_path) || HardLinkFile(from_path, to_path) ||
+         xl::fs::copy(from_path.c_str(), to_path.c_str());
+}
+
+bool CloneOrCopyFile(const xl::native_string &from_path, const xl::native_string &to_path) {
+  return CloneFile(from_path, to_path) || xl::fs::copy(from_path.c_str(), to_path.c_str());
+}
+
+xl::native_string GetPrivateTempDir(const xl::native_string &name) {
+  xl::native_string tmp_dir = xl::fs::tmp_dir();
+  if (tmp_dir.empty()) {
+    return xl::native_string();
+  }
+#ifdef _WIN32
+  // The temp directory is in the user profile.
+  xl::native_string dir = xl::path::join(tmp_dir, name);
+  xl::fs::mkdirs(dir.c_str());
+  return IsDirectory(dir) ? dir : xl::native_string();
+#else
+  xl::native_string dir = xl::path::join(tmp_dir, name + "-" + std::to_string(geteuid()));
+  if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+    return xl::native_string();
+  }
+  // lstat, a symlink planted by another user must not redirect it.
+  struct stat st = {};
+  if (lstat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid()) {
+    return xl::native_string();
+  }
+  if ((st.st_mode & 077) != 0 && chmod(dir.c_str(), 0700) != 0) {
+    return xl::native_string();
+  }
+  return dir;
+#endif
+}
+
+bool IsOwnedByCurrentUser(const xl::native_string &path) {
+#ifdef _WIN32
+  return true;
+#else
+  struct stat st = {};
+  return lstat(path.c_str(), &st) == 0 && st.st_uid == geteuid();
+#endif
+}
+
+FileLock::~FileLock() {
+  Unlock();
+}
+
+#ifdef _WIN32
+
+bool FileLock::TryLock(const xl::native_string &path, bool) {
+  Unlock();
+  HANDLE handle = ::CreateFile(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                               OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  OVERLAPPED overlapped = {};
+  if (!::LockFileEx(handle, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped)) {
+    ::CloseHandle(handle);
+    return false;
+  }
+  handle_ = handle;
+  return true;
+}
+
+void FileLock::Unlock() {
+  if (handle_ != nullptr) {
+    // Closing the handle releases the lock.
+    ::CloseHandle(handle_);
+    handle_ = nullptr;
+  }
+}
+
+bool FileLock::locked() const {
+  return handle_ != nullptr;
+}
+
+#else
+
+bool FileLock::TryLock(const xl::native_string &path, bool shared) {
+  Unlock();
+  int fd = open(path.c_str(), O_RDWR | O_CREAT, shared ? 0666 : 0600);
+  if (fd < 0) {
+    return false;
+  }
+  if (shared) {
+    // Whatever the umask of whoever created it, other users sharing the directory must be able to open it too.
+    fchmod(fd, 0666);
+  }
+  // flock locks belong to the open file, so they also exclude other FileLock objects of this process, unlike fcntl
+  // ones.
+  if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+    close(fd);
+    return false;
+  }
+  fd_ = fd;
+  return true;
+}
+
+void FileLock::Unlock() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool FileLock::locked() const {
+  return fd_ >= 0;
+}
+
+#endif
+
+PositionalFile::~PositionalFile() {
+  Close();
+}
+
+#ifdef _WIN32
+
+bool PositionalFile::Open(const xl::native_string &path, bool read_only) {
+  Close();
+  HANDLE handle = ::CreateFile(path.c_str(), read_only ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE,
+                               FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, read_only ? OPEN_EXISTING : OPEN_ALWAYS,
+                               FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  handle_ = handle;
+  return true;
+}
+
+void PositionalFile::Close() {
+  if (handle_ != nullptr) {
+    ::CloseHandle(handle_);
+    handle_ = nullptr;
+  }
+}
+
+bool PositionalFile::WriteAt(unsigned long long offset, const void *data, size_t size) {
+  const char *p = (const char *)data;
+  while (size > 0) {
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD written = 0;
+    if (!::WriteFile(handle_, p, size > MAXDWORD ? MAXDWORD : (DWORD)size, &written, &overlapped) || written == 0) {
+      return false;
+    }
+    p += written;
+    offset += written;
+    size -= written;
+  }
+  return true;
+}
+
+size_t PositionalFile::ReadAt(unsigned long long offset, void *data, size_t size) {
+  char *p = (char *)data;
+  size_t total = 0;
+  while (total < size) {
+    OVERLAPPED overlapped = {};
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD read = 0;
+    DWORD to_read = size - total > MAXDWORD ? MAXDWORD : (DWORD)(size - total);
+    if (!::ReadFile(handle_, p + total, to_read, &read, &overlapped) || read == 0) {
+      break;
+    }
+    total += read;
+    offset += read;
+  }
+  return total;
+}
+
+bool PositionalFile::Sync() {
+  return ::FlushFileBuffers(handle_) != FALSE;
+}
+
+bool PositionalFile::Reserve(unsigned long long size) {
+  return ReserveSpace(handle_, size);
+}
+
+unsigned long long PositionalFile::CopyTo(unsigned long long offset,
+                                          unsigned long long size,
+                                          PositionalFile &to,
+                                          unsigned long long to_offset) {
+  return 0;
+}
+
+MappedFile::~MappedFile() {
+  Close();
+}
+
+bool MappedFile::Open(const xl::native_string &path) {
+  Close();
+  HANDLE file = ::CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                             FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER size = {};
+  HANDLE mapping = nullptr;
+  if (::GetFileSizeEx(file, &size) && size.QuadPart > 0 && (unsigned long long)size.QuadPart <= SIZE_MAX) {
+    mapping = ::CreateFileMapping(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+  }
+  ::CloseHandle(file);
+  if (mapping == nullptr) {
+    return false;
+  }
+  // The view keeps the mapping alive.
+  data_ = (const unsigned char *)::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+  ::CloseHandle(mapping);
+  if (data_ == nullptr) {
+    return false;
+  }
+  size_ = (unsigned long long)size.QuadPart;
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data_ != nullptr) {
+    ::UnmapViewOfFile(data_);
+    data_ = nullptr;
+    size_ = 0;
+  }
+}
+
+#else
+
+bool PositionalFile::Open(const xl::native_string &path, bool read_only) {
+  Close();
+  fd_ = read_only ? open(path.c_str(), O_RDONLY) : open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  return fd_ >= 0;
+}
+
+void PositionalFile::Close() {
+  if (fd_ >= 0) {
+    close(fd_);
+    fd_ = -1;
+  }
+}
+
+bool PositionalFile::WriteAt(unsigned long long offset, const void *data, size_t size) {
+  const char *p = (const char *)data;
+  while (size > 0) {
+    ssize_t written = pwrite(fd_, p, size, (off_t)offset);
+    if (written <= 0) {
+      return false;
+    }
+    p += written;
+    offset += written;
+    size -= written;
+  }
+  return true;
+}
+
+size_t PositionalFile::ReadAt(unsigned long long offset, void *data, size_t size) {
+  char *p = (char *)data;
+  size_t total = 0;
+  while (total < size) {
+    ssize_t read = pread(fd_, p + total, size - total, (off_t)(offset + total));
+    if (read <= 0) {
+      break;
+    }
+    total += read;
+  }
+  return total;
+}
+
+bool PositionalFile::Sync() {
+#ifdef __linux__
+  return fdatasync(fd_) == 0;
+#else
+  return fsync(fd_) == 0;
+#endif
+}
+
+bool PositionalFile::Reserve(unsigned long long size) {
+  return ReserveSpace(fd_, size);
+}
+
+unsigned long long PositionalFile::CopyTo(unsigned long long offset,
+                                          unsigned long long size,
+                                          PositionalFile &to,
+                                          unsigned long long to_offset) {
+#ifdef __linux__
+  unsigned long long copied = 0;
+  loff_t in_offset = (loff_t)offset;
+  loff_t out_offset = (loff_t)to_offset;
+  while (copied < size) {
+    ssize_t n = copy_file_range(fd_, &in_offset, to.fd_, &out_offset, (size_t)(size - copied), 0);
+    if (n <= 0) {
+      break;
+    }
+    copied += n;
+  }
+  // Older kernels only copy within one file system.
+  if (copied < size && lseek(to.fd_, (off_t)(to_offset + copied), SEEK_SET) >= 0) {
+    off_t sendfile_offset = (off_t)(offset + copied);
+    while (copied < size) {
+      ssize_t n = sendfile(to.fd_, fd_, &sendfile_offset, (size_t)(size - copied));
+      if (n <= 0) {
+        break;
+      }
+      copied += n;
+    }
+  }
+  return copied;
+#else
+  return 0;
+#endif
+}
+
+MappedFile::~MappedFile() {
+  Close();
+}
+
+bool MappedFile::Open(const xl::native_string &path) {
+  Close();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st = {};
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0 && (unsigned long long)st.st_size <= SIZE_MAX) {
+    data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  data_ = (const unsigned char *)data;
+  size_ = (unsigned long long)st.st_size;
+  return true;
+}
+
+void MappedFile::Close() {
+  if (data_ != nullptr) {
+    munmap((void *)data_, (size_t)size_);
+    data_ = nullptr;
+    size_ = 0;
+  }
+}
+
+#endif
+
+} // namespace selfupdate
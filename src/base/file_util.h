@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <unordered_set>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// Flushes the stdio buffer of f and asks the system to write the file data to disk.
+bool SyncFile(FILE *f);
+
+// Allocates disk space for the first size bytes of f without changing its size, so that it is written in place instead
+// of growing in fragments. Returns false only if the disk is full. Other failures, e.g. on file systems that can not
+// preallocate, are ignored.
+bool ReserveFileSpace(FILE *f, unsigned long long size);
+
+// Returns -1 if the file does not exist.
+long long GetFileSize(const xl::native_string &path);
+
+bool IsDirectory(const xl::native_string &path);
+
+// Counts the files and directories in dir, recursively.
+unsigned long long CountDirectoryEntries(const xl::native_string &dir);
+
+// Returns the last modification time in seconds since the epoch, or -1 if the file does not exist.
+long long GetFileModifiedTime(const xl::native_string &path);
+// Sets the last modification time to now.
+bool TouchFile(const xl::native_string &path);
+
+// What tells whether a file may have changed since it was last seen, without reading it.
+struct FileIdentity {
+  unsigned long long id = 0; // inode, or file index on Windows
+  unsigned long long size = 0;
+  long long mtime = 0; // nanoseconds on posix, 100 nanoseconds on Windows
+
+  bool operator==(const FileIdentity &other) const {
+    return id == other.id && size == other.size && mtime == other.mtime;
+  }
+};
+
+bool GetFileIdentity(const xl::native_string &path, FileIdentity &identity);
+
+// Converts a '/' separated UTF-8 path from a package to a native relative path. Rejects absolute paths and anything
+// that could escape the directory it is relative to.
+bool ToRelativeNativePath(const std::string &path, xl::native_string &native_path);
+// Adds path, a native relative one, and every directory it is in to paths.
+void AddPathWithParents(xl::native_string path, std::unordered_set<xl::native_string> &paths);
+
+// Makes to_path a copy of from_path as cheaply as the file system allows: a reflink clone which shares data until either
+// is modified, else a hard link, else a real copy. from_path must not be modified in place afterwards.
+bool LinkOrCopyFile(const xl::native_string &from_path, const xl::native_string &to_path);
+// Like LinkOrCopyFile(), but never a hard link, to_path does not change with from_path afterwards.
+bool CloneOrCopyFile(const xl::native_string &from_path, const xl::native_string &to_path);
+
+// Returns name in the temp directory, a directory only the current user can access, created if missing. On posix
+// systems, where the temp directory may be shared by all users, the user id is appended to name, and an existing
+// directory is refused unless it is owned by the user. Returns an empty string on failure.
+xl::native_string GetPrivateTempDir(const xl::native_string &name);
+
+// Returns false for a file another user could have planted, i.e. one not owned by the current user. Always true on
+// Windows, where the temp directory is per user.
+bool IsOwnedByCurrentUser(const xl::native_string &path);
+
+// File opened for reading and writing at explicit offsets. ReadAt and WriteAt may be called from several threads at
+// the same time.
+class PositionalFile {
+public:
+  PositionalFile() = default;
+  ~PositionalFile();
+  PositionalFile(const PositionalFile &) = delete;
+  PositionalFile &operator=(const PositionalFile &) = delete;
+
+  // Opens an existing file without truncating it, or creates a new one. A read only file must exist.
+  bool Open(const xl::native_string &path, bool read_only = false);
+  void Close();
+
+  bool WriteAt(unsigned long long offset, const void *data, size_t size);
+  // Returns the number of bytes read, which is less than size only at the end of file or on error.
+  size_t ReadAt(unsigned long long offset, void *data, size_t size);
+  bool Sync();
+  // See ReserveFileSpace().
+  bool Reserve(unsigned long long size);
+  // Copies size bytes at offset to to_offset of to without passing them through user space, with copy_file_range,
+  // which may also share the blocks on file systems with reflinks, or sendfile. Returns the number of bytes copied,
+  // which is 0 where neither is available, the caller writes the rest itself.
+  unsigned long long CopyTo(unsigned long long offset,
+                            unsigned long long size,
+                            PositionalFile &to,
+                            unsigned long long to_offset);
+
+private:
+#ifdef _WIN32
+  void *handle_ = nullptr;
+#else
+  int fd_ = -1;
+#endif
+};
+
+// Exclusive advisory lock on a file, which is created if missing. Other processes, and other FileLock objects of this
+// process, can not take it until it is unlocked, or the process holding it exits.
+class FileLock {
+public:
+  FileLock() = default;
+  ~FileLock();
+  FileLock(const FileLock &) = delete;
+  FileLock &operator=(const FileLock &) = delete;
+
+  // Returns false at once if the lock is held elsewhere. The lock file is created for the current user only, unless
+  // shared, where other users must be able to lock it too.
+  bool TryLock(const xl::native_string &path, bool shared = false);
+  void Unlock();
+
+  bool locked() const;
+
+private:
+#ifdef _WIN32
+  void *handle_ = nullptr;
+#else
+  int fd_ = -1;
+#endif
+};
+
+// Whole file mapped read only into memory.
+class MappedFile {
+public:
+  MappedFile() = default;
+  ~MappedFile();
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  // Fails on empty files, and where the address space is too small for the file.
+  bool Open(const xl::native_string &path);
+  void Close();
+
+  const unsigned char *data() const {
+    return data_;
+  }
+  unsigned long long size() const {
+    return size_;
+  }
+
+private:
+  const unsigned char *data_ = nullptr;
+  unsigned long long size_ = 0;
+};
+
+} // namespace selfupdate
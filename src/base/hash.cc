@@ -0,0 +1,520 @@
+#include "hash.h"
+#include "../common.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <xl/scope_exit>
+
+namespace selfupdate {
+
+namespace {
+
+inline uint32_t Rotl32(uint32_t x, int n) {
+  return (x << n) | (x >> (32 - n));
+}
+
+inline uint32_t Rotr32(uint32_t x, int n) {
+  return (x >> n) | (x << (32 - n));
+}
+
+inline uint64_t Rotr64(uint64_t x, int n) {
+  return (x >> n) | (x << (64 - n));
+}
+
+template <typename Word>
+Word LoadBigEndian(const uint8_t *p) {
+  Word v = 0;
+  for (size_t i = 0; i < sizeof(Word); ++i) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+template <typename Word>
+Word LoadLittleEndian(const uint8_t *p) {
+  Word v = 0;
+  for (size_t i = sizeof(Word); i > 0; --i) {
+    v = (v << 8) | p[i - 1];
+  }
+  return v;
+}
+
+void AppendLittleEndian64(std::string &s, uint64_t v) {
+  for (int i = 0; i < 8; ++i) {
+    s.push_back((char)(v >> (i * 8)));
+  }
+}
+
+// Common padding/buffering of Merkle-Damgard hashes. DigestWords is the number of state words in the digest, which is
+// less than StateWords for the truncated variants (sha224, sha384).
+template <typename Word, size_t StateWords, size_t DigestWords, size_t BlockSize, bool BigEndian>
+class BlockHasher : public Hasher {
+public:
+  void Update(const void *data, size_t size) override {
+    const uint8_t *p = (const uint8_t *)data;
+    size_t buffered = (size_t)(count_ % BlockSize);
+    count_ += size;
+    if (buffered > 0) {
+      size_t n = std::min(size, BlockSize - buffered);
+      memcpy(buffer_ + buffered, p, n);
+      p += n;
+      size -= n;
+      if (buffered + n < BlockSize) {
+        return;
+      }
+      Transform(buffer_);
+    }
+    for (; size >= BlockSize; p += BlockSize, size -= BlockSize) {
+      Transform(p);
+    }
+    if (size > 0) {
+      memcpy(buffer_, p, size);
+    }
+  }
+
+  std::string Final() override {
+    // The message length is appended in bits. For 128-byte blocks the length field is 128 bits wide, its high part is
+    // always zero for any size we could count.
+    const size_t length_size = BlockSize / 8;
+    uint64_t bits = count_ << 3;
+    uint8_t padding[BlockSize * 2] = {0x80};
+    size_t buffered = (size_t)(count_ % BlockSize);
+    size_t padding_size = (buffered < BlockSize - length_size ? BlockSize : BlockSize * 2) - buffered;
+    uint8_t *length = padding + padding_size - length_size;
+    for (size_t i = 0; i < 8; ++i) {
+      length[BigEndian ? length_size - 1 - i : i] = (uint8_t)(bits >> (i * 8));
+    }
+    Update(padding, padding_size);
+
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(DigestWords * sizeof(Word) * 2);
+    for (size_t i = 0; i < DigestWords; ++i) {
+      for (size_t j = 0; j < sizeof(Word); ++j) {
+        size_t shift = BigEndian ? (sizeof(Word) - 1 - j) * 8 : j * 8;
+        uint8_t b = (uint8_t)(h_[i] >> shift);
+        hex.push_back(HEX_DIGITS[b >> 4]);
+        hex.push_back(HEX_DIGITS[b & 0x0f]);
+      }
+    }
+    return hex;
+  }
+
+  std::string SaveState() const override {
+    std::string state;
+    for (size_t i = 0; i < StateWords; ++i) {
+      AppendLittleEndian64(state, h_[i]);
+    }
+    AppendLittleEndian64(state, count_);
+    state.append((const char *)buffer_, (size_t)(count_ % BlockSize));
+    return state;
+  }
+
+  bool LoadState(const std::string &state) override {
+    const size_t fixed_size = (StateWords + 1) * 8;
+    if (state.size() < fixed_size) {
+      return false;
+    }
+    const uint8_t *p = (const uint8_t *)state.data();
+    Word h[StateWords];
+    for (size_t i = 0; i < StateWords; ++i) {
+      h[i] = (Word)LoadLittleEndian<uint64_t>(p + i * 8);
+    }
+    uint64_t count = LoadLittleEndian<uint64_t>(p + StateWords * 8);
+    if (state.size() - fixed_size != count % BlockSize) {
+      return false;
+    }
+    memcpy(h_, h, sizeof(h_));
+    count_ = count;
+    memcpy(buffer_, p + fixed_size, state.size() - fixed_size);
+    return true;
+  }
+
+protected:
+  virtual void Transform(const uint8_t *block) = 0;
+
+  Word h_[StateWords] = {};
+  uint64_t count_ = 0;
+  uint8_t buffer_[BlockSize] = {};
+};
+
+class Md5Hasher : public BlockHasher<uint32_t, 4, 4, 64, false> {
+public:
+  Md5Hasher() {
+    h_[0] = 0x67452301;
+    h_[1] = 0xefcdab89;
+    h_[2] = 0x98badcfe;
+    h_[3] = 0x10325476;
+  }
+
+protected:
+  void Transform(const uint8_t *block) override {
+    static const uint32_t K[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+    };
+    static const int R[64] = {
+        7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 5, 9,  14, 20, 5, 9,  14, 20, 5, 9,  14, 20,
+        5, 9,  14, 20, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 6, 10, 15, 21, 6, 10, 15, 21,
+        6, 10, 15, 21, 6, 10, 15, 21,
+    };
+    uint32_t m[16];
+    for (int i = 0; i < 16; ++i) {
+      m[i] = LoadLittleEndian<uint32_t>(block + i * 4);
+    }
+    uint32_t a = h_[0], b = h_[1], c = h_[2], d = h_[3];
+    for (int i = 0; i < 64; ++i) {
+      uint32_t f;
+      int g;
+      if (i < 16) {
+        f = (b & c) | (~b & d);
+        g = i;
+      } else if (i < 32) {
+        f = (d & b) | (~d & c);
+        g = (5 * i + 1) % 16;
+      } else if (i < 48) {
+        f = b ^ c ^ d;
+        g = (3 * i + 5) % 16;
+      } else {
+        f = c ^ (b | ~d);
+        g = (7 * i) % 16;
+      }
+      uint32_t t = d;
+      d = c;
+      c = b;
+      b = b + Rotl32(a + f + K[i] + m[g], R[i]);
+      a = t;
+    }
+    h_[0] += a;
+    h_[1] += b;
+    h_[2] += c;
+    h_[3] += d;
+  }
+};
+
+class Sha1Hasher : public BlockHasher<uint32_t, 5, 5, 64, true> {
+public:
+  Sha1Hasher() {
+    h_[0] = 0x67452301;
+    h_[1] = 0xefcdab89;
+    h_[2] = 0x98badcfe;
+    h_[3] = 0x10325476;
+    h_[4] = 0xc3d2e1f0;
+  }
+
+protected:
+  void Transform(const uint8_t *block) override {
+    uint32_t w[80];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = LoadBigEndian<uint32_t>(block + i * 4);
+    }
+    for (int i = 16; i < 80; ++i) {
+      w[i] = Rotl32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a = h_[0], b = h_[1], c = h_[2], d = h_[3], e = h_[4];
+    for (int i = 0; i < 80; ++i) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5a827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ed9eba1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8f1bbcdc;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xca62c1d6;
+      }
+      uint32_t t = Rotl32(a, 5) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = Rotl32(b, 30);
+      b = a;
+      a = t;
+    }
+    h_[0] += a;
+    h_[1] += b;
+    h_[2] += c;
+    h_[3] += d;
+    h_[4] += e;
+  }
+};
+
+template <size_t DigestWords>
+class Sha256Hasher : public BlockHasher<uint32_t, 8, DigestWords, 64, true> {
+public:
+  Sha256Hasher() {
+    static const uint32_t SHA224_IV[8] = {
+        0xc1059ed8, 0x367cd507, 0x3070dd17, 0xf70e5939, 0xffc00b31, 0x68581511, 0x64f98fa7, 0xbefa4fa4,
+    };
+    static const uint32_t SHA256_IV[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(this->h_, DigestWords == 7 ? SHA224_IV : SHA256_IV, sizeof(this->h_));
+  }
+
+protected:
+  void Transform(const uint8_t *block) override {
+    static const uint32_t K[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = LoadBigEndian<uint32_t>(block + i * 4);
+    }
+    for (int i = 16; i < 64; ++i) {
+      uint32_t s0 = Rotr32(w[i - 15], 7) ^ Rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = Rotr32(w[i - 2], 17) ^ Rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t v[8];
+    memcpy(v, this->h_, sizeof(v));
+    for (int i = 0; i < 64; ++i) {
+      uint32_t s1 = Rotr32(v[4], 6) ^ Rotr32(v[4], 11) ^ Rotr32(v[4], 25);
+      uint32_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+      uint32_t t1 = v[7] + s1 + ch + K[i] + w[i];
+      uint32_t s0 = Rotr32(v[0], 2) ^ Rotr32(v[0], 13) ^ Rotr32(v[0], 22);
+      uint32_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+      uint32_t t2 = s0 + maj;
+      memmove(v + 1, v, sizeof(uint32_t) * 7);
+      v[4] += t1;
+      v[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; ++i) {
+      this->h_[i] += v[i];
+    }
+  }
+};
+
+template <size_t DigestWords>
+class Sha512Hasher : public BlockHasher<uint64_t, 8, DigestWords, 128, true> {
+public:
+  Sha512Hasher() {
+    static const uint64_t SHA384_IV[8] = {
+        0xcbbb9d5dc1059ed8ULL, 0x629a292a367cd507ULL, 0x9159015a3070dd17ULL, 0x152fecd8f70e5939ULL,
+        0x67332667ffc00b31ULL, 0x8eb44a8768581511ULL, 0xdb0c2e0d64f98fa7ULL, 0x47b5481dbefa4fa4ULL,
+    };
+    static const uint64_t SHA512_IV[8] = {
+        0x6a09e667f3bcc908ULL, 0xbb67ae8584caa73bULL, 0x3c6ef372fe94f82bULL, 0xa54ff53a5f1d36f1ULL,
+        0x510e527fade682d1ULL, 0x9b05688c2b3e6c1fULL, 0x1f83d9abfb41bd6bULL, 0x5be0cd19137e2179ULL,
+    };
+    memcpy(this->h_, DigestWords == 6 ? SHA384_IV : SHA512_IV, sizeof(this->h_));
+  }
+
+protected:
+  void Transform(const uint8_t *block) override {
+    static const uint64_t K[80] = {
+        0x428a2f98d728ae22ULL, 0x7137449123ef65cdULL, 0xb5c0fbcfec4d3b2fULL, 0xe9b5dba58189dbbcULL,
+        0x3956c25bf348b538ULL, 0x59f111f1b605d019ULL, 0x923f82a4af194f9bULL, 0xab1c5ed5da6d8118ULL,
+        0xd807aa98a3030242ULL, 0x12835b0145706fbeULL, 0x243185be4ee4b28cULL, 0x550c7dc3d5ffb4e2ULL,
+        0x72be5d74f27b896fULL, 0x80deb1fe3b1696b1ULL, 0x9bdc06a725c71235ULL, 0xc19bf174cf692694ULL,
+        0xe49b69c19ef14ad2ULL, 0xefbe4786384f25e3ULL, 0x0fc19dc68b8cd5b5ULL, 0x240ca1cc77ac9c65ULL,
+        0x2de92c6f592b0275ULL, 0x4a7484aa6ea6e483ULL, 0x5cb0a9dcbd41fbd4ULL, 0x76f988da831153b5ULL,
+        0x983e5152ee66dfabULL, 0xa831c66d2db43210ULL, 0xb00327c898fb213fULL, 0xbf597fc7beef0ee4ULL,
+        0xc6e00bf33da88fc2ULL, 0xd5a79147930aa725ULL, 0x06ca6351e003826fULL, 0x142929670a0e6e70ULL,
+        0x27b70a8546d22ffcULL, 0x2e1b21385c26c926ULL, 0x4d2c6dfc5ac42aedULL, 0x53380d139d95b3dfULL,
+        0x650a73548baf63deULL, 0x766a0abb3c77b2a8ULL, 0x81c2c92e47edaee6ULL, 0x92722c851482353bULL,
+        0xa2bfe8a14cf10364ULL, 0xa81a664bbc423001ULL, 0xc24b8b70d0f89791ULL, 0xc76c51a30654be30ULL,
+        0xd192e819d6ef5218ULL, 0xd69906245565a910ULL, 0xf40e35855771202aULL, 0x106aa07032bbd1b8ULL,
+        0x19a4c116b8d2d0c8ULL, 0x1e376c085141ab53ULL, 0x2748774cdf8eeb99ULL, 0x34b0bcb5e19b48a8ULL,
+        0x391c0cb3c5c95a63ULL, 0x4ed8aa4ae3418acbULL, 0x5b9cca4f7763e373ULL, 0x682e6ff3d6b2b8a3ULL,
+        0x748f82ee5defb2fcULL, 0x78a5636f43172f60ULL, 0x84c87814a1f0ab72ULL, 0x8cc702081a6439ecULL,
+        0x90befffa23631e28ULL, 0xa4506cebde82bde9ULL, 0xbef9a3f7b2c67915ULL, 0xc67178f2e372532bULL,
+        0xca273eceea26619cULL, 0xd186b8c721c0c207ULL, 0xeada7dd6cde0eb1eULL, 0xf57d4f7fee6ed178ULL,
+        0x06f067aa72176fbaULL, 0x0a637dc5a2c898a6ULL, 0x113f9804bef90daeULL, 0x1b710b35131c471bULL,
+        0x28db77f523047d84ULL, 0x32caab7b40c72493ULL, 0x3c9ebe0a15c9bebcULL, 0x431d67c49c100d4cULL,
+        0x4cc5d4becb3e42b6ULL, 0x597f299cfc657e2aULL, 0x5fcb6fab3ad6faecULL, 0x6c44198c4a475817ULL,
+    };
+    uint64_t w[80];
+    for (int i = 0; i < 16; ++i) {
+      w[i] = LoadBigEndian<uint64_t>(block + i * 8);
+    }
+    for (int i = 16; i < 80; ++i) {
+      uint64_t s0 = Rotr64(w[i - 15], 1) ^ Rotr64(w[i - 15], 8) ^ (w[i - 15] >> 7);
+      uint64_t s1 = Rotr64(w[i - 2], 19) ^ Rotr64(w[i - 2], 61) ^ (w[i - 2] >> 6);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint64_t v[8];
+    memcpy(v, this->h_, sizeof(v));
+    for (int i = 0; i < 80; ++i) {
+      uint64_t s1 = Rotr64(v[4], 14) ^ Rotr64(v[4], 18) ^ Rotr64(v[4], 41);
+      uint64_t ch = (v[4] & v[5]) ^ (~v[4] & v[6]);
+      uint64_t t1 = v[7] + s1 + ch + K[i] + w[i];
+      uint64_t s0 = Rotr64(v[0], 28) ^ Rotr64(v[0], 34) ^ Rotr64(v[0], 39);
+      uint64_t maj = (v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]);
+      uint64_t t2 = s0 + maj;
+      memmove(v + 1, v, sizeof(uint64_t) * 7);
+      v[4] += t1;
+      v[0] = t1 + t2;
+    }
+    for (int i = 0; i < 8; ++i) {
+      this->h_[i] += v[i];
+    }
+  }
+};
+
+template <typename T>
+std::unique_ptr<Hasher> CreateHasher() {
+  return std::unique_ptr<Hasher>(new T);
+}
+
+const HashAlgorithm HASH_ALGORITHMS[] = {
+    {PACKAGEINFO_PACKAGE_HASH_ALGO_MD5,    &CreateHasher<Md5Hasher>       },
+    {PACKAGEINFO_PACKAGE_HASH_ALGO_SHA1,   &CreateHasher<Sha1Hasher>      },
+    {PACKAGEINFO_PACKAGE_HASH_ALGO_SHA224, &CreateHasher<Sha256Hasher<7>> },
+    {PACKAGEINFO_PACKAGE_HASH_ALGO_SHA256, &CreateHasher<Sha256Hasher<8>> },
+    {PACKAGEINFO_PACKAGE_HASH_ALGO_SHA384, &CreateHasher<Sha512Hasher<6>> },
+    {PACKAGEINFO_PACKAGE_HASH_ALGO_SHA512, &CreateHasher<Sha512Hasher<8>> },
+};
+
+const size_t HASH_FILE_BUFFER_SIZE = 1024 * 1024;
+
+} // namespace
+
+const HashAlgorithm *FindHashAlgorithm(const std::string &name) {
+  for (const auto &algorithm : HASH_ALGORITHMS) {
+    if (name == algorithm.name) {
+      return &algorithm;
+    }
+  }
+  return nullptr;
+}
+
+bool MultiHasher::Init(const std::map<std::string, std::string> &expected_hashes) {
+  entries_.clear();
+  for (const auto &item : expected_hashes) {
+    const HashAlgorithm *algorithm = FindHashAlgorithm(item.first);
+    if (algorithm == nullptr) {
+      entries_.clear();
+      return false;
+    }
+    std::string expected = item.second;
+    std::transform(expected.begin(), expected.end(), expected.begin(), [](unsigned char c) {
+      return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+    });
+    entries_.push_back({algorithm, std::move(expected), algorithm->create()});
+  }
+  return true;
+}
+
+void MultiHasher::Reset() {
+  for (auto &entry : entries_) {
+    entry.hasher = entry.algorithm->create();
+  }
+}
+
+void MultiHasher::Update(const void *data, size_t size) {
+  // Buffers are at least a network chunk, reading the clock is cheap next to hashing them.
+  auto start = std::chrono::steady_clock::now();
+  for (auto &entry : entries_) {
+    entry.hasher->Update(data, size);
+    auto end = std::chrono::steady_clock::now();
+    entry.elapsed_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+    start = end;
+  }
+}
+
+void MultiHasher::AddElapsedMilliseconds(std::map<std::string, long long> &hash_ms) const {
+  for (const auto &entry : entries_) {
+    hash_ms[entry.algorithm->name] += entry.elapsed_ns / 1000000;
+  }
+}
+
+bool MultiHasher::Verify() {
+  bool ok = true;
+  for (auto &entry : entries_) {
+    if (entry.hasher->Final() != entry.expected) {
+      ok = false;
+    }
+  }
+  return ok;
+}
+
+// Layout: for each hasher, 1 byte name length, name, 4 bytes little endian state length, state.
+std::string MultiHasher::SaveState() const {
+  std::string state;
+  for (const auto &entry : entries_) {
+    std::string hasher_state = entry.hasher->SaveState();
+    state.push_back((char)strlen(entry.algorithm->name));
+    state.append(entry.algorithm->name);
+    for (int i = 0; i < 4; ++i) {
+      state.push_back((char)(hasher_state.size() >> (i * 8)));
+    }
+    state.append(hasher_state);
+  }
+  return state;
+}
+
+bool MultiHasher::LoadState(const std::string &state) {
+  size_t pos = 0;
+  for (auto &entry : entries_) {
+    if (pos + 1 > state.size()) {
+      return false;
+    }
+    size_t name_size = (unsigned char)state[pos++];
+    if (pos + name_size + 4 > state.size() || state.compare(pos, name_size, entry.algorithm->name) != 0) {
+      return false;
+    }
+    pos += name_size;
+    size_t hasher_state_size = LoadLittleEndian<uint32_t>((const uint8_t *)state.data() + pos);
+    pos += 4;
+    if (pos + hasher_state_size > state.size()) {
+      return false;
+    }
+    std::unique_ptr<Hasher> hasher = entry.algorithm->create();
+    if (!hasher->LoadState(state.substr(pos, hasher_state_size))) {
+      return false;
+    }
+    pos += hasher_state_size;
+    entry.hasher = std::move(hasher);
+  }
+  return pos == state.size();
+}
+
+bool HashFile(const xl::native_string &file, MultiHasher &hasher) {
+  FILE *f = _tfopen(file.c_str(), _T("rb"));
+  if (f == nullptr) {
+    return false;
+  }
+  XL_ON_BLOCK_EXIT(fclose, f);
+  std::unique_ptr<char[]> buffer(new char[HASH_FILE_BUFFER_SIZE]);
+  size_t size = 0;
+  while ((size = fread(buffer.get(), 1, HASH_FILE_BUFFER_SIZE, f)) > 0) {
+    hasher.Update(buffer.get(), size);
+  }
+  return ferror(f) == 0;
+}
+
+std::string HashFile(const xl::native_string &file, const HashAlgorithm &algorithm) {
+  FILE *f = _tfopen(file.c_str(), _T("rb"));
+  if (f == nullptr) {
+    return std::string();
+  }
+  XL_ON_BLOCK_EXIT(fclose, f);
+  std::unique_ptr<Hasher> hasher = algorithm.create();
+  std::unique_ptr<char[]> buffer(new char[HASH_FILE_BUFFER_SIZE]);
+  size_t size = 0;
+  while ((size = fread(buffer.get(), 1, HASH_FILE_BUFFER_SIZE, f)) > 0) {
+    hasher->Update(buffer.get(), size);
+  }
+  return ferror(f) == 0 ? hasher->Final() : std::string();
+}
+
+} // namespace selfupdate
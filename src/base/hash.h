@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// Incremental hasher. The internal state can be saved and restored, so that a hash computation could be continued
+// across process restarts, e.g. when resuming a download. xl::crypto only hashes a whole file or buffer in one call,
+// which can neither follow the bytes of a download as they arrive nor continue after a restart, hence the algorithms
+// implemented here.
+class Hasher {
+public:
+  virtual ~Hasher() = default;
+
+  virtual void Update(const void *data, size_t size) = 0;
+  // Returns the digest in lower case hex. The hasher must not be updated afterwards.
+  virtual std::string Final() = 0;
+
+  virtual std::string SaveState() const = 0;
+  virtual bool LoadState(const std::string &state) = 0;
+};
+
+struct HashAlgorithm {
+  const char *name;
+  std::unique_ptr<Hasher> (*create)();
+};
+
+// Returns nullptr if the algorithm is not supported.
+const HashAlgorithm *FindHashAlgorithm(const std::string &name);
+
+// Computes all hashes listed in a PackageInfo::package_hash in one pass.
+class MultiHasher {
+public:
+  // Returns false if any algorithm in expected_hashes is not supported.
+  bool Init(const std::map<std::string, std::string> &expected_hashes);
+  void Reset();
+
+  void Update(const void *data, size_t size);
+  // Finalizes all hashers and compares them with the expected values.
+  bool Verify();
+
+  std::string SaveState() const;
+  bool LoadState(const std::string &state);
+
+  // Adds the time spent in Update() by each algorithm since Init() to hash_ms.
+  void AddElapsedMilliseconds(std::map<std::string, long long> &hash_ms) const;
+
+private:
+  struct Entry {
+    const HashAlgorithm *algorithm;
+    std::string expected;
+    std::unique_ptr<Hasher> hasher;
+    long long elapsed_ns = 0;
+  };
+  std::vector<Entry> entries_;
+};
+
+// Feeds the whole content of file into hasher, reading the file only once.
+bool HashFile(const xl::native_string &file, MultiHasher &hasher);
+// Returns the digest of file with algorithm in lower case hex, or an empty string if the file can not be read.
+std::string HashFile(const xl::native_string &file, const HashAlgorithm &algorithm);
+
+} // namespace selfupdate
@@ -0,0 +1,169 @@
+#include "process_handoff.h"
+#include <algorithm>
+#include <xl/file>
+#include <xl/log>
+#include <xl/process>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#endif
+
+namespace selfupdate {
+
+namespace {
+
+const int HANDOFF_POLL_MIN_MS = 1;
+const int HANDOFF_POLL_MAX_MS = 50;
+
+#ifdef _WIN32
+HANDLE g_handoff_event = nullptr;
+#else
+int g_handoff_fd = -1;
+#endif
+
+} // namespace
+
+#ifdef _WIN32
+
+xl::native_string OpenHandoffChannel(const xl::native_string &path) {
+  // Only has to be unique. GetTickCount() rather than GetTickCount64(), which XP does not have.
+  static unsigned channel_count = 0;
+  xl::native_string name = _T("Local\\selfupdate-handoff-") + xl::to_native_string(xl::process::pid()) + _T("-") +
+                           xl::to_native_string(::GetTickCount()) + _T("-") + xl::to_native_string(++channel_count);
+  HANDLE event = ::CreateEvent(nullptr, TRUE, FALSE, name.c_str());
+  if (event == nullptr) {
+    XL_LOG_WARN("Create handoff event error: ", ::GetLastError());
+    return xl::native_string();
+  }
+  if (g_handoff_event != nullptr) {
+    ::CloseHandle(g_handoff_event);
+  }
+  g_handoff_event = event;
+  return name;
+}
+
+void SignalHandoffChannel() {
+  if (g_handoff_event != nullptr) {
+    ::SetEvent(g_handoff_event);
+  }
+}
+
+void WaitForHandoff(int pid, const xl::native_string &channel, bool &released) {
+  released = false;
+  HANDLE process = ::OpenProcess(SYNCHRONIZE, FALSE, (DWORD)pid);
+  if (process == nullptr) {
+    // Gone already.
+    return;
+  }
+  HANDLE handles[2] = {process, nullptr};
+  DWORD count = 1;
+  if (!channel.empty()) {
+    handles[1] = ::OpenEvent(SYNCHRONIZE, FALSE, channel.c_str());
+    if (handles[1] != nullptr) {
+      count = 2;
+    }
+  }
+  released = ::WaitForMultipleObjects(count, handles, FALSE, INFINITE) == WAIT_OBJECT_0 + 1;
+  for (DWORD i = 0; i < count; ++i) {
+    ::CloseHandle(handles[i]);
+  }
+}
+
+#else
+
+xl::native_string OpenHandoffChannel(const xl::native_string &path) {
+  unlink(path.c_str());
+  if (mkfifo(path.c_str(), S_IRUSR | S_IWUSR) != 0) {
+    XL_LOG_WARN("Create handoff FIFO error: ", path, ", errno: ", errno);
+    return xl::native_string();
+  }
+  // Opened for reading too, so that neither open blocks, and the signal waits in the FIFO until the installer reads
+  // it. Not inherited by the installer, or it would hold the channel open itself.
+  int fd = open(path.c_str(), O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    XL_LOG_WARN("Open handoff FIFO error: ", path, ", errno: ", errno);
+    unlink(path.c_str());
+    return xl::native_string();
+  }
+  if (g_handoff_fd >= 0) {
+    close(g_handoff_fd);
+  }
+  g_handoff_fd = fd;
+  return path;
+}
+
+void SignalHandoffChannel() {
+  if (g_handoff_fd >= 0) {
+    char c = 1;
+    if (write(g_handoff_fd, &c, 1) != 1) {
+      XL_LOG_WARN("Signal handoff FIFO error, errno: ", errno);
+    }
+  }
+}
+
+void WaitForHandoff(int pid, const xl::native_string &channel, bool &released) {
+  released = false;
+  int channel_fd = -1;
+  if (!channel.empty()) {
+    channel_fd = open(channel.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    // Both ends hold it open from here.
+    unlink(channel.c_str());
+  }
+  int pid_fd = -1;
+#if defined(__linux__) && defined(SYS_pidfd_open)
+  pid_fd = (int)syscall(SYS_pidfd_open, (pid_t)pid, 0);
+  if (pid_fd < 0 && errno == ESRCH) {
+    if (channel_fd >= 0) {
+      close(channel_fd);
+    }
+    return;
+  }
+#endif
+
+  struct pollfd fds[2] = {};
+  nfds_t count = 0;
+  if (pid_fd >= 0) {
+    fds[count++] = {pid_fd, POLLIN, 0};
+  }
+  if (channel_fd >= 0) {
+    fds[count++] = {channel_fd, POLLIN, 0};
+  }
+  // Without a pidfd, the process is checked between polls of the channel, a little less often each time.
+  int interval_ms = HANDOFF_POLL_MIN_MS;
+  for (;;) {
+    int ready = poll(fds, count, pid_fd >= 0 ? -1 : interval_ms);
+    if (ready < 0 && errno != EINTR) {
+      XL_LOG_WARN("Poll handoff error, errno: ", errno);
+      xl::process::wait(pid);
+      break;
+    }
+    char c = 0;
+    if (channel_fd >= 0 && (fds[count - 1].revents & POLLIN) != 0 && read(channel_fd, &c, 1) == 1) {
+      released = true;
+      break;
+    }
+    if (pid_fd >= 0 ? (fds[0].revents & POLLIN) != 0 : xl::process::wait(pid, 0)) {
+      break;
+    }
+    interval_ms = std::min(interval_ms * 2, HANDOFF_POLL_MAX_MS);
+  }
+  if (pid_fd >= 0) {
+    close(pid_fd);
+  }
+  if (channel_fd >= 0) {
+    close(channel_fd);
+  }
+}
+
+#endif
+
+} // namespace selfupdate
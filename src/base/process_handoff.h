@@ -0,0 +1,22 @@
+#pragma once
+
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// The main process and the installer it starts share a handoff channel, through which the main process tells the
+// installer that it no longer holds files in the installation, so that the installer does not have to wait for it to
+// exit. A named event on Windows, a FIFO at a path next to the package elsewhere.
+
+// Main process side, called before starting the installer. path is where the FIFO goes, unused on Windows. Returns the
+// channel to pass to the installer, empty if it could not be created. The channel stays open until the process exits.
+xl::native_string OpenHandoffChannel(const xl::native_string &path);
+// Main process side. Does nothing without an open channel.
+void SignalHandoffChannel();
+
+// Installer side. Returns as soon as process pid exits, or signals through channel, which may be empty. released is
+// set to whether it was the signal. Waits for the exit with pidfd_open() on Linux and the process handle on Windows,
+// and falls back to short, growing polls where those are not available.
+void WaitForHandoff(int pid, const xl::native_string &channel, bool &released);
+
+} // namespace selfupdate
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <chrono>
+
+namespace selfupdate {
+
+// Measures wall time on the monotonic clock, from construction or the last Restart().
+class Stopwatch {
+public:
+  Stopwatch() : start_(std::chrono::steady_clock::now()) {
+  }
+
+  void Restart() {
+    start_ = std::chrono::steady_clock::now();
+  }
+  long long ElapsedMilliseconds() const {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start_).count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+} // namespace selfupdate
@@ -0,0 +1,465 @@
+#include "tar_extractor.h"
+#include "file_util.h"
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <xl/file>
+#include <xl/log>
+#include <xl/scope_exit>
+#include <zstd.h>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace selfupdate {
+
+namespace {
+
+const size_t TAR_BLOCK_SIZE = 512;
+const size_t DECOMPRESSED_BLOCK_SIZE = 1024 * 1024;
+// Bounds the memory held between the two threads.
+const size_t MAX_QUEUED_BLOCK_COUNT = 8;
+// The largest window zstd allows, what "--long=31" and "--ultra -22 --long" write on 64 bits systems.
+const int MAX_WINDOW_LOG = sizeof(size_t) == 8 ? 31 : 30;
+
+const char TAR_TYPE_FILE = '0';
+const char TAR_TYPE_OLD_FILE = '\0';
+const char TAR_TYPE_HARD_LINK = '1';
+const char TAR_TYPE_SYMLINK = '2';
+const char TAR_TYPE_DIRECTORY = '5';
+const char TAR_TYPE_CONTIGUOUS_FILE = '7';
+const char TAR_TYPE_GNU_LONG_NAME = 'L';
+const char TAR_TYPE_GNU_LONG_LINK = 'K';
+const char TAR_TYPE_PAX_HEADER = 'x';
+
+// Decompressed blocks, from the decompressing thread to the extracting one. Either side may close it to stop the
+// other.
+class BlockQueue {
+public:
+  // Returns false if the consumer has given up.
+  bool Push(std::string block) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this]() {
+      return closed_ || blocks_.size() < MAX_QUEUED_BLOCK_COUNT;
+    });
+    if (closed_) {
+      return false;
+    }
+    blocks_.push_back(std::move(block));
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // Returns false when the queue is closed and empty.
+  bool Pop(std::string &block) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this]() {
+      return closed_ || !blocks_.empty();
+    });
+    if (blocks_.empty()) {
+      return false;
+    }
+    block = std::move(blocks_.front());
+    blocks_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  // Called by the producer when done, succeeded tells whether the whole package was decompressed, or by the consumer to
+  // stop the producer.
+  void Close(bool succeeded) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    succeeded_ = succeeded;
+    not_empty_.notify_all();
+    not_full_.notify_all();
+  }
+
+  bool succeeded() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return succeeded_;
+  }
+
+private:
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+  std::deque<std::string> blocks_;
+  bool closed_ = false;
+  bool succeeded_ = false;
+};
+
+void Decompress(FILE *f, BlockQueue &queue) {
+  ZSTD_DCtx *dctx = ZSTD_createDCtx();
+  if (dctx == nullptr) {
+    XL_LOG_ERROR("Create zstd decompression context failed.");
+    queue.Close(false);
+    return;
+  }
+  XL_ON_BLOCK_EXIT(ZSTD_freeDCtx, dctx);
+  ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, MAX_WINDOW_LOG);
+  size_t input_size = ZSTD_DStreamInSize();
+  std::unique_ptr<char[]> input(new char[input_size]);
+  // 0 once a frame is complete, the package may hold several frames.
+  size_t frame_pending = 0;
+  size_t read = 0;
+  while ((read = fread(input.get(), 1, input_size, f)) > 0) {
+    ZSTD_inBuffer in = {input.get(), read, 0};
+    bool output_full = false;
+    while (in.pos < in.size || output_full) {
+      std::string block(DECOMPRESSED_BLOCK_SIZE, '\0');
+      ZSTD_outBuffer out = {&block[0], block.size(), 0};
+      frame_pending = ZSTD_decompressStream(dctx, &out, &in);
+      if (ZSTD_isError(frame_pending)) {
+        XL_LOG_ERROR("Decompress package error: ", ZSTD_getErrorName(frame_pending));
+        queue.Close(false);
+        return;
+      }
+      output_full = out.pos == out.size;
+      block.resize(out.pos);
+      if (!block.empty() && !queue.Push(std::move(block))) {
+        return;
+      }
+    }
+  }
+  if (ferror(f) != 0 || frame_pending != 0) {
+    XL_LOG_ERROR("Package truncated or unreadable.");
+    queue.Close(false);
+    return;
+  }
+  queue.Close(true);
+}
+
+// Reads the decompressed stream as it comes out of the queue.
+class QueueReader {
+public:
+  explicit QueueReader(BlockQueue &queue) : queue_(queue) {
+  }
+
+  bool Read(void *data, size_t size) {
+    char *p = (char *)data;
+    while (size > 0) {
+      if (!Fill()) {
+        return false;
+      }
+      size_t n = std::min(size, block_.size() - pos_);
+      memcpy(p, block_.data() + pos_, n);
+      p += n;
+      pos_ += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  bool CopyTo(FILE *f, unsigned long long size) {
+    while (size > 0) {
+      if (!Fill()) {
+        return false;
+      }
+      size_t n = (size_t)std::min((unsigned long long)(block_.size() - pos_), size);
+      if (fwrite(block_.data() + pos_, 1, n, f) != n) {
+        return false;
+      }
+      pos_ += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  bool Skip(unsigned long long size) {
+    while (size > 0) {
+      if (!Fill()) {
+        return false;
+      }
+      size_t n = (size_t)std::min((unsigned long long)(block_.size() - pos_), size);
+      pos_ += n;
+      size -= n;
+    }
+    return true;
+  }
+
+  // Reads to the end, which is only padding after the end of archive blocks, and tells whether the whole package was
+  // decompressed.
+  bool Finish() {
+    while (queue_.Pop(block_)) {
+    }
+    return queue_.succeeded();
+  }
+
+private:
+  bool Fill() {
+    while (pos_ == block_.size()) {
+      if (!queue_.Pop(block_)) {
+        return false;
+      }
+      pos_ = 0;
+    }
+    return true;
+  }
+
+  BlockQueue &queue_;
+  std::string block_;
+  size_t pos_ = 0;
+};
+
+// Octal, NUL or space terminated, or base-256 with the high bit of the first byte set, for GNU large sizes.
+unsigned long long ParseTarNumber(const char *field, size_t size) {
+  unsigned long long value = 0;
+  if (((unsigned char)field[0] & 0x80) != 0) {
+    for (size_t i = 1; i < size; ++i) {
+      value = (value << 8) | (unsigned char)field[i];
+    }
+    return value;
+  }
+  size_t i = 0;
+  while (i < size && field[i] == ' ') {
+    ++i;
+  }
+  for (; i < size && field[i] >= '0' && field[i] <= '7'; ++i) {
+    value = value * 8 + (unsigned long long)(field[i] - '0');
+  }
+  return value;
+}
+
+std::string GetTarString(const char *field, size_t size) {
+  return std::string(field, strnlen(field, size));
+}
+
+bool CheckTarHeader(const char *header) {
+  unsigned long long sum = 0;
+  for (size_t i = 0; i < TAR_BLOCK_SIZE; ++i) {
+    // The checksum field counts as spaces.
+    sum += (i >= 148 && i < 156) ? ' ' : (unsigned char)header[i];
+  }
+  return sum == ParseTarNumber(header + 148, 8);
+}
+
+// "<length> <key>=<value>\n" records.
+void ParsePaxRecords(const std::string &records, std::string &path, std::string &link_path) {
+  for (size_t pos = 0; pos < records.size();) {
+    size_t space = records.find(' ', pos);
+    size_t length = (size_t)atoll(records.c_str() + pos);
+    if (space == std::string::npos || length == 0 || pos + length > records.size()) {
+      return;
+    }
+    std::string record = records.substr(space + 1, pos + length - space - 2);
+    size_t equal = record.find('=');
+    if (equal != std::string::npos) {
+      std::string key = record.substr(0, equal);
+      if (key == "path") {
+        path = record.substr(equal + 1);
+      } else if (key == "linkpath") {
+        link_path = record.substr(equal + 1);
+      }
+    }
+    pos += length;
+  }
+}
+
+// Archives made with "tar -C dir ." name their entries "./...".
+std::string NormalizeTarPath(std::string path) {
+  while (path.compare(0, 2, "./") == 0) {
+    path.erase(0, 2);
+  }
+  while (!path.empty() && path.back() == '/') {
+    path.pop_back();
+  }
+  return path == "." ? std::string() : path;
+}
+
+class TarExtractor {
+public:
+  TarExtractor(QueueReader &reader,
+               const xl::native_string &target_dir,
+               std::unordered_set<xl::native_string> *extracted_paths)
+      : reader_(reader), target_dir_(target_dir), extracted_paths_(extracted_paths) {
+  }
+
+  bool Extract() {
+    char header[TAR_BLOCK_SIZE];
+    std::string long_name, long_link;
+    for (;;) {
+      if (!reader_.Read(header, sizeof(header))) {
+        XL_LOG_ERROR("Unexpected end of tar archive.");
+        return false;
+      }
+      static const char zero_block[TAR_BLOCK_SIZE] = {};
+      if (memcmp(header, zero_block, sizeof(header)) == 0) {
+        break;
+      }
+      if (!CheckTarHeader(header)) {
+        XL_LOG_ERROR("Bad tar header checksum.");
+        return false;
+      }
+      std::string name = GetTarString(header, 100);
+      if (memcmp(header + 257, "ustar", 5) == 0 && header[345] != 0) {
+        name = GetTarString(header + 345, 155) + "/" + name;
+      }
+      std::string link = GetTarString(header + 157, 100);
+      unsigned mode = (unsigned)ParseTarNumber(header + 100, 8);
+      unsigned long long size = ParseTarNumber(header + 124, 12);
+      unsigned long long padding = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+      char type = header[156];
+
+      if (type == TAR_TYPE_GNU_LONG_NAME || type == TAR_TYPE_GNU_LONG_LINK || type == TAR_TYPE_PAX_HEADER) {
+        // Applies to the next entry.
+        std::string data((size_t)size, '\0');
+        if (!reader_.Read(&data[0], data.size()) || !reader_.Skip(padding)) {
+          return false;
+        }
+        if (type == TAR_TYPE_PAX_HEADER) {
+          ParsePaxRecords(data, long_name, long_link);
+        } else {
+          (type == TAR_TYPE_GNU_LONG_NAME ? long_name : long_link) = data.c_str();
+        }
+        continue;
+      }
+      if (!long_name.empty()) {
+        name = std::move(long_name);
+      }
+      if (!long_link.empty()) {
+        link = std::move(long_link);
+      }
+      long_name.clear();
+      long_link.clear();
+
+      if (!ExtractEntry(NormalizeTarPath(name), type, mode, size, link) || !reader_.Skip(padding)) {
+        return false;
+      }
+    }
+
+#ifndef _WIN32
+    for (const auto &item : symlinks_) {
+      if (symlink(item.second.c_str(), item.first.c_str()) != 0) {
+        XL_LOG_ERROR("Create symlink error: ", item.first);
+        return false;
+      }
+    }
+#endif
+    return true;
+  }
+
+  unsigned long long entry_count() const {
+    return entry_count_;
+  }
+
+private:
+  // Consumes the data of the entry, not the padding after it.
+  bool ExtractEntry(const std::string &name,
+                    char type,
+                    unsigned mode,
+                    unsigned long long size,
+                    const std::string &link) {
+    bool is_file = type == TAR_TYPE_FILE || type == TAR_TYPE_OLD_FILE || type == TAR_TYPE_CONTIGUOUS_FILE;
+    if (name.empty()) {
+      return reader_.Skip(size);
+    }
+    xl::native_string native_path;
+    if (!ToRelativeNativePath(name, native_path)) {
+      XL_LOG_ERROR("Invalid tar entry name: ", name);
+      return false;
+    }
+    xl::native_string path = xl::path::join(target_dir_, native_path);
+    if (type == TAR_TYPE_DIRECTORY) {
+      xl::fs::mkdirs(path.c_str());
+      AddPath(native_path);
+      return reader_.Skip(size);
+    }
+    if (!is_file && type != TAR_TYPE_HARD_LINK && type != TAR_TYPE_SYMLINK) {
+      XL_LOG_WARN("Tar entry skipped: ", name, ", type: ", (int)type);
+      return reader_.Skip(size);
+    }
+    xl::fs::mkdirs(xl::path::dirname(path.c_str()).c_str());
+    AddPath(native_path);
+
+    if (type == TAR_TYPE_SYMLINK) {
+#ifdef _WIN32
+      XL_LOG_WARN("Symlink skipped: ", name);
+#else
+      symlinks_.push_back({path, link});
+#endif
+      return reader_.Skip(size);
+    }
+    if (type == TAR_TYPE_HARD_LINK) {
+      xl::native_string native_link;
+      if (!ToRelativeNativePath(NormalizeTarPath(link), native_link) ||
+          !LinkOrCopyFile(xl::path::join(target_dir_, native_link), path)) {
+        XL_LOG_ERROR("Create hard link error: ", name, ", to: ", link);
+        return false;
+      }
+      return reader_.Skip(size);
+    }
+
+    FILE *f = _tfopen(path.c_str(), _T("wb"));
+    if (f == nullptr) {
+      XL_LOG_ERROR("Create file error: ", path);
+      return false;
+    }
+    bool written = reader_.CopyTo(f, size);
+#ifndef _WIN32
+    if (written && (mode & 0777) != 0) {
+      fchmod(fileno(f), mode & 07777);
+    }
+#endif
+    written = fclose(f) == 0 && written;
+    if (!written) {
+      XL_LOG_ERROR("Write file error: ", path);
+    }
+    return written;
+  }
+
+  void AddPath(const xl::native_string &native_path) {
+    ++entry_count_;
+    if (extracted_paths_ != nullptr) {
+      AddPathWithParents(native_path, *extracted_paths_);
+    }
+  }
+
+  QueueReader &reader_;
+  xl::native_string target_dir_;
+  std::unordered_set<xl::native_string> *extracted_paths_;
+  std::vector<std::pair<xl::native_string, std::string>> symlinks_;
+  unsigned long long entry_count_ = 0;
+};
+
+} // namespace
+
+bool ExtractTarZstd(const xl::native_string &package_file,
+                    const xl::native_string &target_dir,
+                    std::unordered_set<xl::native_string> *extracted_paths,
+                    unsigned long long *entry_count) {
+  FILE *f = _tfopen(package_file.c_str(), _T("rb"));
+  if (f == nullptr) {
+    XL_LOG_ERROR("Open package error: ", package_file);
+    return false;
+  }
+  XL_ON_BLOCK_EXIT(fclose, f);
+  xl::fs::mkdirs(target_dir.c_str());
+
+  BlockQueue queue;
+  std::thread decompressor(Decompress, f, std::ref(queue));
+  QueueReader reader(queue);
+  TarExtractor extractor(reader, target_dir, extracted_paths);
+  bool extracted = extractor.Extract();
+  if (!extracted) {
+    queue.Close(false);
+  }
+  extracted = reader.Finish() && extracted;
+  decompressor.join();
+  if (entry_count != nullptr) {
+    *entry_count = extractor.entry_count();
+  }
+  return extracted;
+}
+
+} // namespace selfupdate
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <unordered_set>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// Extracts a Zstandard compressed tar archive, "tar.zst", into target_dir.
+//
+// Zstandard can not decompress one frame on several threads, so the package is decompressed on a thread of its own,
+// which hands blocks to the calling thread to parse the archive and write the files, and both run at the same time.
+// Frames compressed with a long window, as by "zstd --long=31", are accepted.
+//
+// ustar and GNU archives are understood, with GNU long names and pax path records. Regular files, directories, hard
+// links and, on posix systems, symlinks are extracted, with their unix modes. Other entries are skipped. Symlinks are
+// created last, so that no entry can be written through one.
+//
+// extracted_paths, if not null, receives the relative native paths of all entries and their parent directories.
+// entry_count, if not null, receives the number of entries extracted.
+bool ExtractTarZstd(const xl::native_string &package_file,
+                    const xl::native_string &target_dir,
+                    std::unordered_set<xl::native_string> *extracted_paths = nullptr,
+                    unsigned long long *entry_count = nullptr);
+
+} // namespace selfupdate
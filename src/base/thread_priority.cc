@@ -0,0 +1,52 @@
+#include "thread_priority.h"
+#include <xl/log>
+
+#ifdef _WIN32
+#include <Windows.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#include <sys/resource.h>
+#elif defined(__linux__)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace selfupdate {
+
+namespace {
+
+#ifdef __linux__
+// From linux/ioprio.h, which not every libc ships.
+const int IOPRIO_CLASS_IDLE = 3;
+const int IOPRIO_CLASS_SHIFT = 13;
+const int IOPRIO_WHO_PROCESS = 1;
+#endif
+
+} // namespace
+
+void SetBackgroundThreadPriority() {
+#if defined(_WIN32) && _WIN32_WINNT >= 0x0600
+  // Lowers I/O and memory priority along with the CPU one.
+  if (!::SetThreadPriority(::GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN)) {
+    XL_LOG_WARN("Set background thread priority failed, error: ", ::GetLastError());
+  }
+#elif defined(_WIN32)
+  // Background mode is only there since Vista, the CPU priority is all that can be lowered.
+  if (!::SetThreadPriority(::GetCurrentThread(), THREAD_PRIORITY_IDLE)) {
+    XL_LOG_WARN("Set background thread priority failed, error: ", ::GetLastError());
+  }
+#elif defined(__APPLE__)
+  pthread_set_qos_class_self_np(QOS_CLASS_BACKGROUND, 0);
+  setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD, IOPOL_THROTTLE);
+#elif defined(__linux__)
+  // Both apply to the thread alone when given its id.
+  pid_t tid = (pid_t)syscall(SYS_gettid);
+  setpriority(PRIO_PROCESS, (id_t)tid, 19);
+  if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT) != 0) {
+    XL_LOG_WARN("Set idle I/O priority failed.");
+  }
+#endif
+}
+
+} // namespace selfupdate
@@ -0,0 +1,10 @@
+#pragma once
+
+namespace selfupdate {
+
+// Gives the calling thread background CPU and I/O priority, so that its work only uses what the rest of the system
+// leaves. Threads it creates afterwards inherit that on Linux only, elsewhere they must call it too. Can not be undone
+// without privileges on posix systems, meant for threads started for that work.
+void SetBackgroundThreadPriority();
+
+} // namespace selfupdate
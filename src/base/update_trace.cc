@@ -0,0 +1,126 @@
+#include "update_trace.h"
+#include <cstdio>
+#include <sstream>
+#include <xl/json>
+#include <xl/log>
+
+namespace selfupdate {
+
+namespace {
+
+typedef std::vector<unsigned long long> SampleVector;
+typedef std::vector<SampleVector> SampleVectorVector;
+typedef std::map<std::string, long long> DurationMap;
+
+XL_JSON_BEGIN(UpdateTraceInternal)
+  XL_JSON_MEMBER(long long, query_ms)
+  XL_JSON_MEMBER(bool, query_from_cache)
+  XL_JSON_MEMBER(bool, query_not_modified)
+  XL_JSON_MEMBER(long long, download_first_byte_ms)
+  XL_JSON_MEMBER(long long, download_ms)
+  XL_JSON_MEMBER(unsigned long long, bytes_resumed)
+  XL_JSON_MEMBER(unsigned long long, bytes_fetched)
+  XL_JSON_MEMBER(SampleVectorVector, throughput)
+  XL_JSON_MEMBER(DurationMap, hash_ms)
+  XL_JSON_MEMBER(long long, stage_ms)
+  XL_JSON_MEMBER(long long, extract_ms)
+  XL_JSON_MEMBER(unsigned long long, extracted_entries)
+  XL_JSON_MEMBER(unsigned, rename_retries)
+  XL_JSON_MEMBER(long long, downtime_ms)
+  XL_JSON_MEMBER(bool, files_released)
+XL_JSON_END()
+
+// Algorithm names are the only strings, characters that would need escaping are left out.
+void WriteJsonString(std::ostringstream &ss, const std::string &value) {
+  ss << '"';
+  for (char c : value) {
+    if (c == '"' || c == '\\' || (unsigned char)c < 0x20) {
+      continue;
+    }
+    ss << c;
+  }
+  ss << '"';
+}
+
+} // namespace
+
+bool WriteUpdateTrace(const xl::native_string &trace_file, const UpdateMetrics &metrics) {
+  std::ostringstream ss;
+  ss << "{\"query_ms\":" << metrics.query_ms;
+  ss << ",\"query_from_cache\":" << (metrics.query_from_cache ? "true" : "false");
+  ss << ",\"query_not_modified\":" << (metrics.query_not_modified ? "true" : "false");
+  ss << ",\"download_first_byte_ms\":" << metrics.download_first_byte_ms;
+  ss << ",\"download_ms\":" << metrics.download_ms;
+  ss << ",\"bytes_resumed\":" << metrics.bytes_resumed;
+  ss << ",\"bytes_fetched\":" << metrics.bytes_fetched;
+  ss << ",\"throughput\":[";
+  for (size_t i = 0; i < metrics.throughput.size(); ++i) {
+    ss << (i > 0 ? "," : "") << '[' << metrics.throughput[i].elapsed_ms << ','
+       << metrics.throughput[i].downloaded_bytes << ']';
+  }
+  ss << "],\"hash_ms\":{";
+  for (auto it = metrics.hash_ms.begin(); it != metrics.hash_ms.end(); ++it) {
+    ss << (it != metrics.hash_ms.begin() ? "," : "");
+    WriteJsonString(ss, it->first);
+    ss << ':' << it->second;
+  }
+  ss << "},\"stage_ms\":" << metrics.stage_ms;
+  ss << ",\"extract_ms\":" << metrics.extract_ms;
+  ss << ",\"extracted_entries\":" << metrics.extracted_entries;
+  ss << ",\"rename_retries\":" << metrics.rename_retries;
+  ss << ",\"downtime_ms\":" << metrics.downtime_ms;
+  ss << ",\"files_released\":" << (metrics.files_released ? "true" : "false");
+  ss << "}\n";
+  std::string content = ss.str();
+
+  FILE *f = _tfopen(trace_file.c_str(), _T("wb"));
+  if (f == nullptr) {
+    XL_LOG_WARN("Open trace file error: ", trace_file);
+    return false;
+  }
+  bool written = fwrite(content.data(), 1, content.size(), f) == content.size();
+  return fclose(f) == 0 && written;
+}
+
+bool ReadUpdateTrace(const xl::native_string &trace_file, UpdateMetrics &metrics) {
+  FILE *f = _tfopen(trace_file.c_str(), _T("rb"));
+  if (f == nullptr) {
+    return false;
+  }
+  std::string content;
+  char buffer[4096];
+  size_t size = 0;
+  while ((size = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    content.append(buffer, size);
+  }
+  fclose(f);
+
+  UpdateTraceInternal json;
+  if (!json.json_parse(content.c_str())) {
+    XL_LOG_WARN("Parsing trace file failed: ", trace_file);
+    return false;
+  }
+  metrics = UpdateMetrics();
+  metrics.query_ms = json.query_ms;
+  metrics.query_from_cache = json.query_from_cache;
+  metrics.query_not_modified = json.query_not_modified;
+  metrics.download_first_byte_ms = json.download_first_byte_ms;
+  metrics.download_ms = json.download_ms;
+  metrics.bytes_resumed = json.bytes_resumed;
+  metrics.bytes_fetched = json.bytes_fetched;
+  for (const auto &sample : json.throughput) {
+    if (sample.size() == 2) {
+      metrics.throughput.push_back({(long long)sample[0], sample[1]});
+    }
+  }
+  metrics.hash_ms = std::move(json.hash_ms);
+  metrics.stage_ms = json.stage_ms;
+  metrics.extract_ms = json.extract_ms;
+  metrics.extracted_entries = json.extracted_entries;
+  metrics.rename_retries = json.rename_retries;
+  metrics.downtime_ms = json.downtime_ms;
+  metrics.files_released = json.files_released;
+  return true;
+}
+
+} // namespace selfupdate
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <selfupdate/updater.h>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// The trace file carries UpdateMetrics from the updater through the installer to the new version, as a JSON object
+// with the member names of UpdateMetrics, throughput samples as [elapsed_ms, downloaded_bytes] pairs.
+bool WriteUpdateTrace(const xl::native_string &trace_file, const UpdateMetrics &metrics);
+bool ReadUpdateTrace(const xl::native_string &trace_file, UpdateMetrics &metrics);
+
+} // namespace selfupdate
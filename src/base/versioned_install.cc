@@ -0,0 +1,208 @@
+#include "versioned_install.h"
+#include "../common.h"
+#include "file_util.h"
+#include <algorithm>
+#include <cstdio>
+#include <set>
+#include <xl/file>
+#include <xl/log>
+
+#ifndef _WIN32
+#include <cerrno>
+#include <climits>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace selfupdate {
+
+namespace {
+
+xl::native_string GetHistoryFile(const xl::native_string &install_location) {
+  return xl::path::join(GetVersionsDir(install_location), _T(INSTALL_VERSIONS_HISTORY_FILE_NAME));
+}
+
+} // namespace
+
+xl::native_string GetVersionsDir(const xl::native_string &install_location) {
+  return install_location + _T(INSTALL_LOCATION_VERSIONS_SUFFIX);
+}
+
+bool IsValidVersionName(const xl::native_string &version) {
+  return !version.empty() && version[0] != _T('.') && version.find_first_of(_T("/\\:")) == xl::native_string::npos;
+}
+
+#ifdef _WIN32
+
+bool GetActiveVersion(const xl::native_string &install_location, xl::native_string &version) {
+  return false;
+}
+
+xl::native_string GetInstallLocationOf(const xl::native_string &dir) {
+  return dir;
+}
+
+bool SwitchVersion(const xl::native_string &install_location, const xl::native_string &version) {
+  XL_LOG_ERROR("Versioned installs are not supported on Windows.");
+  return false;
+}
+
+std::vector<xl::native_string> ReadVersionHistory(const xl::native_string &install_location) {
+  return std::vector<xl::native_string>();
+}
+
+bool WriteVersionHistory(const xl::native_string &install_location, const std::vector<xl::native_string> &history) {
+  return false;
+}
+
+#else
+
+bool GetActiveVersion(const xl::native_string &install_location, xl::native_string &version) {
+  struct stat st = {};
+  if (lstat(install_location.c_str(), &st) != 0 || !S_ISLNK(st.st_mode)) {
+    return false;
+  }
+  char target[PATH_MAX];
+  ssize_t size = readlink(install_location.c_str(), target, sizeof(target) - 1);
+  if (size <= 0) {
+    return false;
+  }
+  xl::native_string link(target, (size_t)size);
+  // Written relative by SwitchVersion(), absolute ones are accepted too.
+  xl::native_string versions_dir = link[0] == '/' ? GetVersionsDir(install_location)
+                                                  : xl::path::filename(GetVersionsDir(install_location).c_str());
+  versions_dir += '/';
+  if (link.compare(0, versions_dir.size(), versions_dir) != 0 ||
+      !IsValidVersionName(link.substr(versions_dir.size()))) {
+    return false;
+  }
+  version = link.substr(versions_dir.size());
+  return true;
+}
+
+xl::native_string GetInstallLocationOf(const xl::native_string &dir) {
+  xl::native_string parent = xl::path::dirname(dir.c_str());
+  xl::native_string suffix = _T(INSTALL_LOCATION_VERSIONS_SUFFIX);
+  if (parent.size() <= suffix.size() || parent.compare(parent.size() - suffix.size(), suffix.size(), suffix) != 0) {
+    return dir;
+  }
+  xl::native_string install_location = parent.substr(0, parent.size() - suffix.size());
+  xl::native_string version;
+  return GetActiveVersion(install_location, version) ? install_location : dir;
+}
+
+bool SwitchVersion(const xl::native_string &install_location, const xl::native_string &version) {
+  xl::native_string target = xl::path::filename(GetVersionsDir(install_location).c_str()) + '/' + version;
+  xl::native_string switch_path = install_location + _T(INSTALL_LOCATION_SWITCH_SUFFIX);
+  unlink(switch_path.c_str());
+  if (symlink(target.c_str(), switch_path.c_str()) != 0) {
+    XL_LOG_ERROR("Create version symlink error: ", switch_path, ", errno: ", errno);
+    return false;
+  }
+  if (rename(switch_path.c_str(), install_location.c_str()) != 0) {
+    XL_LOG_ERROR("Switch version error: ", install_location, " => ", target, ", errno: ", errno);
+    unlink(switch_path.c_str());
+    return false;
+  }
+  XL_LOG_INFO("Switched version: ", install_location, " => ", target);
+  return true;
+}
+
+std::vector<xl::native_string> ReadVersionHistory(const xl::native_string &install_location) {
+  std::vector<xl::native_string> history;
+  FILE *f = fopen(GetHistoryFile(install_location).c_str(), "rb");
+  if (f == nullptr) {
+    return history;
+  }
+  char line[PATH_MAX];
+  while (fgets(line, sizeof(line), f) != nullptr) {
+    xl::native_string version = line;
+    version.erase(version.find_last_not_of("\r\n") + 1);
+    if (IsValidVersionName(version)) {
+      history.push_back(version);
+    }
+  }
+  fclose(f);
+  return history;
+}
+
+bool WriteVersionHistory(const xl::native_string &install_location, const std::vector<xl::native_string> &history) {
+  xl::native_string history_file = GetHistoryFile(install_location);
+  xl::native_string temp_file = history_file + _T(".tmp");
+  FILE *f = fopen(temp_file.c_str(), "wb");
+  if (f == nullptr) {
+    XL_LOG_WARN("Open version history error: ", temp_file);
+    return false;
+  }
+  bool written = true;
+  for (const auto &version : history) {
+    written = written && fprintf(f, "%s\n", version.c_str()) > 0;
+  }
+  if (fclose(f) != 0 || !written || rename(temp_file.c_str(), history_file.c_str()) != 0) {
+    XL_LOG_WARN("Write version history error: ", history_file);
+    unlink(temp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+#endif
+
+bool RollbackVersion(const xl::native_string &install_location) {
+  xl::native_string active;
+  if (!GetActiveVersion(install_location, active)) {
+    XL_LOG_ERROR("Not a versioned install: ", install_location);
+    return false;
+  }
+  std::vector<xl::native_string> history = ReadVersionHistory(install_location);
+  history.erase(std::remove(history.begin(), history.end(), active), history.end());
+  while (!history.empty() && !IsDirectory(xl::path::join(GetVersionsDir(install_location), history.back()))) {
+    history.pop_back();
+  }
+  if (history.empty()) {
+    XL_LOG_ERROR("No earlier version to roll back to: ", install_location);
+    return false;
+  }
+  if (!SwitchVersion(install_location, history.back())) {
+    return false;
+  }
+  WriteVersionHistory(install_location, history);
+  XL_LOG_INFO("Rolled back from: ", active, ", to: ", history.back());
+  return true;
+}
+
+void CollectVersions(const xl::native_string &install_location, unsigned keep_count) {
+  xl::native_string active;
+  if (!GetActiveVersion(install_location, active)) {
+    return;
+  }
+  std::vector<xl::native_string> history = ReadVersionHistory(install_location);
+  std::vector<xl::native_string> kept;
+  for (auto it = history.rbegin(); it != history.rend() && kept.size() < keep_count; ++it) {
+    if (std::find(kept.begin(), kept.end(), *it) == kept.end()) {
+      kept.insert(kept.begin(), *it);
+    }
+  }
+  if (std::find(kept.begin(), kept.end(), active) == kept.end()) {
+    kept.push_back(active);
+  }
+
+  xl::native_string versions_dir = GetVersionsDir(install_location);
+  std::vector<xl::native_string> collected;
+  xl::fs::enum_dir(versions_dir.c_str(), [&](const xl::native_string &path, bool is_dir) -> bool {
+    xl::native_string version = xl::path::filename(path.c_str());
+    if (is_dir && IsValidVersionName(version) && std::find(kept.begin(), kept.end(), version) == kept.end()) {
+      collected.push_back(version);
+    }
+    return true;
+  });
+  for (const auto &version : collected) {
+    XL_LOG_INFO("Deleting old version: ", version);
+    xl::fs::remove_all(xl::path::join(versions_dir, version).c_str());
+  }
+  if (kept != history) {
+    WriteVersionHistory(install_location, kept);
+  }
+}
+
+} // namespace selfupdate
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <vector>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// Versioned installs keep each version in a directory of its own, install_location + ".versions/<version>", and make
+// install_location a symlink to the active one. Switching versions, and rolling back, is then one rename. The versions
+// directory also holds the history of activated versions. Not available on Windows, where creating symlinks takes
+// privileges, the functions fail there.
+
+xl::native_string GetVersionsDir(const xl::native_string &install_location);
+// Version names become directory names, they must not be empty, contain separators, or start with a '.'.
+bool IsValidVersionName(const xl::native_string &version);
+
+// Returns false if install_location is not a symlink into its versions directory.
+bool GetActiveVersion(const xl::native_string &install_location, xl::native_string &version);
+// Returns the install location dir is a version of, or dir if it is not part of a versioned install. For the
+// executable directory, which is reported with symlinks resolved.
+xl::native_string GetInstallLocationOf(const xl::native_string &dir);
+// Points install_location at version, with a new symlink renamed over it. install_location is never missing or half
+// switched, but it must be a symlink already, or not exist.
+bool SwitchVersion(const xl::native_string &install_location, const xl::native_string &version);
+
+// Oldest first, the active version last unless rolled back past.
+std::vector<xl::native_string> ReadVersionHistory(const xl::native_string &install_location);
+bool WriteVersionHistory(const xl::native_string &install_location, const std::vector<xl::native_string> &history);
+
+// Switches back to the version activated before the active one, which is dropped from the history and deleted by the
+// next CollectVersions().
+bool RollbackVersion(const xl::native_string &install_location);
+// Deletes the versions that are not among the keep_count last activated ones. The active version is always kept.
+void CollectVersions(const xl::native_string &install_location, unsigned keep_count);
+
+} // namespace selfupdate
@@ -0,0 +1,382 @@
+#include "zip_extractor.h"
+#include "crc32.h"
+#include "crc32_cache.h"
+#include "file_util.h"
+#include "zip_format.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include <xl/file>
+#include <xl/log>
+#include <xl/scope_exit>
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace selfupdate {
+
+namespace {
+
+const unsigned MAX_EXTRACT_THREAD_COUNT = 32;
+const size_t EXTRACT_BUFFER_SIZE = 256 * 1024;
+// zlib takes at most this much input at once.
+const size_t MAX_MAPPED_INPUT_SIZE = 1 << 30;
+
+class ZipExtractor {
+public:
+  ZipExtractor(PositionalFile &file,
+               uint64_t file_size,
+               const unsigned char *mapped,
+               const xl::native_string &target_dir,
+               const xl::native_string &installed_dir,
+               Crc32Cache *crc_cache)
+      : file_(file), file_size_(file_size), mapped_(mapped), target_dir_(target_dir), installed_dir_(installed_dir),
+        crc_cache_(crc_cache) {
+  }
+
+  bool Extract(const std::vector<ZipEntry> &entries,
+               unsigned thread_count,
+               std::unordered_set<xl::native_string> *extracted_paths,
+               unsigned long long *entry_count) {
+    entries_ = &entries;
+    native_paths_.resize(entries.size());
+    std::set<xl::native_string> dirs;
+    std::vector<size_t> files;
+    size_t dir_entry_count = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      const ZipEntry &entry = entries[i];
+      if (entry.name.empty() && entry.is_dir) {
+        continue;
+      }
+      if (!ToRelativeNativePath(entry.name, native_paths_[i])) {
+        XL_LOG_ERROR("Invalid zip entry name: ", entry.name);
+        return false;
+      }
+      if (extracted_paths != nullptr) {
+        AddPathWithParents(native_paths_[i], *extracted_paths);
+      }
+      xl::native_string path = xl::path::join(target_dir_, native_paths_[i]);
+      if (entry.is_dir) {
+        dirs.insert(path);
+        ++dir_entry_count;
+        continue;
+      }
+      if ((entry.flags & ZIP_FLAG_ENCRYPTED) != 0 ||
+          (entry.method != ZIP_METHOD_STORED && entry.method != ZIP_METHOD_DEFLATED)) {
+        XL_LOG_ERROR("Unsupported zip entry: ", entry.name, ", method: ", entry.method, ", flags: ", entry.flags);
+        return false;
+      }
+      dirs.insert(xl::path::dirname(path.c_str()));
+      files.push_back(i);
+    }
+
+    // Created before any thread starts, so that workers never race on a shared parent.
+    xl::fs::mkdirs(target_dir_.c_str());
+    for (const auto &dir : dirs) {
+      xl::fs::mkdirs(dir.c_str());
+    }
+
+    std::sort(files.begin(), files.end(), [&entries](size_t a, size_t b) {
+      return entries[a].compressed_size > entries[b].compressed_size;
+    });
+    thread_count = std::max(1u, std::min({thread_count, MAX_EXTRACT_THREAD_COUNT, (unsigned)files.size()}));
+    queues_.reset(new Queue[thread_count]);
+    queue_count_ = thread_count;
+    for (size_t i = 0; i < files.size(); ++i) {
+      queues_[i % thread_count].items.push_back(files[i]);
+    }
+
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < thread_count; ++i) {
+      workers.emplace_back(&ZipExtractor::Work, this, i);
+    }
+    Work(0);
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    if (entry_count != nullptr) {
+      *entry_count = dir_entry_count + extracted_count_;
+    }
+    XL_LOG_INFO("Zip extracted, files: ", files.size(), ", unchanged: ", unchanged_count_.load(),
+                ", directories: ", dirs.size(), ", threads: ", thread_count, ", failed: ", failed_.load());
+    return !failed_;
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<size_t> items;
+  };
+
+  // Takes the largest remaining entry of its own queue, or the smallest one of another queue.
+  bool Next(unsigned self, size_t &index) {
+    for (unsigned i = 0; i < queue_count_; ++i) {
+      Queue &queue = queues_[(self + i) % queue_count_];
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      if (queue.items.empty()) {
+        continue;
+      }
+      if (i == 0) {
+        index = queue.items.front();
+        queue.items.pop_front();
+      } else {
+        index = queue.items.back();
+        queue.items.pop_back();
+      }
+      return true;
+    }
+    return false;
+  }
+
+  void Work(unsigned self) {
+    // Compressed data is read straight from the mapping when there is one.
+    std::unique_ptr<char[]> input(mapped_ == nullptr ? new char[EXTRACT_BUFFER_SIZE] : nullptr);
+    std::unique_ptr<char[]> output(new char[EXTRACT_BUFFER_SIZE]);
+    size_t index = 0;
+    while (!failed_ && Next(self, index)) {
+      const ZipEntry &entry = (*entries_)[index];
+      if (LinkUnchangedFile(entry, native_paths_[index])) {
+        ++unchanged_count_;
+      } else if (ExtractEntry(entry, native_paths_[index], input.get(), output.get())) {
+        ++extracted_count_;
+      } else {
+        XL_LOG_ERROR("Extract zip entry failed: ", entry.name);
+        failed_ = true;
+        break;
+      }
+#ifndef _WIN32
+      if (S_ISLNK(entry.mode)) {
+        continue;
+      }
+#endif
+      if (crc_cache_ != nullptr) {
+        crc_cache_->Put(entry.name, xl::path::join(target_dir_, native_paths_[index]), entry.crc);
+      }
+    }
+  }
+
+  // Links the installed file into target_dir if it has the size, CRC-32 and executable bits of entry.
+  bool LinkUnchangedFile(const ZipEntry &entry, const xl::native_string &native_path) {
+    if (installed_dir_.empty()) {
+      return false;
+    }
+    xl::native_string installed_path = xl::path::join(installed_dir_, native_path);
+#ifndef _WIN32
+    struct stat st = {};
+    if (S_ISLNK(entry.mode) || lstat(installed_path.c_str(), &st) != 0 || !S_ISREG(st.st_mode) ||
+        (uint64_t)st.st_size != entry.size ||
+        ((entry.mode & 0777) != 0 && (st.st_mode & 0111) != (entry.mode & 0111))) {
+      return false;
+    }
+#else
+    if ((uint64_t)GetFileSize(installed_path) != entry.size) {
+      return false;
+    }
+#endif
+    uint32_t crc = 0;
+    bool hashed = crc_cache_ != nullptr ? crc_cache_->Get(entry.name, installed_path, crc)
+                                        : Crc32File(installed_path, crc);
+    return hashed && crc == entry.crc &&
+           LinkOrCopyFile(installed_path, xl::path::join(target_dir_, native_path));
+  }
+
+  bool ExtractEntry(const ZipEntry &entry, const xl::native_string &native_path, char *input, char *output) {
+    unsigned char local_header[ZIP_LOCAL_HEADER_SIZE];
+    if (file_.ReadAt(entry.local_header_offset, local_header, sizeof(local_header)) != sizeof(local_header) ||
+        GetZipInteger(local_header, 4) != ZIP_LOCAL_HEADER_SIGNATURE) {
+      return false;
+    }
+    uint64_t offset = entry.local_header_offset + ZIP_LOCAL_HEADER_SIZE + GetZipInteger(local_header + 26, 2) +
+                      GetZipInteger(local_header + 28, 2);
+    if (offset + entry.compressed_size > file_size_) {
+      return false;
+    }
+
+    xl::native_string path = xl::path::join(target_dir_, native_path);
+#ifndef _WIN32
+    if (S_ISLNK(entry.mode)) {
+      std::string link;
+      if (!Inflate(entry, offset, input, output, [&link](const char *data, size_t size) {
+            link.append(data, size);
+            return true;
+          })) {
+        return false;
+      }
+      return symlink(link.c_str(), path.c_str()) == 0;
+    }
+#endif
+
+    if (entry.method == ZIP_METHOD_STORED && mapped_ != nullptr) {
+      return CopyStoredEntry(entry, offset, path);
+    }
+
+    FILE *f = _tfopen(path.c_str(), _T("wb"));
+    if (f == nullptr) {
+      return false;
+    }
+    XL_ON_BLOCK_EXIT(fclose, f);
+    if (!Inflate(entry, offset, input, output, [f](const char *data, size_t size) {
+          return fwrite(data, 1, size, f) == size;
+        })) {
+      return false;
+    }
+#ifndef _WIN32
+    if ((entry.mode & 0777) != 0) {
+      fchmod(fileno(f), entry.mode & 07777);
+    }
+#endif
+    return true;
+  }
+
+  // Stored data is copied from the package file by the kernel where possible, else written from the mapping.
+  bool CopyStoredEntry(const ZipEntry &entry, uint64_t offset, const xl::native_string &path) {
+    const unsigned char *data = mapped_ + offset;
+    if (entry.compressed_size != entry.size || Crc32(0, data, (size_t)entry.size) != entry.crc) {
+      return false;
+    }
+    PositionalFile f;
+    if (!f.Open(path)) {
+      return false;
+    }
+    uint64_t copied = file_.CopyTo(offset, entry.size, f, 0);
+    while (copied < entry.size) {
+      // Keeps each write within what WriteFile takes at once.
+      size_t size = (size_t)std::min<uint64_t>(entry.size - copied, 1 << 30);
+      if (!f.WriteAt(copied, data + copied, size)) {
+        return false;
+      }
+      copied += size;
+    }
+    f.Close();
+#ifndef _WIN32
+    if ((entry.mode & 0777) != 0) {
+      chmod(path.c_str(), entry.mode & 07777);
+    }
+#endif
+    return true;
+  }
+
+  // Returns size bytes of the package at offset, from the mapping or read into buffer.
+  const char *ReadInput(uint64_t offset, size_t size, char *buffer) {
+    if (mapped_ != nullptr) {
+      return (const char *)mapped_ + offset;
+    }
+    return file_.ReadAt(offset, buffer, size) == size ? buffer : nullptr;
+  }
+
+  template <typename Writer>
+  bool Inflate(const ZipEntry &entry, uint64_t offset, char *input, char *output, Writer write) {
+    uint32_t crc = 0;
+    uint64_t written = 0;
+    uint64_t remaining = entry.compressed_size;
+    if (entry.method == ZIP_METHOD_STORED) {
+      while (remaining > 0) {
+        size_t size = (size_t)std::min<uint64_t>(EXTRACT_BUFFER_SIZE, remaining);
+        const char *data = ReadInput(offset, size, input);
+        if (data == nullptr || !write(data, size)) {
+          return false;
+        }
+        crc = Crc32(crc, data, size);
+        offset += size;
+        remaining -= size;
+        written += size;
+      }
+      return written == entry.size && crc == entry.crc;
+    }
+
+    z_stream stream = {};
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK) {
+      return false;
+    }
+    XL_ON_BLOCK_EXIT(inflateEnd, &stream);
+    int ret = Z_OK;
+    while (ret != Z_STREAM_END) {
+      // A full output buffer may leave more output pending without any input left.
+      if (stream.avail_in == 0 && remaining > 0) {
+        size_t size = (size_t)std::min<uint64_t>(mapped_ != nullptr ? MAX_MAPPED_INPUT_SIZE : EXTRACT_BUFFER_SIZE,
+                                                  remaining);
+        const char *data = ReadInput(offset, size, input);
+        if (data == nullptr) {
+          return false;
+        }
+        stream.next_in = (Bytef *)data;
+        stream.avail_in = (uInt)size;
+        offset += size;
+        remaining -= size;
+      }
+      stream.next_out = (Bytef *)output;
+      stream.avail_out = (uInt)EXTRACT_BUFFER_SIZE;
+      ret = inflate(&stream, Z_NO_FLUSH);
+      if (ret != Z_OK && ret != Z_STREAM_END) {
+        return false;
+      }
+      size_t size = EXTRACT_BUFFER_SIZE - stream.avail_out;
+      if (size > 0 && !write(output, size)) {
+        return false;
+      }
+      crc = Crc32(crc, output, size);
+      written += size;
+    }
+    return written == entry.size && crc == entry.crc;
+  }
+
+  PositionalFile &file_;
+  uint64_t file_size_;
+  const unsigned char *mapped_;
+  xl::native_string target_dir_;
+  xl::native_string installed_dir_;
+  Crc32Cache *crc_cache_;
+  const std::vector<ZipEntry> *entries_ = nullptr;
+  std::vector<xl::native_string> native_paths_;
+  std::unique_ptr<Queue[]> queues_;
+  unsigned queue_count_ = 0;
+  std::atomic<bool> failed_{false};
+  std::atomic<size_t> unchanged_count_{0};
+  std::atomic<size_t> extracted_count_{0};
+};
+
+} // namespace
+
+bool ExtractZip(const xl::native_string &zip_file,
+                const xl::native_string &target_dir,
+                unsigned thread_count,
+                const xl::native_string &installed_dir,
+                Crc32Cache *crc_cache,
+                std::unordered_set<xl::native_string> *extracted_paths,
+                unsigned long long *entry_count) {
+  XL_LOG_INFO(_T("Extracting zip: "), zip_file.c_str(), _T(", to: "), target_dir.c_str(), _T(", threads: "),
+              thread_count);
+  long long file_size = GetFileSize(zip_file);
+  PositionalFile file;
+  if (file_size < 0 || !file.Open(zip_file, true)) {
+    XL_LOG_ERROR("Open zip file error: ", zip_file);
+    return false;
+  }
+  std::vector<ZipEntry> entries;
+  if (!ReadZipCentralDirectory(file, (uint64_t)file_size, entries)) {
+    return false;
+  }
+  if (thread_count == 0) {
+    thread_count = std::max(1u, std::thread::hardware_concurrency());
+  }
+  MappedFile mapped;
+  if (!mapped.Open(zip_file) || mapped.size() != (unsigned long long)file_size) {
+    XL_LOG_WARN("Map zip file failed, reading it instead: ", zip_file);
+    mapped.Close();
+  }
+  ZipExtractor extractor(file, (uint64_t)file_size, mapped.data(), target_dir, installed_dir, crc_cache);
+  return extractor.Extract(entries, thread_count, extracted_paths, entry_count);
+}
+
+} // namespace selfupdate
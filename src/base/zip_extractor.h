@@ -0,0 +1,33 @@
+#pragma once
+
+#include <unordered_set>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+class Crc32Cache;
+
+// Extracts zip_file into target_dir with thread_count threads, 0 for one per processor.
+//
+// The central directory is read once, all directories are created up front, then entries are inflated concurrently.
+// Entries are dealt to the threads largest first by compressed size, and a thread that runs out of entries steals from
+// the others. The package is memory mapped, deflated entries are inflated straight from the mapping, and stored ones are
+// copied by the kernel where it can. Only stored and deflated entries without encryption are supported, returns false
+// on anything else.
+//
+// If installed_dir is not empty, a file there with the same size, CRC-32 and executable bits as an entry is linked into
+// target_dir instead of extracting the entry. crc_cache, if not null, saves reading installed files to hash them, and
+// records the CRC-32 of every file written to target_dir.
+//
+// extracted_paths, if not null, receives the relative native paths of all entries and their parent directories.
+// entry_count, if not null, receives the number of entries written, files and directories, not counting the files
+// linked from installed_dir.
+bool ExtractZip(const xl::native_string &zip_file,
+                const xl::native_string &target_dir,
+                unsigned thread_count,
+                const xl::native_string &installed_dir = xl::native_string(),
+                Crc32Cache *crc_cache = nullptr,
+                std::unordered_set<xl::native_string> *extracted_paths = nullptr,
+                unsigned long long *entry_count = nullptr);
+
+} // namespace selfupdate
@@ -0,0 +1,139 @@
+#include "zip_format.h"
+#include <algorithm>
+#include <xl/log>
+
+namespace selfupdate {
+
+namespace {
+
+const size_t ZIP_END_SIZE = 22;
+const size_t ZIP64_END_SIZE = 56;
+const size_t ZIP64_END_LOCATOR_SIZE = 20;
+const size_t ZIP_MAX_COMMENT_SIZE = 0xffff;
+const uint8_t ZIP_HOST_UNIX = 3;
+
+bool FindEndOfCentralDirectory(PositionalFile &file,
+                               uint64_t file_size,
+                               uint64_t &entry_count,
+                               uint64_t &directory_offset,
+                               uint64_t &directory_size) {
+  size_t tail_size = (size_t)std::min<uint64_t>(file_size, ZIP_END_SIZE + ZIP_MAX_COMMENT_SIZE);
+  std::vector<unsigned char> tail(tail_size);
+  uint64_t tail_offset = file_size - tail_size;
+  if (tail_size < ZIP_END_SIZE || file.ReadAt(tail_offset, tail.data(), tail_size) != tail_size) {
+    return false;
+  }
+  size_t end = tail_size - ZIP_END_SIZE + 1;
+  while (end > 0 && GetZipInteger(&tail[end - 1], 4) != ZIP_END_SIGNATURE) {
+    --end;
+  }
+  if (end == 0) {
+    return false;
+  }
+  const unsigned char *eocd = &tail[end - 1];
+  entry_count = GetZipInteger(eocd + 10, 2);
+  directory_size = GetZipInteger(eocd + 12, 4);
+  directory_offset = GetZipInteger(eocd + 16, 4);
+  if (entry_count != 0xffff && directory_size != 0xffffffff && directory_offset != 0xffffffff) {
+    return true;
+  }
+
+  uint64_t eocd_offset = tail_offset + end - 1;
+  unsigned char locator[ZIP64_END_LOCATOR_SIZE];
+  unsigned char eocd64[ZIP64_END_SIZE];
+  if (eocd_offset < ZIP64_END_LOCATOR_SIZE ||
+      file.ReadAt(eocd_offset - ZIP64_END_LOCATOR_SIZE, locator, sizeof(locator)) != sizeof(locator) ||
+      GetZipInteger(locator, 4) != ZIP64_END_LOCATOR_SIGNATURE ||
+      file.ReadAt(GetZipInteger(locator + 8, 8), eocd64, sizeof(eocd64)) != sizeof(eocd64) ||
+      GetZipInteger(eocd64, 4) != ZIP64_END_SIGNATURE) {
+    return false;
+  }
+  entry_count = GetZipInteger(eocd64 + 32, 8);
+  directory_size = GetZipInteger(eocd64 + 40, 8);
+  directory_offset = GetZipInteger(eocd64 + 48, 8);
+  return true;
+}
+
+} // namespace
+
+uint64_t GetZipInteger(const unsigned char *p, size_t size) {
+  uint64_t v = 0;
+  for (size_t i = size; i > 0; --i) {
+    v = (v << 8) | p[i - 1];
+  }
+  return v;
+}
+
+bool ReadZipCentralDirectory(PositionalFile &file, uint64_t file_size, std::vector<ZipEntry> &entries) {
+  uint64_t entry_count = 0, directory_offset = 0, directory_size = 0;
+  if (!FindEndOfCentralDirectory(file, file_size, entry_count, directory_offset, directory_size) ||
+      directory_offset + directory_size > file_size) {
+    XL_LOG_ERROR("Zip end of central directory not found.");
+    return false;
+  }
+  std::vector<unsigned char> directory((size_t)directory_size);
+  if (file.ReadAt(directory_offset, directory.data(), directory.size()) != directory.size()) {
+    return false;
+  }
+
+  entries.clear();
+  entries.reserve((size_t)std::min<uint64_t>(entry_count, directory_size / ZIP_CENTRAL_HEADER_SIZE));
+  for (size_t pos = 0; entries.size() < entry_count;) {
+    if (pos + ZIP_CENTRAL_HEADER_SIZE > directory.size() ||
+        GetZipInteger(&directory[pos], 4) != ZIP_CENTRAL_HEADER_SIGNATURE) {
+      XL_LOG_ERROR("Zip central directory corrupted, at entry: ", entries.size());
+      return false;
+    }
+    const unsigned char *header = &directory[pos];
+    size_t name_size = (size_t)GetZipInteger(header + 28, 2);
+    size_t extra_size = (size_t)GetZipInteger(header + 30, 2);
+    size_t comment_size = (size_t)GetZipInteger(header + 32, 2);
+    if (pos + ZIP_CENTRAL_HEADER_SIZE + name_size + extra_size + comment_size > directory.size()) {
+      return false;
+    }
+
+    ZipEntry entry;
+    entry.flags = (uint16_t)GetZipInteger(header + 8, 2);
+    entry.method = (uint16_t)GetZipInteger(header + 10, 2);
+    entry.crc = (uint32_t)GetZipInteger(header + 16, 4);
+    entry.compressed_size = GetZipInteger(header + 20, 4);
+    entry.size = GetZipInteger(header + 24, 4);
+    entry.local_header_offset = GetZipInteger(header + 42, 4);
+    if (header[5] == ZIP_HOST_UNIX) {
+      entry.mode = (uint32_t)(GetZipInteger(header + 38, 4) >> 16);
+    }
+    entry.name.assign((const char *)header + ZIP_CENTRAL_HEADER_SIZE, name_size);
+    std::replace(entry.name.begin(), entry.name.end(), '\\', '/');
+    entry.is_dir = !entry.name.empty() && entry.name.back() == '/';
+    if (entry.is_dir) {
+      entry.name.pop_back();
+    }
+
+    // Zip64 extended information, present for each field that is saturated in the header, in this order.
+    const unsigned char *extra = header + ZIP_CENTRAL_HEADER_SIZE + name_size;
+    for (size_t i = 0; i + 4 <= extra_size;) {
+      uint16_t id = (uint16_t)GetZipInteger(extra + i, 2);
+      size_t size = (size_t)GetZipInteger(extra + i + 2, 2);
+      if (i + 4 + size > extra_size) {
+        break;
+      }
+      if (id == ZIP64_EXTRA_FIELD_ID) {
+        const unsigned char *p = extra + i + 4;
+        const unsigned char *p_end = p + size;
+        for (uint64_t *field : {&entry.size, &entry.compressed_size, &entry.local_header_offset}) {
+          if (*field == 0xffffffff && p + 8 <= p_end) {
+            *field = GetZipInteger(p, 8);
+            p += 8;
+          }
+        }
+      }
+      i += 4 + size;
+    }
+
+    entries.push_back(std::move(entry));
+    pos += ZIP_CENTRAL_HEADER_SIZE + name_size + extra_size + comment_size;
+  }
+  return true;
+}
+
+} // namespace selfupdate
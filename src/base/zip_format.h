@@ -0,0 +1,45 @@
+#pragma once
+
+#include "file_util.h"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace selfupdate {
+
+const uint32_t ZIP_LOCAL_HEADER_SIGNATURE = 0x04034b50;
+const uint32_t ZIP_DATA_DESCRIPTOR_SIGNATURE = 0x08074b50;
+const uint32_t ZIP_CENTRAL_HEADER_SIGNATURE = 0x02014b50;
+const uint32_t ZIP_END_SIGNATURE = 0x06054b50;
+const uint32_t ZIP64_END_SIGNATURE = 0x06064b50;
+const uint32_t ZIP64_END_LOCATOR_SIGNATURE = 0x07064b50;
+const size_t ZIP_LOCAL_HEADER_SIZE = 30;
+const size_t ZIP_CENTRAL_HEADER_SIZE = 46;
+const uint16_t ZIP64_EXTRA_FIELD_ID = 0x0001;
+const uint16_t ZIP_FLAG_ENCRYPTED = 0x0001;
+const uint16_t ZIP_FLAG_DATA_DESCRIPTOR = 0x0008;
+const uint16_t ZIP_METHOD_STORED = 0;
+const uint16_t ZIP_METHOD_DEFLATED = 8;
+
+// Reads a little endian integer of size bytes.
+uint64_t GetZipInteger(const unsigned char *p, size_t size);
+
+struct ZipEntry {
+  // '/' separated, without the trailing '/' of a directory.
+  std::string name;
+  uint16_t flags = 0;
+  uint16_t method = 0;
+  uint32_t crc = 0;
+  uint64_t compressed_size = 0;
+  uint64_t size = 0;
+  uint64_t local_header_offset = 0;
+  // Unix mode, 0 if the entry was not made on unix.
+  uint32_t mode = 0;
+  bool is_dir = false;
+};
+
+// Reads all entries from the central directory of the zip file, zip64 included.
+bool ReadZipCentralDirectory(PositionalFile &file, uint64_t file_size, std::vector<ZipEntry> &entries);
+
+} // namespace selfupdate
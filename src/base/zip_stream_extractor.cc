@@ -0,0 +1,357 @@
+#include "zip_stream_extractor.h"
+#include "crc32.h"
+#include "file_util.h"
+#include "zip_format.h"
+#include <algorithm>
+#include <vector>
+#include <xl/file>
+#include <xl/log>
+#include <zlib.h>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace selfupdate {
+
+namespace {
+
+const size_t INFLATE_BUFFER_SIZE = 256 * 1024;
+
+} // namespace
+
+struct ZipStreamExtractor::Inflater {
+  z_stream stream = {};
+  std::unique_ptr<unsigned char[]> output{new unsigned char[INFLATE_BUFFER_SIZE]};
+
+  int init_result = Z_OK;
+
+  Inflater() {
+    init_result = inflateInit2(&stream, -MAX_WBITS);
+  }
+  ~Inflater() {
+    if (init_result == Z_OK) {
+      inflateEnd(&stream);
+    }
+  }
+};
+
+ZipStreamExtractor::ZipStreamExtractor() = default;
+
+ZipStreamExtractor::~ZipStreamExtractor() {
+  if (file_ != nullptr) {
+    fclose(file_);
+  }
+}
+
+bool ZipStreamExtractor::Open(const xl::native_string &target_dir) {
+  target_dir_ = target_dir;
+  xl::fs::remove_all(target_dir_.c_str());
+  xl::fs::mkdirs(target_dir_.c_str());
+  if (!xl::fs::exists(target_dir_.c_str())) {
+    return Fail("create target dir error");
+  }
+  return true;
+}
+
+bool ZipStreamExtractor::Fail(const char *reason) {
+  if (!failed_) {
+    XL_LOG_WARN("Streaming extraction stopped: ", reason, ", entry: ", name_);
+  }
+  failed_ = true;
+  if (file_ != nullptr) {
+    fclose(file_);
+    file_ = nullptr;
+  }
+  return false;
+}
+
+bool ZipStreamExtractor::Fill(const unsigned char *&data, size_t &size, size_t needed) {
+  if (pending_.size() < needed) {
+    size_t n = std::min(needed - pending_.size(), size);
+    pending_.append((const char *)data, n);
+    data += n;
+    size -= n;
+  }
+  return pending_.size() >= needed;
+}
+
+bool ZipStreamExtractor::Write(const void *data, size_t size) {
+  const unsigned char *p = (const unsigned char *)data;
+  while (size > 0 && !failed_ && state_ != STATE_DONE) {
+    switch (state_) {
+    case STATE_HEADER: {
+      if (!Fill(p, size, 4)) {
+        return true;
+      }
+      uint32_t signature = (uint32_t)GetZipInteger((const unsigned char *)pending_.data(), 4);
+      if (signature == ZIP_CENTRAL_HEADER_SIGNATURE || signature == ZIP_END_SIGNATURE) {
+        // Local entries are over, the rest is only read back in Finish().
+        state_ = STATE_DONE;
+        pending_.clear();
+        return true;
+      }
+      if (signature != ZIP_LOCAL_HEADER_SIGNATURE) {
+        return Fail("bad local header signature");
+      }
+      if (!Fill(p, size, ZIP_LOCAL_HEADER_SIZE)) {
+        return true;
+      }
+      state_ = STATE_NAME;
+      break;
+    }
+    case STATE_NAME: {
+      const unsigned char *header = (const unsigned char *)pending_.data();
+      size_t name_size = (size_t)GetZipInteger(header + 26, 2);
+      size_t extra_size = (size_t)GetZipInteger(header + 28, 2);
+      if (!Fill(p, size, ZIP_LOCAL_HEADER_SIZE + name_size + extra_size)) {
+        return true;
+      }
+      if (!BeginEntry()) {
+        return false;
+      }
+      break;
+    }
+    case STATE_DATA: {
+      size_t n = WriteData(p, size);
+      p += n;
+      size -= n;
+      break;
+    }
+    case STATE_DESCRIPTOR: {
+      if (!Fill(p, size, 4)) {
+        return true;
+      }
+      // The signature is optional.
+      size_t offset = GetZipInteger((const unsigned char *)pending_.data(), 4) == ZIP_DATA_DESCRIPTOR_SIGNATURE ? 4 : 0;
+      size_t size_field = zip64_ ? 8 : 4;
+      if (!Fill(p, size, offset + 4 + size_field * 2)) {
+        return true;
+      }
+      const unsigned char *descriptor = (const unsigned char *)pending_.data() + offset;
+      expected_crc_ = (uint32_t)GetZipInteger(descriptor, 4);
+      size_ = GetZipInteger(descriptor + 4 + size_field, size_field);
+      pending_.clear();
+      if (!EndEntry()) {
+        return false;
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  return !failed_;
+}
+
+bool ZipStreamExtractor::BeginEntry() {
+  const unsigned char *header = (const unsigned char *)pending_.data();
+  flags_ = (uint16_t)GetZipInteger(header + 6, 2);
+  method_ = (uint16_t)GetZipInteger(header + 8, 2);
+  expected_crc_ = (uint32_t)GetZipInteger(header + 14, 4);
+  compressed_size_ = GetZipInteger(header + 18, 4);
+  size_ = GetZipInteger(header + 22, 4);
+  size_t name_size = (size_t)GetZipInteger(header + 26, 2);
+  size_t extra_size = (size_t)GetZipInteger(header + 28, 2);
+  name_.assign(pending_, ZIP_LOCAL_HEADER_SIZE, name_size);
+  std::replace(name_.begin(), name_.end(), '\\', '/');
+
+  zip64_ = false;
+  const unsigned char *extra = header + ZIP_LOCAL_HEADER_SIZE + name_size;
+  for (size_t i = 0; i + 4 <= extra_size;) {
+    uint16_t id = (uint16_t)GetZipInteger(extra + i, 2);
+    size_t size = (size_t)GetZipInteger(extra + i + 2, 2);
+    if (i + 4 + size > extra_size) {
+      break;
+    }
+    if (id == ZIP64_EXTRA_FIELD_ID) {
+      zip64_ = true;
+      if (size >= 16) {
+        size_ = GetZipInteger(extra + i + 4, 8);
+        compressed_size_ = GetZipInteger(extra + i + 12, 8);
+      }
+    }
+    i += 4 + size;
+  }
+  pending_.clear();
+
+  if ((flags_ & ZIP_FLAG_ENCRYPTED) != 0) {
+    return Fail("encrypted entry");
+  }
+  if (method_ != ZIP_METHOD_STORED && method_ != ZIP_METHOD_DEFLATED) {
+    return Fail("unsupported compression method");
+  }
+  bool has_descriptor = (flags_ & ZIP_FLAG_DATA_DESCRIPTOR) != 0;
+  if (method_ == ZIP_METHOD_STORED && has_descriptor) {
+    return Fail("stored entry without size");
+  }
+
+  bool is_dir = !name_.empty() && name_.back() == '/';
+  std::string name = is_dir ? name_.substr(0, name_.size() - 1) : name_;
+  xl::native_string native_path;
+  if (!ToRelativeNativePath(name, native_path)) {
+    return Fail("invalid entry name");
+  }
+  xl::native_string path = xl::path::join(target_dir_, native_path);
+  xl::native_string dir = is_dir ? path : xl::path::dirname(path.c_str());
+  if (created_dirs_.insert(dir).second) {
+    xl::fs::mkdirs(dir.c_str());
+  }
+  if (is_dir) {
+    state_ = STATE_HEADER;
+    ++dir_entry_count_;
+    return compressed_size_ == 0 || Fail("directory with data");
+  }
+
+  file_ = _tfopen(path.c_str(), _T("wb"));
+  if (file_ == nullptr) {
+    return Fail("create file error");
+  }
+  name_ = name;
+  consumed_ = 0;
+  written_ = 0;
+  crc_ = 0;
+  if (method_ == ZIP_METHOD_DEFLATED) {
+    inflater_.reset(new Inflater);
+    if (inflater_->init_result != Z_OK) {
+      XL_LOG_ERROR("Inflater init error: ", inflater_->init_result);
+      inflater_.reset();
+      return Fail("inflate init error");
+    }
+  }
+  state_ = STATE_DATA;
+  if (method_ == ZIP_METHOD_STORED && compressed_size_ == 0) {
+    return EndEntry();
+  }
+  return true;
+}
+
+size_t ZipStreamExtractor::WriteData(const unsigned char *data, size_t size) {
+  bool has_descriptor = (flags_ & ZIP_FLAG_DATA_DESCRIPTOR) != 0;
+  if (!has_descriptor) {
+    size = (size_t)std::min<uint64_t>(size, compressed_size_ - consumed_);
+  }
+
+  if (method_ == ZIP_METHOD_STORED) {
+    if (fwrite(data, 1, size, file_) != size) {
+      Fail("write file error");
+      return size;
+    }
+    crc_ = Crc32(crc_, data, size);
+    consumed_ += size;
+    written_ += size;
+    if (consumed_ == compressed_size_) {
+      EndEntry();
+    }
+    return size;
+  }
+
+  z_stream &stream = inflater_->stream;
+  stream.next_in = (Bytef *)data;
+  stream.avail_in = (uInt)size;
+  int ret = Z_OK;
+  while (ret == Z_OK && (stream.avail_in > 0 || stream.avail_out == 0)) {
+    stream.next_out = inflater_->output.get();
+    stream.avail_out = (uInt)INFLATE_BUFFER_SIZE;
+    ret = inflate(&stream, Z_NO_FLUSH);
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+      Fail("inflate error");
+      return size;
+    }
+    size_t output_size = INFLATE_BUFFER_SIZE - stream.avail_out;
+    if (fwrite(inflater_->output.get(), 1, output_size, file_) != output_size) {
+      Fail("write file error");
+      return size;
+    }
+    crc_ = Crc32(crc_, inflater_->output.get(), output_size);
+    written_ += output_size;
+  }
+  size_t used = size - stream.avail_in;
+  consumed_ += used;
+  if (ret == Z_STREAM_END) {
+    inflater_.reset();
+    if (has_descriptor) {
+      fclose(file_);
+      file_ = nullptr;
+      state_ = STATE_DESCRIPTOR;
+    } else if (consumed_ != compressed_size_) {
+      Fail("compressed size mismatch");
+    } else {
+      EndEntry();
+    }
+  } else if (!has_descriptor && consumed_ == compressed_size_) {
+    Fail("truncated deflate stream");
+  }
+  return used;
+}
+
+bool ZipStreamExtractor::EndEntry() {
+  if (file_ != nullptr) {
+    bool closed = fclose(file_) == 0;
+    file_ = nullptr;
+    if (!closed) {
+      return Fail("write file error");
+    }
+  }
+  if (written_ != size_ || crc_ != expected_crc_) {
+    return Fail("crc mismatch");
+  }
+  extracted_.insert(name_);
+  state_ = STATE_HEADER;
+  return true;
+}
+
+bool ZipStreamExtractor::Finish(const xl::native_string &package_file) {
+  if (failed_ || state_ != STATE_DONE) {
+    return Fail("package not complete");
+  }
+  long long file_size = GetFileSize(package_file);
+  PositionalFile file;
+  std::vector<ZipEntry> entries;
+  if (file_size < 0 || !file.Open(package_file, true) || !ReadZipCentralDirectory(file, file_size, entries)) {
+    return Fail("read central directory error");
+  }
+  size_t file_count = 0;
+  for (const auto &entry : entries) {
+    if (entry.is_dir) {
+      continue;
+    }
+    ++file_count;
+    if (extracted_.find(entry.name) == extracted_.end()) {
+      name_ = entry.name;
+      return Fail("entry missing from local headers");
+    }
+#ifndef _WIN32
+    xl::native_string native_path;
+    ToRelativeNativePath(entry.name, native_path);
+    xl::native_string path = xl::path::join(target_dir_, native_path);
+    if (S_ISLNK(entry.mode)) {
+      std::string link;
+      FILE *f = fopen(path.c_str(), "rb");
+      if (f != nullptr) {
+        char buffer[4096];
+        size_t size = 0;
+        while ((size = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+          link.append(buffer, size);
+        }
+        fclose(f);
+      }
+      unlink(path.c_str());
+      if (symlink(link.c_str(), path.c_str()) != 0) {
+        name_ = entry.name;
+        return Fail("create symlink error");
+      }
+    } else if ((entry.mode & 0777) != 0) {
+      chmod(path.c_str(), entry.mode & 07777);
+    }
+#endif
+  }
+  if (file_count != extracted_.size()) {
+    return Fail("entries not in central directory");
+  }
+  XL_LOG_INFO("Streaming extraction finished, files: ", file_count);
+  return true;
+}
+
+} // namespace selfupdate
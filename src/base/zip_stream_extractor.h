@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <set>
+#include <string>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// Extracts a zip package while it is being downloaded, following the local file headers in stream order.
+//
+// Entries written with a data descriptor after stored data can not be followed, nor can encrypted ones. Write()
+// returns false from then on, and the caller should extract the package as usual. Nothing written into target_dir
+// should be used before Finish() succeeds, which the caller only calls when the whole package has been verified.
+class ZipStreamExtractor {
+public:
+  ZipStreamExtractor();
+  ~ZipStreamExtractor();
+  ZipStreamExtractor(const ZipStreamExtractor &) = delete;
+  ZipStreamExtractor &operator=(const ZipStreamExtractor &) = delete;
+
+  bool Open(const xl::native_string &target_dir);
+  bool Write(const void *data, size_t size);
+  // Checks the extracted entries against the central directory of package_file, and restores unix modes and
+  // symlinks, which are only recorded there.
+  bool Finish(const xl::native_string &package_file);
+
+  bool failed() const {
+    return failed_;
+  }
+  // Entries written, files and directories.
+  unsigned long long entry_count() const {
+    return extracted_.size() + dir_entry_count_;
+  }
+
+private:
+  enum State {
+    STATE_HEADER,
+    STATE_NAME,
+    STATE_DATA,
+    STATE_DESCRIPTOR,
+    STATE_DONE,
+  };
+
+  bool Fill(const unsigned char *&data, size_t &size, size_t needed);
+  bool BeginEntry();
+  size_t WriteData(const unsigned char *data, size_t size);
+  bool EndEntry();
+  bool Fail(const char *reason);
+
+  xl::native_string target_dir_;
+  State state_ = STATE_HEADER;
+  bool failed_ = false;
+  std::string pending_;
+
+  // Current entry.
+  std::string name_;
+  uint16_t flags_ = 0;
+  uint16_t method_ = 0;
+  uint32_t expected_crc_ = 0;
+  uint64_t compressed_size_ = 0;
+  uint64_t size_ = 0;
+  bool zip64_ = false;
+  uint64_t consumed_ = 0;
+  uint64_t written_ = 0;
+  uint32_t crc_ = 0;
+  FILE *file_ = nullptr;
+  struct Inflater;
+  std::unique_ptr<Inflater> inflater_;
+
+  std::set<std::string> extracted_;
+  size_t dir_entry_count_ = 0;
+  std::set<xl::native_string> created_dirs_;
+};
+
+} // namespace selfupdate
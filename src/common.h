@@ -1,6 +1,9 @@
 #pragma once
 
 #define PACKAGEINFO_PACKAGE_FORMAT_ZIP "zip"
+#define PACKAGEINFO_PACKAGE_FORMAT_DELTA "delta"
+#define PACKAGEINFO_PACKAGE_FORMAT_MANIFEST "manifest"
+#define PACKAGEINFO_PACKAGE_FORMAT_TAR_ZSTD "tar.zst"
 
 #define PACKAGEINFO_PACKAGE_HASH_ALGO_MD5 "md5"
 #define PACKAGEINFO_PACKAGE_HASH_ALGO_SHA1 "sha1"
@@ -12,10 +15,41 @@
 #define PACKAGE_NAME_VERSION_SEP "-"
 #define FILE_NAME_EXT_SEP "."
 
+#define INSTALL_LOCATION_OLD_SUFFIX ".old"
+#define INSTALL_LOCATION_NEW_SUFFIX ".new"
+#define INSTALL_LOCATION_STAGING_SUFFIX ".staging"
+#define INSTALL_LOCATION_PREPARING_SUFFIX ".preparing"
+#define INSTALL_LOCATION_TRASH_SUFFIX ".trash"
+#define INSTALL_LOCATION_VERSIONS_SUFFIX ".versions"
+#define INSTALL_LOCATION_SWITCH_SUFFIX ".switch"
+#define INSTALL_VERSIONS_HISTORY_FILE_NAME ".history"
+#define INSTALL_VERSION_INITIAL_NAME "initial"
+#define STAGED_MARKER_SUFFIX ".staged"
+#define STAGED_OWNER_SUFFIX ".owner"
+#define STAGED_OWNER_INSTALLER "installer"
+#define STAGED_DELETED_LIST_FILE_NAME ".selfupdate.deleted"
+#define DELTA_FAILED_SUFFIX ".failed"
+#define UPDATE_TRACE_FILE_SUFFIX ".trace.json"
+#define HANDOFF_FILE_SUFFIX ".handoff"
+#define CRC32_CACHE_DIR_NAME "selfupdate-crc"
+#define CRC32_CACHE_FILE_EXT ".crc"
+#define QUERY_CACHE_DIR_NAME "selfupdate-query"
+#define PACKAGE_STORE_DIR_NAME "selfupdate-packages"
+#define INSTALL_ID_DIR_NAME "selfupdate-ids"
+#define INSTALL_ID_FILE_EXT ".id"
+#define DOWNLOADING_FILE_SUFFIX ".downloading"
+
 #define INSTALLER_ARGUMENT_UPDATE "update"
 #define INSTALLER_ARGUMENT_WAIT_PID "wait-pid"
 #define INSTALLER_ARGUMENT_FORCE_UPDATE "force"
 #define INSTALLER_ARGUMENT_SOURCE "source"
 #define INSTALLER_ARGUMENT_TARGET "target"
 #define INSTALLER_ARGUMENT_LAUNCH_FILE "launch-file"
+#define INSTALLER_ARGUMENT_EXTRACT_THREADS "extract-threads"
+#define INSTALLER_ARGUMENT_INCREMENTAL "incremental"
+#define INSTALLER_ARGUMENT_TRACE_FILE "trace-file"
+#define INSTALLER_ARGUMENT_HANDOFF "handoff"
+#define INSTALLER_ARGUMENT_VERSION "version"
+#define INSTALLER_ARGUMENT_KEEP_VERSIONS "keep-versions"
+#define INSTALLER_ARGUMENT_KEEP_INSTALLER "keep-installer"
 #define INSTALLER_ARGUMENT_NEW_VERSION "new-version"
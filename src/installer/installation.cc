@@ -0,0 +1,357 @@
+#include "installation.h"
+#include "../base/file_util.h"
+#include "../base/stopwatch.h"
+#include "../base/versioned_install.h"
+#include "../common.h"
+#include <algorithm>
+#include <cstdio>
+#include <cwctype>
+#include <string>
+#include <utility>
+#include <vector>
+#include <xl/file>
+#include <xl/log>
+#include <xl/process>
+
+namespace selfupdate {
+
+namespace {
+
+// Renaming fails on Windows while files in the installation are open, e.g. the executable of a main process that has
+// released its other files but not exited yet. They are usually closed within milliseconds, so retries start soon,
+// then slow down to once a second. Given up after the same bound as the former loop of 10000 retries a second apart,
+// about 2.8 hours, as the main process may take that long to exit, e.g. waiting for the user to close a dialog.
+const long long RENAME_RETRY_TIMEOUT_MS = 10000LL * 1000;
+const int RENAME_RETRY_MIN_MS = 10;
+const int RENAME_RETRY_MAX_MS = 1000;
+const int MAX_TRASH_ENTRIES = 1000;
+
+xl::native_string ParentPath(const xl::native_string &path) {
+#ifdef _WIN32
+  size_t pos = path.find_last_of(_T("\\/"));
+#else
+  size_t pos = path.find_last_of('/');
+#endif
+  return pos == xl::native_string::npos ? xl::native_string() : path.substr(0, pos);
+}
+
+// Names differing only in case are the same file on Windows.
+xl::native_string PathKey(const xl::native_string &path) {
+#ifdef _WIN32
+  xl::native_string key = path;
+  std::transform(key.begin(), key.end(), key.begin(), [](wchar_t c) {
+    return (wchar_t)std::towlower(c);
+  });
+  return key;
+#else
+  return path;
+#endif
+}
+
+std::unordered_set<xl::native_string> ListDirectory(const xl::native_string &dir) {
+  std::unordered_set<xl::native_string> paths;
+  xl::fs::enum_dir(
+      dir.c_str(),
+      [&paths](const xl::native_string &path, bool is_dir) -> bool {
+        paths.insert(path);
+        return true;
+      },
+      true);
+  return paths;
+}
+
+// Adds the paths a delta package deleted, listed in STAGED_DELETED_LIST_FILE_NAME in dir, to paths. The list is not
+// part of the installation and is removed.
+void TakeDeletedPaths(const xl::native_string &dir, std::unordered_set<xl::native_string> &paths) {
+  xl::native_string list_file = xl::path::join(dir, _T(STAGED_DELETED_LIST_FILE_NAME));
+  FILE *f = _tfopen(list_file.c_str(), _T("rb"));
+  if (f == nullptr) {
+    return;
+  }
+  std::string content;
+  char buffer[4096];
+  for (size_t size; (size = fread(buffer, 1, sizeof(buffer), f)) > 0;) {
+    content.append(buffer, size);
+  }
+  fclose(f);
+  xl::fs::remove(list_file.c_str());
+
+  for (size_t begin = 0; begin < content.size();) {
+    size_t end = content.find('\n', begin);
+    if (end == std::string::npos) {
+      end = content.size();
+    }
+    xl::native_string path;
+    if (ToRelativeNativePath(content.substr(begin, end - begin), path)) {
+      paths.insert(path);
+    }
+    begin = end + 1;
+  }
+  XL_LOG_INFO("Paths deleted by the new installation: ", paths.size());
+}
+
+// Moves everything of the old installation that is not in new_paths into the new one. Only the topmost missing
+// directory is moved, its contents go along.
+void MoveExtraFiles(const xl::native_string &install_location_old,
+                    const xl::native_string &install_location,
+                    const std::unordered_set<xl::native_string> &new_paths) {
+  std::vector<xl::native_string> old_paths;
+  xl::fs::enum_dir(
+      install_location_old.c_str(),
+      [&old_paths](const xl::native_string &path, bool is_dir) -> bool {
+        old_paths.push_back(path);
+        return true;
+      },
+      true);
+  // Parents sort before their contents.
+  std::sort(old_paths.begin(), old_paths.end());
+  std::unordered_set<xl::native_string> new_keys;
+  for (const auto &path : new_paths) {
+    new_keys.insert(PathKey(path));
+  }
+
+  std::unordered_set<xl::native_string> moved;
+  std::vector<const xl::native_string *> extras;
+  for (const auto &path : old_paths) {
+    if (new_keys.find(PathKey(path)) != new_keys.end()) {
+      continue;
+    }
+    moved.insert(path);
+    if (moved.find(ParentPath(path)) == moved.end()) {
+      extras.push_back(&path);
+    }
+  }
+
+  XL_LOG_INFO("Moving extra files from old installation, count: ", extras.size(), ", of: ", old_paths.size());
+  for (const auto *path : extras) {
+    xl::native_string old_path = xl::path::join(install_location_old.c_str(), path->c_str());
+    xl::native_string new_path = xl::path::join(install_location.c_str(), path->c_str());
+    if (!xl::fs::move(old_path.c_str(), new_path.c_str())) {
+      XL_LOG_WARN("Moving extra file failed. (", old_path, " => ", new_path, ")");
+    }
+  }
+}
+
+// Renames from_path to to_path, retrying while it is in use.
+bool RenameInstallation(const xl::native_string &from_path, const xl::native_string &to_path, UpdateMetrics *metrics) {
+  Stopwatch rename_time;
+  int retry_ms = RENAME_RETRY_MIN_MS;
+  while (xl::fs::exists(from_path.c_str()) && !xl::fs::move(from_path.c_str(), to_path.c_str()) &&
+         rename_time.ElapsedMilliseconds() < RENAME_RETRY_TIMEOUT_MS) {
+    XL_LOG_WARN("Renaming old installation failed, retrying in ", retry_ms, "ms. (", from_path, " => ", to_path, ")");
+    if (metrics != nullptr) {
+      ++metrics->rename_retries;
+    }
+    xl::process::sleep(retry_ms);
+    retry_ms = std::min(retry_ms * 2, RENAME_RETRY_MAX_MS);
+  }
+  if (xl::fs::exists(from_path.c_str())) {
+    XL_LOG_WARN("Renaming old installation failed. (", from_path, " => ", to_path, ")");
+    return false;
+  }
+  return true;
+}
+
+// Copies everything of the active version that is not in new_paths into the new one, the active version is kept
+// intact for rolling back.
+void CopyExtraFiles(const xl::native_string &active_dir,
+                    const xl::native_string &version_dir,
+                    const std::unordered_set<xl::native_string> &new_paths) {
+  std::vector<std::pair<xl::native_string, bool>> old_paths;
+  xl::fs::enum_dir(
+      active_dir.c_str(),
+      [&old_paths](const xl::native_string &path, bool is_dir) -> bool {
+        old_paths.emplace_back(path, is_dir);
+        return true;
+      },
+      true);
+  // Parents sort before their contents.
+  std::sort(old_paths.begin(), old_paths.end());
+
+  size_t count = 0;
+  for (const auto &item : old_paths) {
+    if (new_paths.find(item.first) != new_paths.end()) {
+      continue;
+    }
+    ++count;
+    xl::native_string old_path = xl::path::join(active_dir.c_str(), item.first.c_str());
+    xl::native_string new_path = xl::path::join(version_dir.c_str(), item.first.c_str());
+    if (item.second) {
+      xl::fs::mkdirs(new_path.c_str());
+    }
+    if (item.second ? !IsDirectory(new_path) : !xl::fs::copy(old_path.c_str(), new_path.c_str())) {
+      XL_LOG_WARN("Copying extra file failed. (", old_path, " => ", new_path, ")");
+    }
+  }
+  XL_LOG_INFO("Copied extra files from active version, count: ", count, ", of: ", old_paths.size());
+}
+
+// Returns name, or name with a number appended if that is taken in versions_dir.
+xl::native_string GetFreeVersionName(const xl::native_string &versions_dir, const xl::native_string &name) {
+  xl::native_string free_name = name;
+  for (int i = 1; xl::fs::exists(xl::path::join(versions_dir, free_name).c_str()); ++i) {
+    free_name = name + _T("-") + xl::to_native_string(i);
+  }
+  return free_name;
+}
+
+bool ActivateVersion(const xl::native_string &install_location,
+                     const xl::native_string &version,
+                     const std::unordered_set<xl::native_string> &new_paths,
+                     UpdateMetrics *metrics) {
+  xl::native_string versions_dir = GetVersionsDir(install_location);
+  xl::fs::mkdirs(versions_dir.c_str());
+  std::vector<xl::native_string> history = ReadVersionHistory(install_location);
+
+  xl::native_string active;
+  if (!GetActiveVersion(install_location, active) && xl::fs::exists(install_location.c_str())) {
+    // The first versioned install, the installation in place becomes a version too.
+    active = GetFreeVersionName(versions_dir, _T(INSTALL_VERSION_INITIAL_NAME));
+    XL_LOG_INFO("Moving installation into versions directory, as: ", active);
+    if (!RenameInstallation(install_location, xl::path::join(versions_dir, active), metrics)) {
+      return false;
+    }
+    if (!SwitchVersion(install_location, active)) {
+      xl::fs::move(xl::path::join(versions_dir, active).c_str(), install_location.c_str());
+      return false;
+    }
+    history.push_back(active);
+  }
+
+  // Reinstalling the active version goes next to it, any other version of that name is replaced.
+  xl::native_string name = version == active ? GetFreeVersionName(versions_dir, version) : version;
+  xl::native_string version_dir = xl::path::join(versions_dir, name);
+  MoveToTrash(install_location, version_dir);
+  xl::native_string install_location_new = install_location + _T(INSTALL_LOCATION_NEW_SUFFIX);
+  XL_LOG_INFO("Renaming new installation. (", install_location_new, " => ", version_dir, ")");
+  if (!xl::fs::move(install_location_new.c_str(), version_dir.c_str())) {
+    XL_LOG_ERROR("Renaming new installation failed. (", install_location_new, " => ", version_dir, ")");
+    return false;
+  }
+  if (!active.empty()) {
+    CopyExtraFiles(xl::path::join(versions_dir, active), version_dir, new_paths);
+  }
+
+  if (!SwitchVersion(install_location, name)) {
+    return false;
+  }
+  history.erase(std::remove(history.begin(), history.end(), name), history.end());
+  history.push_back(name);
+  WriteVersionHistory(install_location, history);
+  return true;
+}
+
+} // namespace
+
+void MoveToTrash(const xl::native_string &install_location, const xl::native_string &path) {
+  if (!xl::fs::exists(path.c_str())) {
+    return;
+  }
+  xl::native_string trash_dir = install_location + _T(INSTALL_LOCATION_TRASH_SUFFIX);
+  xl::fs::mkdirs(trash_dir.c_str());
+  for (int i = 0; i < MAX_TRASH_ENTRIES; ++i) {
+    xl::native_string trash_path = xl::path::join(trash_dir, xl::to_native_string(i));
+    if (xl::fs::exists(trash_path.c_str())) {
+      continue;
+    }
+    if (xl::fs::move(path.c_str(), trash_path.c_str())) {
+      return;
+    }
+    break;
+  }
+  XL_LOG_WARN("Moving to trash failed, deleting now: ", path);
+  xl::fs::remove_all(path.c_str());
+}
+
+void EmptyTrash(const xl::native_string &install_location) {
+  xl::native_string trash_dir = install_location + _T(INSTALL_LOCATION_TRASH_SUFFIX);
+  if (xl::fs::exists(trash_dir.c_str())) {
+    XL_LOG_INFO("Emptying trash: ", trash_dir);
+    xl::fs::remove_all(trash_dir.c_str());
+  }
+}
+
+bool ReplaceInstallation(const xl::native_string &install_location,
+                         const std::unordered_set<xl::native_string> *new_paths,
+                         UpdateMetrics *metrics,
+                         const xl::native_string &version) {
+  xl::native_string install_location_old = install_location + _T(INSTALL_LOCATION_OLD_SUFFIX);
+  xl::native_string install_location_new = install_location + _T(INSTALL_LOCATION_NEW_SUFFIX);
+
+  std::unordered_set<xl::native_string> listed_paths;
+  if (new_paths == nullptr) {
+    listed_paths = ListDirectory(install_location_new);
+    new_paths = &listed_paths;
+  }
+  if (!version.empty()) {
+    return ActivateVersion(install_location, version, *new_paths, metrics);
+  }
+
+  // Installing in place over a versioned install converts it back. Extra files are taken from the active version
+  // rather than through the renamed symlink, and the versions are trashed once the new installation is in place.
+  xl::native_string active;
+  bool versioned = GetActiveVersion(install_location, active);
+  xl::native_string old_dir =
+      versioned ? xl::path::join(GetVersionsDir(install_location), active) : install_location_old;
+
+  XL_LOG_INFO(_T("Renaming old installation, from: "), install_location.c_str(), _T(", to: "),
+              install_location_old.c_str());
+  if (!RenameInstallation(install_location, install_location_old, metrics)) {
+    return false;
+  }
+
+  XL_LOG_INFO("Renaming new installation. (", install_location_new, " => ", install_location, ")");
+  if (!xl::fs::move(install_location_new.c_str(), install_location.c_str())) {
+    XL_LOG_ERROR("Renaming new installation failed. (", install_location_new, " => ", install_location, ")");
+    // The old installation is put back rather than leaving none.
+    if (!xl::fs::move(install_location_old.c_str(), install_location.c_str())) {
+      XL_LOG_ERROR("Restoring old installation failed. (", install_location_old, " => ", install_location, ")");
+    }
+    return false;
+  }
+
+  if (xl::fs::exists(old_dir.c_str())) {
+    MoveExtraFiles(old_dir, install_location, *new_paths);
+    // Deleted after the new version is launched.
+    MoveToTrash(install_location, install_location_old);
+  }
+  if (versioned) {
+    XL_LOG_INFO("Installed in place, dropping versions of: ", install_location);
+    MoveToTrash(install_location, GetVersionsDir(install_location));
+  }
+  return true;
+}
+
+bool InstallStagedDirectory(const xl::native_string &staged_dir,
+                            const xl::native_string &install_location,
+                            UpdateMetrics *metrics,
+                            const xl::native_string &version) {
+  XL_LOG_INFO(_T("Installing staged directory, from: "), staged_dir.c_str(), _T(", to: "), install_location.c_str());
+
+  xl::native_string install_location_old = install_location + _T(INSTALL_LOCATION_OLD_SUFFIX);
+  MoveToTrash(install_location, install_location_old);
+  xl::native_string install_location_new = install_location + _T(INSTALL_LOCATION_NEW_SUFFIX);
+  if (staged_dir != install_location_new) {
+    MoveToTrash(install_location, install_location_new);
+    if (!xl::fs::move(staged_dir.c_str(), install_location_new.c_str())) {
+      XL_LOG_ERROR(_T("Moving staged directory failed, from: "), staged_dir.c_str(), _T(", to: "),
+                   install_location_new.c_str());
+      return false;
+    }
+  }
+
+  // Paths deleted by a delta package count as part of the new installation, so they are not carried over.
+  std::unordered_set<xl::native_string> new_paths;
+  TakeDeletedPaths(install_location_new, new_paths);
+  for (const auto &path : ListDirectory(install_location_new)) {
+    new_paths.insert(path);
+  }
+  if (!ReplaceInstallation(install_location, &new_paths, metrics, version)) {
+    return false;
+  }
+
+  XL_LOG_INFO("Install staged directory OK");
+  return true;
+}
+
+} // namespace selfupdate
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <selfupdate/updater.h>
+#include <unordered_set>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// Replaces install_location with the complete new installation in install_location + INSTALL_LOCATION_NEW_SUFFIX.
+// Files of the old installation that the new one does not have are carried over, the rest of it is moved to the
+// trash. new_paths are the relative paths of everything in the new installation, directories included, listed from
+// the directory when null. Retries of renaming the old installation are counted in metrics, if not null.
+//
+// If version is not empty, the new installation becomes that version of a versioned install instead, see
+// versioned_install.h, and install_location is switched to it. Files it does not have are copied from the active
+// version, which is left as it is for rolling back. An installation in place is moved into the versions directory
+// first.
+bool ReplaceInstallation(const xl::native_string &install_location,
+                         const std::unordered_set<xl::native_string> *new_paths = nullptr,
+                         UpdateMetrics *metrics = nullptr,
+                         const xl::native_string &version = xl::native_string());
+
+// Installs a directory that was prepared before the installer started, e.g. files reconstructed from a delta package.
+bool InstallStagedDirectory(const xl::native_string &staged_dir,
+                            const xl::native_string &install_location,
+                            UpdateMetrics *metrics = nullptr,
+                            const xl::native_string &version = xl::native_string());
+
+// Moves path, a leftover next to install_location, into install_location + INSTALL_LOCATION_TRASH_SUFFIX, which is one
+// rename instead of deleting a whole tree while the application is down. Deletes it right away if that fails.
+void MoveToTrash(const xl::native_string &install_location, const xl::native_string &path);
+// Deletes what MoveToTrash() collected, meant for after the new version is launched.
+void EmptyTrash(const xl::native_string &install_location);
+
+} // namespace selfupdate
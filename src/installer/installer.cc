@@ -1,8 +1,16 @@
+#include "../base/file_util.h"
+#include "../base/process_handoff.h"
+#include "../base/stopwatch.h"
+#include "../base/update_trace.h"
+#include "../base/versioned_install.h"
 #include "../common.h"
+#include "installation.h"
+#include "tar_installer.h"
 #include "zip_installer.h"
 #include <cstdio>
 #include <selfupdate/installer.h>
 #include <sstream>
+#include <vector>
 #include <xl/cmdline_options>
 #include <xl/encoding>
 #include <xl/file>
@@ -14,6 +22,7 @@
 #ifdef _WIN32
 #include <Windows.h>
 #else
+#include <sys/resource.h>
 #include <unistd.h>
 #endif
 
@@ -25,6 +34,13 @@ struct InstallContext {
   xl::native_string source;
   xl::native_string target;
   xl::native_string launch_file;
+  unsigned extract_thread_count = 0;
+  bool incremental = false;
+  xl::native_string trace_file;
+  xl::native_string handoff;
+  xl::native_string version;
+  unsigned keep_versions = 0;
+  bool keep_installer = false;
 };
 
 namespace {
@@ -43,6 +59,28 @@ const InstallContext *IsInstallMode(const xl::cmdline_options::parsed_options &o
   xl::native_string source = options.get(_T(INSTALLER_ARGUMENT_SOURCE));
   xl::native_string target = options.get(_T(INSTALLER_ARGUMENT_TARGET));
   xl::native_string launch_file = options.get(_T(INSTALLER_ARGUMENT_LAUNCH_FILE));
+  unsigned extract_thread_count = 0;
+  if (options.has(_T(INSTALLER_ARGUMENT_EXTRACT_THREADS))) {
+    extract_thread_count = options.get_as<unsigned>(_T(INSTALLER_ARGUMENT_EXTRACT_THREADS));
+  }
+  bool incremental = options.has(_T(INSTALLER_ARGUMENT_INCREMENTAL)) &&
+                     options.get_as<bool>(_T(INSTALLER_ARGUMENT_INCREMENTAL));
+  xl::native_string trace_file;
+  if (options.has(_T(INSTALLER_ARGUMENT_TRACE_FILE))) {
+    trace_file = options.get(_T(INSTALLER_ARGUMENT_TRACE_FILE));
+  }
+  xl::native_string handoff;
+  if (options.has(_T(INSTALLER_ARGUMENT_HANDOFF))) {
+    handoff = options.get(_T(INSTALLER_ARGUMENT_HANDOFF));
+  }
+  xl::native_string version;
+  unsigned keep_versions = 0;
+  if (options.has(_T(INSTALLER_ARGUMENT_VERSION)) && options.has(_T(INSTALLER_ARGUMENT_KEEP_VERSIONS))) {
+    version = options.get(_T(INSTALLER_ARGUMENT_VERSION));
+    keep_versions = options.get_as<unsigned>(_T(INSTALLER_ARGUMENT_KEEP_VERSIONS));
+  }
+  bool keep_installer = options.has(_T(INSTALLER_ARGUMENT_KEEP_INSTALLER)) &&
+                        options.get_as<bool>(_T(INSTALLER_ARGUMENT_KEEP_INSTALLER));
 
   auto trim_quote = [](xl::native_string &s) -> xl::native_string & {
     s.erase(0, s.find_first_not_of(_T('"'), 0));
@@ -52,6 +90,9 @@ const InstallContext *IsInstallMode(const xl::cmdline_options::parsed_options &o
   trim_quote(source);
   trim_quote(target);
   trim_quote(launch_file);
+  trim_quote(trace_file);
+  trim_quote(handoff);
+  trim_quote(version);
 
   InstallContext *install_context = new InstallContext;
   install_context->wait_pid = wait_pid;
@@ -59,9 +100,27 @@ const InstallContext *IsInstallMode(const xl::cmdline_options::parsed_options &o
   install_context->source = source;
   install_context->target = target;
   install_context->launch_file = launch_file;
+  install_context->extract_thread_count = extract_thread_count;
+  install_context->incremental = incremental;
+  install_context->trace_file = trace_file;
+  install_context->handoff = handoff;
+  install_context->version = version;
+  install_context->keep_versions = keep_versions;
+  install_context->keep_installer = keep_installer;
   return install_context;
 }
 
+void LowerPriority() {
+#if defined(_WIN32) && _WIN32_WINNT >= 0x0600
+  ::SetPriorityClass(::GetCurrentProcess(), PROCESS_MODE_BACKGROUND_BEGIN);
+#elif defined(_WIN32)
+  // Background mode, which also lowers I/O priority, is only there since Vista.
+  ::SetPriorityClass(::GetCurrentProcess(), IDLE_PRIORITY_CLASS);
+#else
+  setpriority(PRIO_PROCESS, 0, 19);
+#endif
+}
+
 } // namespace
 
 const InstallContext *IsInstallMode(int argc, const TCHAR *argv[]) {
@@ -74,8 +133,6 @@ const InstallContext *IsInstallMode(const TCHAR *command_line) {
 }
 #endif
 
-const int INSTALL_WAIT_FOR_MAIN_PROCESS = 10000;
-
 bool DoInstall(const InstallContext *install_context) {
   XL_LOG_INFO(_T("Installing, from: "), install_context->source.c_str(), _T(", to: "), install_context->target.c_str());
 
@@ -87,16 +144,55 @@ bool DoInstall(const InstallContext *install_context) {
     return false;
   }
 
-  if (!xl::process::wait(install_context->wait_pid, INSTALL_WAIT_FOR_MAIN_PROCESS)) {
-    xl::process::wait(install_context->wait_pid);
+  Stopwatch handoff;
+  bool released = false;
+  WaitForHandoff(install_context->wait_pid, install_context->handoff, released);
+  // The application is down from here until the new version is launched.
+  Stopwatch downtime;
+  XL_LOG_INFO(released ? _T("Main process released its files, after: ") : _T("Main process exited, after: "),
+              handoff.ElapsedMilliseconds(), _T("ms"));
+  UpdateMetrics metrics;
+  if (!install_context->trace_file.empty()) {
+    ReadUpdateTrace(install_context->trace_file, metrics);
   }
+  metrics.files_released = released;
 
   xl::native_string package_file = install_context->source;
   xl::native_string install_location = install_context->target;
+  xl::native_string version = install_context->version;
+  if (!version.empty() && !IsValidVersionName(version)) {
+    XL_LOG_WARN(_T("Invalid version name, installing in place: "), version.c_str());
+    version.clear();
+  }
+#ifdef _WIN32
+  if (!version.empty()) {
+    XL_LOG_WARN(_T("Versioned installs are not supported on Windows, installing in place."));
+    version.clear();
+  }
+#endif
 
   xl::native_string package_format = xl::path::extname(package_file.c_str());
-  if (package_format == _T(FILE_NAME_EXT_SEP PACKAGEINFO_PACKAGE_FORMAT_ZIP)) {
-    if (!InstallZipPackage(package_file, install_location)) {
+  xl::native_string tar_zstd_suffix = _T(FILE_NAME_EXT_SEP PACKAGEINFO_PACKAGE_FORMAT_TAR_ZSTD);
+  if (IsDirectory(package_file)) {
+    bool installed = InstallStagedDirectory(package_file, install_location, &metrics, version);
+    // Released to Download() and Stage(), whatever is left of it.
+    xl::fs::remove((install_location + _T(INSTALL_LOCATION_NEW_SUFFIX STAGED_OWNER_SUFFIX)).c_str());
+    if (!installed) {
+      XL_LOG_ERROR(_T("Install staged directory failed, from: "), install_context->source.c_str(), _T(", to: "),
+                   install_context->target.c_str());
+      return false;
+    }
+  } else if (package_format == _T(FILE_NAME_EXT_SEP PACKAGEINFO_PACKAGE_FORMAT_ZIP)) {
+    if (!InstallZipPackage(package_file, install_location, install_context->extract_thread_count,
+                           install_context->incremental, &metrics, version)) {
+      XL_LOG_ERROR(_T("Install package failed, from: "), install_context->source.c_str(), _T(", to: "),
+                   install_context->target.c_str());
+      return false;
+    }
+  } else if (package_file.size() > tar_zstd_suffix.size() &&
+             package_file.compare(package_file.size() - tar_zstd_suffix.size(), tar_zstd_suffix.size(),
+                                  tar_zstd_suffix) == 0) {
+    if (!InstallTarZstdPackage(package_file, install_location, &metrics, version)) {
       XL_LOG_ERROR(_T("Install package failed, from: "), install_context->source.c_str(), _T(", to: "),
                    install_context->target.c_str());
       return false;
@@ -107,7 +203,42 @@ bool DoInstall(const InstallContext *install_context) {
   }
   xl::fs::remove(package_file.c_str());
 
+  bool launched = true;
   {
+    xl::native_string launch_path = xl::path::join(install_location, install_context->launch_file);
+    std::vector<xl::native_string> launch_args = {
+        _T("--" INSTALLER_ARGUMENT_NEW_VERSION),
+        _T("--" INSTALLER_ARGUMENT_FORCE_UPDATE),
+        install_context->force_update ? _T("1") : _T("0"),
+    };
+    // Written before launching, the new version may read it as soon as it starts.
+    metrics.downtime_ms = downtime.ElapsedMilliseconds();
+    if (!install_context->trace_file.empty() && WriteUpdateTrace(install_context->trace_file, metrics)) {
+      launch_args.push_back(_T("--" INSTALLER_ARGUMENT_TRACE_FILE));
+      launch_args.push_back(install_context->trace_file);
+    }
+    XL_LOG_INFO(_T("Launching new version. Command line: "), launch_path.c_str(),
+                _T("--" INSTALLER_ARGUMENT_NEW_VERSION), _T("--" INSTALLER_ARGUMENT_FORCE_UPDATE),
+                install_context->force_update ? _T("1") : _T("0"), _T(" --" INSTALLER_ARGUMENT_TRACE_FILE " "),
+                install_context->trace_file.c_str(), _T(", downtime: "), metrics.downtime_ms, _T("ms"));
+    long pid = xl::process::start(launch_path.c_str(), launch_args, install_location);
+    if (pid == 0) {
+      XL_LOG_ERROR(_T("Launch new version failed. Command line: "), launch_path.c_str(),
+                   _T("--" INSTALLER_ARGUMENT_NEW_VERSION));
+      launched = false;
+    }
+  }
+
+  // The new version is installed, and running unless it failed to launch. What is left is no longer in its way.
+  LowerPriority();
+  EmptyTrash(install_location);
+  if (!version.empty()) {
+    CollectVersions(install_location, install_context->keep_versions);
+  }
+
+  if (install_context->keep_installer) {
+    XL_LOG_INFO(_T("Keeping installer for the next update: "), exe_path.c_str());
+  } else {
 #ifdef _WIN32
     xl::native_string_stream ss;
     ss << _T("cmd /C ping 127.0.0.1 -n 10 >Nul & Del /F /Q \"") << exe_path << _T("\" & RMDIR /Q \"")
@@ -124,25 +255,9 @@ bool DoInstall(const InstallContext *install_context) {
 #endif
   }
 
-  {
-    xl::native_string launch_path = xl::path::join(install_location, install_context->launch_file);
-    XL_LOG_INFO(_T("Launching new version. Command line: "), launch_path.c_str(),
-                _T("--" INSTALLER_ARGUMENT_NEW_VERSION), _T("--" INSTALLER_ARGUMENT_FORCE_UPDATE),
-                install_context->force_update ? _T("1") : _T("0"));
-    long pid = xl::process::start(launch_path.c_str(),
-                                  {
-                                      _T("--" INSTALLER_ARGUMENT_NEW_VERSION),
-                                      _T("--" INSTALLER_ARGUMENT_FORCE_UPDATE),
-                                      install_context->force_update ? _T("1") : _T("0"),
-                                  },
-                                  install_location);
-    if (pid == 0) {
-      XL_LOG_ERROR(_T("Launch new version failed. Command line: "), launch_path.c_str(),
-                   _T("--" INSTALLER_ARGUMENT_NEW_VERSION));
-      return false;
-    }
+  if (!launched) {
+    return false;
   }
-
   XL_LOG_INFO("Install package OK");
   return true;
 }
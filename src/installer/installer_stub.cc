@@ -0,0 +1,51 @@
+// A standalone installer, for applications that do not want to be merged with it. Install() copies the installer it
+// is given before every update, this stub is a fraction of the size of a statically linked application, and as it
+// does not change with the application, the copy is kept and reused by later updates.
+//
+// Pass its path as the installer_path of selfupdate::Install(). It only installs, and exits with an error when
+// launched otherwise.
+
+#include <selfupdate/installer.h>
+#include <xl/log_setup>
+#include <xl/native_string>
+#include <xl/scope_exit>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <shellapi.h>
+#endif
+
+namespace {
+
+int RunInstaller(int argc, const TCHAR *argv[]) {
+  xl::log::setup(_T("installer_stub"));
+  XL_ON_BLOCK_EXIT(xl::log::shutdown);
+
+  const selfupdate::InstallContext *install_context = selfupdate::IsInstallMode(argc, argv);
+  if (install_context == nullptr) {
+    XL_LOG_ERROR("Not launched by selfupdate::Install().");
+    return -1;
+  }
+  XL_LOG_INFO("Installing...");
+  return selfupdate::DoInstall(install_context) ? 0 : -1;
+}
+
+} // namespace
+
+#ifdef _WIN32
+// Built for the windows subsystem, so that no console shows up during the update.
+int WINAPI wWinMain(HINSTANCE, HINSTANCE, LPWSTR, int) {
+  int argc = 0;
+  LPWSTR *argv = ::CommandLineToArgvW(::GetCommandLineW(), &argc);
+  if (argv == nullptr) {
+    return -1;
+  }
+  int result = RunInstaller(argc, (const TCHAR **)argv);
+  ::LocalFree(argv);
+  return result;
+}
+#else
+int main(int argc, const char *argv[]) {
+  return RunInstaller(argc, argv);
+}
+#endif
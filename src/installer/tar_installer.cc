@@ -0,0 +1,45 @@
+#include "tar_installer.h"
+#include "../base/stopwatch.h"
+#include "../base/tar_extractor.h"
+#include "../common.h"
+#include "installation.h"
+#include <unordered_set>
+#include <xl/file>
+#include <xl/log>
+
+namespace selfupdate {
+
+bool InstallTarZstdPackage(const xl::native_string &package_file,
+                           const xl::native_string &install_location,
+                           UpdateMetrics *metrics,
+                           const xl::native_string &version) {
+  XL_LOG_INFO(_T("Installing tar.zst package, from: "), package_file.c_str(), _T(", to: "), install_location.c_str());
+
+  xl::native_string install_location_old = install_location + _T(INSTALL_LOCATION_OLD_SUFFIX);
+  MoveToTrash(install_location, install_location_old);
+  xl::native_string install_location_new = install_location + _T(INSTALL_LOCATION_NEW_SUFFIX);
+  MoveToTrash(install_location, install_location_new);
+
+  XL_LOG_INFO(_T("Extracting package, from: "), package_file.c_str(), _T(", to: "), install_location_new.c_str());
+  Stopwatch stopwatch;
+  std::unordered_set<xl::native_string> extracted_paths;
+  unsigned long long entry_count = 0;
+  if (!ExtractTarZstd(package_file, install_location_new, &extracted_paths, &entry_count)) {
+    XL_LOG_INFO(_T("Extract package failed, from: "), package_file.c_str(), _T(", to: "), install_location_new.c_str());
+    xl::fs::remove_all(install_location_new.c_str());
+    return false;
+  }
+  if (metrics != nullptr) {
+    metrics->extract_ms = stopwatch.ElapsedMilliseconds();
+    metrics->extracted_entries = entry_count;
+  }
+
+  if (!ReplaceInstallation(install_location, &extracted_paths, metrics, version)) {
+    return false;
+  }
+
+  XL_LOG_INFO("Install tar.zst package OK");
+  return true;
+}
+
+} // namespace selfupdate
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <selfupdate/updater.h>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// Installs a "tar.zst" package, extracting it next to install_location and swapping it in as InstallZipPackage() does.
+// Extraction and renaming are measured into metrics, if not null. If version is not empty, the package is installed as
+// that version of a versioned install.
+bool InstallTarZstdPackage(const xl::native_string &package_file,
+                           const xl::native_string &install_location,
+                           UpdateMetrics *metrics = nullptr,
+                           const xl::native_string &version = xl::native_string());
+
+} // namespace selfupdate
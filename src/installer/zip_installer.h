@@ -1,9 +1,22 @@
 #pragma once
 
+#include <selfupdate/updater.h>
 #include <xl/native_string>
 
 namespace selfupdate {
 
-bool InstallZipPackage(const xl::native_string &package_file, const xl::native_string &install_location);
+// Extracts with xl::zip when extract_thread_count is 1, in parallel otherwise, 0 for one thread per processor.
+//
+// If incremental, files of install_location that match an entry in size and CRC-32 are linked into the new installation
+// instead of being extracted again. CRC-32 of installed files are cached next to package_file for the next update.
+//
+// Extraction and renaming are measured into metrics, if not null. If version is not empty, the package is installed as
+// that version of a versioned install, see ReplaceInstallation().
+bool InstallZipPackage(const xl::native_string &package_file,
+                       const xl::native_string &install_location,
+                       unsigned extract_thread_count = 0,
+                       bool incremental = false,
+                       UpdateMetrics *metrics = nullptr,
+                       const xl::native_string &version = xl::native_string());
 
 } // namespace selfupdate
@@ -0,0 +1,45 @@
+#include "executor.h"
+#include <selfupdate/updater.h>
+
+namespace selfupdate {
+
+void QueryAsync(const std::string &query_url,
+                const std::multimap<std::string, std::string> &headers,
+                const std::string &query_body,
+                QueryCallback callback,
+                const CancellationToken &cancellation_token) {
+  PostTask([query_url, headers, query_body, callback, cancellation_token]() {
+    PackageInfo package_info;
+    bool succeeded = Query(query_url, headers, query_body, package_info, cancellation_token);
+    if (callback != nullptr) {
+      callback(succeeded, package_info);
+    }
+  });
+}
+
+void DownloadAsync(const PackageInfo &package_info,
+                   const DownloadOptions &download_options,
+                   DownloadProgressMonitor download_progress_monitor,
+                   DownloadCallback callback) {
+  PostTask([package_info, download_options, download_progress_monitor, callback]() {
+    bool succeeded = Download(package_info, download_options, download_progress_monitor);
+    if (callback != nullptr) {
+      callback(succeeded);
+    }
+  });
+}
+
+void StageAsync(const PackageInfo &package_info,
+                const InstallOptions &install_options,
+                const TCHAR *install_location,
+                StageCallback callback) {
+  // Extracting takes long enough to hold up a query or download queued behind it.
+  PostLongTask([package_info, install_options, install_location, callback]() {
+    bool succeeded = Stage(package_info, install_options, install_location);
+    if (callback != nullptr) {
+      callback(succeeded);
+    }
+  });
+}
+
+} // namespace selfupdate
@@ -0,0 +1,166 @@
+#include "backoff.h"
+#include "../base/file_util.h"
+#include "../base/hash.h"
+#include "../base/versioned_install.h"
+#include "../common.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <xl/encoding>
+#include <xl/file>
+#include <xl/log>
+#include <xl/process>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace selfupdate {
+
+namespace {
+
+const long long RETRY_BASE_DELAY_MS = 1000;
+const long long RETRY_MAX_DELAY_MS = 30000;
+// Longest sleep before the cancellation token is checked again.
+const long long MAX_SLEEP_SLICE_MS = 100;
+// Hex digits of the random installation id.
+const size_t INSTALL_ID_LENGTH = 32;
+
+std::string GetHostName() {
+#ifdef _WIN32
+  wchar_t name[MAX_COMPUTERNAME_LENGTH + 1] = {};
+  DWORD size = MAX_COMPUTERNAME_LENGTH + 1;
+  if (!GetComputerNameW(name, &size)) {
+    return {};
+  }
+  return std::string((const char *)name, size * sizeof(wchar_t));
+#else
+  char name[256] = {};
+  if (gethostname(name, sizeof(name) - 1) != 0) {
+    return {};
+  }
+  return name;
+#endif
+}
+
+std::mt19937_64 &RandomEngine() {
+  thread_local std::mt19937_64 engine(std::random_device{}());
+  return engine;
+}
+
+bool IsInstallId(const std::string &id) {
+  return id.size() == INSTALL_ID_LENGTH && id.find_first_not_of("0123456789abcdef") == std::string::npos;
+}
+
+// Random, created on first use and kept in a private directory of the user, one file per installation, named after a
+// hash of its location, which stays the same from version to version. The directory of the installation is usually
+// not writable by the user. Empty if it can neither be read nor written, which is not tried again by the process.
+std::string GetInstallId() {
+  static std::mutex mutex;
+  static std::string install_id;
+  static bool failed = false;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!install_id.empty() || failed) {
+    return install_id;
+  }
+
+  xl::native_string id_dir = GetPrivateTempDir(_T(INSTALL_ID_DIR_NAME));
+  if (id_dir.empty()) {
+    XL_LOG_WARN("Installation id directory not usable.");
+    failed = true;
+    return {};
+  }
+  xl::native_string install_location = GetInstallLocationOf(xl::path::dirname(xl::process::executable_path().c_str()));
+  auto location_hasher = FindHashAlgorithm(PACKAGEINFO_PACKAGE_HASH_ALGO_SHA256)->create();
+  location_hasher->Update(install_location.data(), install_location.size() * sizeof(install_location[0]));
+  xl::native_string id_file = xl::path::join(
+      id_dir, xl::encoding::utf8_to_native(location_hasher->Final().substr(0, INSTALL_ID_LENGTH) + INSTALL_ID_FILE_EXT));
+  char buffer[INSTALL_ID_LENGTH + 1] = {};
+  FILE *f = _tfopen(id_file.c_str(), _T("rb"));
+  if (f != nullptr) {
+    size_t size = fread(buffer, 1, sizeof(buffer), f);
+    fclose(f);
+    std::string id(buffer, size);
+    if (IsInstallId(id)) {
+      install_id = id;
+      return install_id;
+    }
+  }
+
+  std::random_device random;
+  std::string id;
+  while (id.size() < INSTALL_ID_LENGTH) {
+    id += "0123456789abcdef"[random() % 16];
+  }
+  // Written aside and renamed, another process never reads it half written.
+  xl::native_string temp_file = id_file + _T(".") + xl::to_native_string(xl::process::pid());
+  f = _tfopen(temp_file.c_str(), _T("wb"));
+  if (f == nullptr) {
+    XL_LOG_WARN("Create installation id failed: ", id_file);
+    failed = true;
+    return {};
+  }
+  bool written = fwrite(id.data(), 1, id.size(), f) == id.size();
+  if (fclose(f) != 0 || !written || !xl::fs::move(temp_file.c_str(), id_file.c_str())) {
+    XL_LOG_WARN("Write installation id failed: ", id_file);
+    xl::fs::remove(temp_file.c_str());
+    failed = true;
+    return {};
+  }
+  install_id = id;
+  return install_id;
+}
+
+} // namespace
+
+unsigned GetRolloutBucket(const std::string &salt) {
+  auto hasher = FindHashAlgorithm(PACKAGEINFO_PACKAGE_HASH_ALGO_SHA256)->create();
+  std::string install_id = GetInstallId();
+  if (!install_id.empty()) {
+    hasher->Update(install_id.data(), install_id.size() + 1);
+  } else {
+    xl::native_string executable_path = xl::process::executable_path();
+    std::string host_name = GetHostName();
+    hasher->Update(host_name.data(), host_name.size() + 1);
+    hasher->Update(executable_path.c_str(), (executable_path.size() + 1) * sizeof(executable_path[0]));
+  }
+  hasher->Update(salt.data(), salt.size());
+  // Hex digest, the first 8 digits are plenty for 100 buckets.
+  std::string digest = hasher->Final();
+  return (unsigned)(strtoull(digest.substr(0, 8).c_str(), nullptr, 16) % 100);
+}
+
+long long GetRetryDelayMs(unsigned attempt, long long min_delay_ms) {
+  long long cap = RETRY_BASE_DELAY_MS << std::min(attempt > 0 ? attempt - 1 : 0, 5u);
+  cap = std::min(cap, RETRY_MAX_DELAY_MS);
+  return std::max(GetRandomDelayMs(cap + 1), min_delay_ms);
+}
+
+long long GetRandomDelayMs(long long window_ms) {
+  if (window_ms <= 0) {
+    return 0;
+  }
+  return std::uniform_int_distribution<long long>(0, window_ms - 1)(RandomEngine());
+}
+
+bool SleepUnlessCancelled(long long delay_ms, const CancellationToken &cancellation_token) {
+  auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(delay_ms);
+  while (!cancellation_token.IsCancelled()) {
+    auto now = std::chrono::steady_clock::now();
+    if (now >= until) {
+      return true;
+    }
+    std::this_thread::sleep_for(
+        std::min(std::chrono::duration_cast<std::chrono::milliseconds>(until - now),
+                 std::chrono::milliseconds(MAX_SLEEP_SLICE_MS)));
+  }
+  return false;
+}
+
+} // namespace selfupdate
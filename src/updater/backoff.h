@@ -0,0 +1,29 @@
+#pragma once
+
+#include <selfupdate/updater.h>
+#include <string>
+
+namespace selfupdate {
+
+// Attempts of a query or a download, including the first one, before giving up on a transient error.
+const unsigned RETRY_ATTEMPT_COUNT = 3;
+// Longest Retry-After waited for within one call. The call fails instead if the server asks for more.
+const long long MAX_RETRY_AFTER_SECONDS = 60;
+
+// Bucket of this installation for staged rollouts, in [0, 100). Derived from a random id kept next to the installation,
+// or from the host name and the executable path if it cannot be written there, so that an installation is let in once
+// and stays in as the rollout percentage grows. salt is mixed in so that different releases let in different
+// installations first.
+unsigned GetRolloutBucket(const std::string &salt);
+
+// Delay before retry attempt, counted from 1: a random time up to a base delay doubled at each attempt and capped,
+// so that clients failing together do not come back together. Not less than min_delay_ms, e.g. from Retry-After.
+long long GetRetryDelayMs(unsigned attempt, long long min_delay_ms = 0);
+
+// A random time in [0, window_ms).
+long long GetRandomDelayMs(long long window_ms);
+
+// Returns false as soon as cancellation_token is cancelled, without waiting the rest of delay_ms.
+bool SleepUnlessCancelled(long long delay_ms, const CancellationToken &cancellation_token);
+
+} // namespace selfupdate
@@ -0,0 +1,65 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <selfupdate/updater.h>
+#include <thread>
+
+namespace selfupdate {
+
+namespace {
+
+// Longest sleep before the rate is read again, so that raising the limit takes effect soon.
+const long long MAX_WAIT_MS = 100;
+
+} // namespace
+
+struct BandwidthLimit::State {
+  std::atomic<unsigned long long> bytes_per_second{0};
+  std::mutex mutex;
+  // May go negative, the debt is paid off by waiting. At most a second of bytes piles up while idle.
+  double tokens = 0;
+  std::chrono::steady_clock::time_point refilled = std::chrono::steady_clock::now();
+};
+
+BandwidthLimit::BandwidthLimit() : state_(std::make_shared<State>()) {
+}
+
+void BandwidthLimit::SetBytesPerSecond(unsigned long long bytes_per_second) const {
+  state_->bytes_per_second = bytes_per_second;
+}
+
+unsigned long long BandwidthLimit::BytesPerSecond() const {
+  return state_->bytes_per_second;
+}
+
+void BandwidthLimit::Acquire(size_t size) const {
+  bool taken = false;
+  while (true) {
+    long long wait_ms = 0;
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      auto now = std::chrono::steady_clock::now();
+      double rate = (double)state_->bytes_per_second;
+      if (rate <= 0) {
+        state_->tokens = 0;
+        state_->refilled = now;
+        return;
+      }
+      double elapsed = std::chrono::duration<double>(now - state_->refilled).count();
+      state_->tokens = std::min(rate, state_->tokens + elapsed * rate);
+      state_->refilled = now;
+      if (!taken) {
+        state_->tokens -= (double)size;
+        taken = true;
+      }
+      if (state_->tokens >= 0) {
+        return;
+      }
+      wait_ms = std::min(MAX_WAIT_MS, (long long)(-state_->tokens * 1000 / rate) + 1);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(wait_ms));
+  }
+}
+
+} // namespace selfupdate
@@ -0,0 +1,122 @@
+#include "chunk_repair.h"
+#include "../base/file_util.h"
+#include "../base/hash.h"
+#include "http_util.h"
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <xl/http>
+#include <xl/log>
+
+namespace selfupdate {
+
+namespace {
+
+const size_t CHUNK_READ_BUFFER_SIZE = 1024 * 1024;
+
+std::string ToLower(std::string s) {
+  std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+  });
+  return s;
+}
+
+bool VerifyChunk(PositionalFile &file,
+                 const HashAlgorithm *algorithm,
+                 unsigned long long offset,
+                 unsigned long long length,
+                 const std::string &expected,
+                 char *buffer) {
+  std::unique_ptr<Hasher> hasher = algorithm->create();
+  while (length > 0) {
+    size_t size = (size_t)std::min((unsigned long long)CHUNK_READ_BUFFER_SIZE, length);
+    if (file.ReadAt(offset, buffer, size) != size) {
+      return false;
+    }
+    hasher->Update(buffer, size);
+    offset += size;
+    length -= size;
+  }
+  return hasher->Final() == expected;
+}
+
+bool FetchChunk(const PackageInfo &package_info,
+                PositionalFile &file,
+                const HashAlgorithm *algorithm,
+                unsigned long long offset,
+                unsigned long long length,
+                const std::string &expected) {
+  std::stringstream range_expr;
+  range_expr << "bytes=" << offset << "-" << offset + length - 1;
+  xl::http::Headers request_headers = {
+      {"Range", range_expr.str()}
+  };
+  xl::http::Headers response_headers;
+  std::string data;
+  int status = HttpGet(package_info.package_url, request_headers, response_headers,
+                       [&](const void *buffer, size_t size) -> size_t {
+                         if (data.size() + size > length) {
+                           return 0;
+                         }
+                         data.append((const char *)buffer, size);
+                         return size;
+                       });
+  if (status != 206 || data.size() != length) {
+    XL_LOG_ERROR("Fetch chunk error: ", range_expr.str(), ", status/error: ", status, ", received: ", data.size());
+    return false;
+  }
+  std::unique_ptr<Hasher> hasher = algorithm->create();
+  hasher->Update(data.data(), data.size());
+  if (hasher->Final() != expected) {
+    XL_LOG_ERROR("Fetched chunk hash mismatch: ", range_expr.str());
+    return false;
+  }
+  return file.WriteAt(offset, data.data(), data.size());
+}
+
+} // namespace
+
+bool RepairPackageChunks(const PackageInfo &package_info,
+                         const xl::native_string &package_file,
+                         unsigned long long size) {
+  if (package_info.package_chunk_size == 0 || package_info.package_chunk_hashes.empty()) {
+    return false;
+  }
+  const HashAlgorithm *algorithm = FindHashAlgorithm(package_info.package_chunk_hash_algo);
+  if (algorithm == nullptr) {
+    return false;
+  }
+  PositionalFile file;
+  if (!file.Open(package_file)) {
+    return false;
+  }
+
+  std::unique_ptr<char[]> buffer(new char[CHUNK_READ_BUFFER_SIZE]);
+  std::vector<size_t> bad_chunks;
+  for (size_t i = 0; i < package_info.package_chunk_hashes.size(); ++i) {
+    unsigned long long offset = i * package_info.package_chunk_size;
+    unsigned long long length = std::min(package_info.package_chunk_size, package_info.package_size - offset);
+    if (offset + length > size) {
+      break;
+    }
+    if (!VerifyChunk(file, algorithm, offset, length, ToLower(package_info.package_chunk_hashes[i]), buffer.get())) {
+      bad_chunks.push_back(i);
+    }
+  }
+  if (!bad_chunks.empty()) {
+    XL_LOG_WARN("Package chunks mismatched: ", bad_chunks.size(), "/", package_info.package_chunk_hashes.size());
+  }
+
+  for (size_t i : bad_chunks) {
+    unsigned long long offset = i * package_info.package_chunk_size;
+    unsigned long long length = std::min(package_info.package_chunk_size, package_info.package_size - offset);
+    if (!FetchChunk(package_info, file, algorithm, offset, length, ToLower(package_info.package_chunk_hashes[i]))) {
+      return false;
+    }
+  }
+  return file.Sync();
+}
+
+} // namespace selfupdate
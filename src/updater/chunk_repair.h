@@ -0,0 +1,15 @@
+#pragma once
+
+#include <selfupdate/updater.h>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// Checks the chunks of package_file that end within the first size bytes against package_info.package_chunk_hashes,
+// and fetches only the chunks that do not match again, with Range requests. Returns false if the package has no chunk
+// hashes, or any chunk could not be repaired. The caller still has to verify the whole package afterwards.
+bool RepairPackageChunks(const PackageInfo &package_info,
+                         const xl::native_string &package_file,
+                         unsigned long long size);
+
+} // namespace selfupdate
@@ -0,0 +1,286 @@
+#include "delta_package.h"
+#include "../base/file_util.h"
+#include "../base/hash.h"
+#include "../common.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <xl/file>
+#include <xl/log>
+#include <xl/scope_exit>
+
+#ifdef _WIN32
+#define fseek _fseeki64
+#else
+#define _FILE_OFFSET_BITS 64
+#define fseek fseeko
+#include <sys/stat.h>
+#endif
+
+namespace selfupdate {
+
+namespace {
+
+const char DELTA_MAGIC[] = "SUDELTA1";
+const size_t DELTA_MAGIC_SIZE = sizeof(DELTA_MAGIC) - 1;
+const size_t DELTA_MAX_STRING_SIZE = 64 * 1024;
+const size_t DELTA_COPY_BUFFER_SIZE = 1024 * 1024;
+
+enum DeltaEntryKind : uint8_t {
+  DELTA_ENTRY_END = 0,
+  DELTA_ENTRY_FILE = 1,
+  DELTA_ENTRY_DELETED = 2,
+};
+
+enum DeltaFileFlag : uint8_t {
+  DELTA_FILE_EXECUTABLE = 1,
+};
+
+enum DeltaOp : uint8_t {
+  DELTA_OP_END = 0,
+  DELTA_OP_COPY = 1,
+  DELTA_OP_ADD = 2,
+};
+
+class DeltaReader {
+public:
+  explicit DeltaReader(FILE *f) : f_(f) {
+  }
+
+  bool ReadBytes(void *data, size_t size) {
+    return fread(data, 1, size, f_) == size;
+  }
+
+  bool ReadInteger(uint64_t &v, size_t size) {
+    unsigned char buffer[8] = {};
+    if (!ReadBytes(buffer, size)) {
+      return false;
+    }
+    v = 0;
+    for (size_t i = size; i > 0; --i) {
+      v = (v << 8) | buffer[i - 1];
+    }
+    return true;
+  }
+
+  bool ReadString(std::string &s) {
+    uint64_t size = 0;
+    if (!ReadInteger(size, 4) || size > DELTA_MAX_STRING_SIZE) {
+      return false;
+    }
+    s.resize((size_t)size);
+    return size == 0 || ReadBytes(&s[0], (size_t)size);
+  }
+
+private:
+  FILE *f_;
+};
+
+class DeltaFileWriter {
+public:
+  DeltaFileWriter(DeltaReader &reader, char *buffer) : reader_(reader), buffer_(buffer) {
+  }
+
+  bool Apply(const xl::native_string &source_file,
+             const xl::native_string &target_file,
+             uint64_t target_size,
+             MultiHasher &target_hasher) {
+    // New files have no source.
+    std::unique_ptr<FILE, int (*)(FILE *)> source(nullptr, fclose);
+    if (!source_file.empty()) {
+      source.reset(_tfopen(source_file.c_str(), _T("rb")));
+      if (source == nullptr) {
+        XL_LOG_ERROR("Open delta source file error: ", source_file);
+        return false;
+      }
+    }
+    FILE *target = _tfopen(target_file.c_str(), _T("wb"));
+    if (target == nullptr) {
+      XL_LOG_ERROR("Create delta target file error: ", target_file);
+      return false;
+    }
+    XL_ON_BLOCK_EXIT(fclose, target);
+
+    uint64_t written = 0;
+    for (;;) {
+      uint64_t op = 0;
+      if (!reader_.ReadInteger(op, 1)) {
+        return false;
+      }
+      if (op == DELTA_OP_END) {
+        break;
+      }
+      uint64_t offset = 0, length = 0;
+      if (op == DELTA_OP_COPY) {
+        if (source == nullptr || !reader_.ReadInteger(offset, 8) || !reader_.ReadInteger(length, 8) ||
+            fseek(source.get(), offset, SEEK_SET) != 0) {
+          return false;
+        }
+      } else if (op != DELTA_OP_ADD || !reader_.ReadInteger(length, 8)) {
+        return false;
+      }
+      if (length > target_size - written) {
+        XL_LOG_ERROR("Delta instruction exceeds target size: ", target_file);
+        return false;
+      }
+      while (length > 0) {
+        size_t size = (size_t)std::min((uint64_t)DELTA_COPY_BUFFER_SIZE, length);
+        bool read =
+            op == DELTA_OP_COPY ? fread(buffer_, 1, size, source.get()) == size : reader_.ReadBytes(buffer_, size);
+        if (!read || fwrite(buffer_, 1, size, target) != size) {
+          return false;
+        }
+        target_hasher.Update(buffer_, size);
+        written += size;
+        length -= size;
+      }
+    }
+    return written == target_size && fflush(target) == 0;
+  }
+
+private:
+  DeltaReader &reader_;
+  char *buffer_;
+};
+
+} // namespace
+
+bool ApplyDeltaPackage(const xl::native_string &delta_file,
+                       const xl::native_string &source_dir,
+                       const xl::native_string &target_dir) {
+  XL_LOG_INFO(_T("Applying delta package: "), delta_file.c_str(), _T(", from: "), source_dir.c_str(), _T(", to: "),
+              target_dir.c_str());
+  FILE *f = _tfopen(delta_file.c_str(), _T("rb"));
+  if (f == nullptr) {
+    XL_LOG_ERROR("Open delta package error: ", delta_file);
+    return false;
+  }
+  XL_ON_BLOCK_EXIT(fclose, f);
+
+  DeltaReader reader(f);
+  char magic[DELTA_MAGIC_SIZE] = {};
+  if (!reader.ReadBytes(magic, DELTA_MAGIC_SIZE) || memcmp(magic, DELTA_MAGIC, DELTA_MAGIC_SIZE) != 0) {
+    XL_LOG_ERROR("Invalid delta package: ", delta_file);
+    return false;
+  }
+  xl::fs::mkdirs(target_dir.c_str());
+
+  std::unique_ptr<char[]> buffer(new char[DELTA_COPY_BUFFER_SIZE]);
+  size_t file_count = 0;
+  std::string deleted_list;
+  size_t deleted_count = 0;
+  for (;;) {
+    uint64_t kind = 0;
+    if (!reader.ReadInteger(kind, 1)) {
+      XL_LOG_ERROR("Truncated delta package: ", delta_file);
+      return false;
+    }
+    if (kind == DELTA_ENTRY_END) {
+      break;
+    }
+    std::string path, source_hash, target_hash;
+    uint64_t flags = 0, target_size = 0;
+    xl::native_string native_path;
+    if (kind == DELTA_ENTRY_DELETED) {
+      if (!reader.ReadString(path) || !ToRelativeNativePath(path, native_path)) {
+        XL_LOG_ERROR("Invalid delta entry: ", path);
+        return false;
+      }
+      deleted_list += path + "\n";
+      ++deleted_count;
+      continue;
+    }
+    if (kind != DELTA_ENTRY_FILE || !reader.ReadString(path) || !reader.ReadInteger(flags, 1) ||
+        !reader.ReadString(source_hash) ||
+        !reader.ReadInteger(target_size, 8) || !reader.ReadString(target_hash) ||
+        !ToRelativeNativePath(path, native_path)) {
+      XL_LOG_ERROR("Invalid delta entry: ", path);
+      return false;
+    }
+
+    xl::native_string source_file;
+    if (!source_hash.empty()) {
+      source_file = xl::path::join(source_dir, native_path);
+      MultiHasher source_hasher;
+      std::map<std::string, std::string> source_hashes = {
+          {PACKAGEINFO_PACKAGE_HASH_ALGO_SHA256, source_hash}
+      };
+      if (!source_hasher.Init(source_hashes) || !HashFile(source_file, source_hasher) || !source_hasher.Verify()) {
+        XL_LOG_ERROR("Installed file does not match delta source: ", path);
+        return false;
+      }
+    }
+
+    xl::native_string target_file = xl::path::join(target_dir, native_path);
+    xl::fs::mkdirs(xl::path::dirname(target_file.c_str()).c_str());
+    MultiHasher target_hasher;
+    std::map<std::string, std::string> target_hashes = {
+        {PACKAGEINFO_PACKAGE_HASH_ALGO_SHA256, target_hash}
+    };
+    if (!target_hasher.Init(target_hashes)) {
+      return false;
+    }
+    DeltaFileWriter writer(reader, buffer.get());
+    if (!writer.Apply(source_file, target_file, target_size, target_hasher)) {
+      XL_LOG_ERROR("Reconstruct file error: ", path);
+      return false;
+    }
+    if (!target_hasher.Verify()) {
+      XL_LOG_ERROR("Reconstructed file hash mismatch: ", path);
+      return false;
+    }
+#ifndef _WIN32
+    if ((flags & DELTA_FILE_EXECUTABLE) != 0) {
+      chmod(target_file.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+    }
+#endif
+    ++file_count;
+  }
+
+  if (!deleted_list.empty()) {
+    xl::native_string deleted_list_file = xl::path::join(target_dir, _T(STAGED_DELETED_LIST_FILE_NAME));
+    FILE *list = _tfopen(deleted_list_file.c_str(), _T("wb"));
+    if (list == nullptr) {
+      XL_LOG_ERROR("Create deleted list error: ", deleted_list_file);
+      return false;
+    }
+    bool written = fwrite(deleted_list.data(), 1, deleted_list.size(), list) == deleted_list.size();
+    if (fclose(list) != 0 || !written) {
+      XL_LOG_ERROR("Write deleted list error: ", deleted_list_file);
+      return false;
+    }
+  }
+
+  XL_LOG_INFO("Delta package applied, files: ", file_count, ", deleted: ", deleted_count);
+  return true;
+}
+
+void MarkDeltaPackageFailed(const xl::native_string &delta_file) {
+  FILE *f = _tfopen((delta_file + _T(DELTA_FAILED_SUFFIX)).c_str(), _T("wb"));
+  if (f != nullptr) {
+    fclose(f);
+  }
+}
+
+bool IsDeltaPackageFailed(const PackageInfo &package_info, const xl::native_string &delta_file) {
+  return package_info.package_format == PACKAGEINFO_PACKAGE_FORMAT_DELTA && !package_info.full_package_url.empty() &&
+         xl::fs::exists((delta_file + _T(DELTA_FAILED_SUFFIX)).c_str());
+}
+
+PackageInfo GetFullPackageInfo(const PackageInfo &package_info) {
+  PackageInfo full_package_info = package_info;
+  full_package_info.package_url = package_info.full_package_url;
+  full_package_info.package_size = package_info.full_package_size;
+  full_package_info.package_format = PACKAGEINFO_PACKAGE_FORMAT_ZIP;
+  full_package_info.package_hash = package_info.full_package_hash;
+  full_package_info.package_chunk_size = 0;
+  full_package_info.package_chunk_hash_algo.clear();
+  full_package_info.package_chunk_hashes.clear();
+  return full_package_info;
+}
+
+} // namespace selfupdate
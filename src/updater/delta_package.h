@@ -0,0 +1,43 @@
+#pragma once
+
+#include <selfupdate/updater.h>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// Delta package, a patch against one installed version. All integers are little endian, strings are a 4 bytes size
+// followed by the bytes:
+//
+//   "SUDELTA1"
+//   entries, each:
+//     u8  kind, 1 for a file, 2 for a deleted path, 0 ends the package
+//     str path, relative to the install location, '/' separated
+//   file entries go on with:
+//     u8  flags, 1 for an executable file
+//     str source hash, sha256 hex of the installed file the patch applies to, empty for a new file
+//     u64 target size
+//     str target hash, sha256 hex
+//     instructions, each:
+//       u8 op, 0 ends the file
+//       COPY (1): u64 source offset, u64 length
+//       ADD  (2): u64 length, then length bytes
+//
+// Files that are not listed are unchanged, they are carried over from the old installation when it is replaced.
+// Deleted paths are not, a deleted directory is listed along with everything in it.
+
+// Reconstructs the files listed in delta_file from source_dir into target_dir, which should not exist before. Every
+// source file must match its source hash, and every reconstructed file its target size and hash. Deleted paths are
+// written to STAGED_DELETED_LIST_FILE_NAME in target_dir, one per line, for the installer.
+bool ApplyDeltaPackage(const xl::native_string &delta_file,
+                       const xl::native_string &source_dir,
+                       const xl::native_string &target_dir);
+
+// A delta package that does not apply to the installation is marked as failed. Download(), Stage() and Install() of it
+// take the full package from then on, so that the caller fetches it with its own download options.
+void MarkDeltaPackageFailed(const xl::native_string &delta_file);
+// Whether delta_file, the package file of package_info, is marked as failed and there is a full package to use instead.
+bool IsDeltaPackageFailed(const PackageInfo &package_info, const xl::native_string &delta_file);
+// The full package to use in place of the delta package of package_info.
+PackageInfo GetFullPackageInfo(const PackageInfo &package_info);
+
+} // namespace selfupdate
@@ -1,12 +1,32 @@
+#include "../base/file_util.h"
+#include "../base/hash.h"
+#include "../base/stopwatch.h"
+#include "../base/thread_priority.h"
+#include "../base/versioned_install.h"
+#include "../base/zip_stream_extractor.h"
 #include "../common.h"
+#include "backoff.h"
+#include "chunk_repair.h"
+#include "delta_package.h"
+#include "http_util.h"
+#include "manifest_package.h"
+#include "package_store.h"
+#include "package_writer.h"
+#include "resume_journal.h"
+#include "segmented_download.h"
+#include "staged_package.h"
+#include "update_metrics.h"
+#include <algorithm>
 #include <cstdio>
+#include <memory>
 #include <selfupdate/updater.h>
 #include <sstream>
-#include <xl/crypto>
+#include <thread>
 #include <xl/file>
 #include <xl/http>
 #include <xl/log>
 #include <xl/native_string>
+#include <xl/process>
 #include <xl/scope_exit>
 
 #ifdef _WIN32
@@ -22,80 +42,372 @@ namespace selfupdate {
 
 namespace {
 
-long long ReadInteger(const xl::native_string &file) {
-#ifdef _MSC_VER
-  FILE *f = _wfopen(file.c_str(), L"r");
-#else
-  FILE *f = fopen(file.c_str(), "r");
-#endif
-  if (f == nullptr) {
-    return -1;
-  }
-  unsigned long long v = 0;
-  if (fscanf(f, "%lld", &v) != 1) {
-    return -2;
-  }
-  fclose(f);
-  return v;
-}
-void WriteInteger(const xl::native_string &file, long long v) {
-#ifdef _MSC_VER
-  FILE *f = _wfopen(file.c_str(), L"w");
-#else
-  FILE *f = fopen(file.c_str(), "w");
-#endif
-  if (f == nullptr) {
-    return;
+const long long THROUGHPUT_SAMPLE_INTERVAL_MS = 1000;
+// Longer than a package download should take, a store entry held beyond that is taken as stuck.
+const long long STORE_LOCK_TIMEOUT_MS = 5 * 60 * 1000;
+
+bool VerifyPackage(const xl::native_string &package_file,
+                   const std::map<std::string, std::string> &hashes,
+                   std::map<std::string, long long> &hash_ms) {
+  MultiHasher hasher;
+  if (!hasher.Init(hashes)) {
+    return false;
   }
-  fprintf(f, "%lld", v);
-  fclose(f);
+  bool hashed = HashFile(package_file, hasher);
+  hasher.AddElapsedMilliseconds(hash_ms);
+  return hashed && hasher.Verify();
 }
 
-const char *DOWNLOADING_FILE_SUFFIX = ".downloading";
+// Measurements of one Download() call, for UpdateMetrics.
+class DownloadTrace {
+public:
+  // Called when the transfer starts, offset bytes are already there from an earlier attempt.
+  void Start(unsigned long long offset) {
+    transfer_.Restart();
+    resumed_ = offset;
+    last_ = offset;
+  }
 
-bool VerifyPackage(const xl::native_string &package_file, const std::map<std::string, std::string> &hashes) {
-  for (const auto &item : hashes) {
-    std::string hash = item.second;
-    std::transform(hash.begin(), hash.end(), hash.begin(), [](unsigned char c) {
-      return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
-    });
-    if (item.first == PACKAGEINFO_PACKAGE_HASH_ALGO_MD5) {
-      if (xl::crypto::md5_file(package_file.c_str()) != hash) {
-        return false;
-      }
+  // Called with what a DownloadProgressMonitor gets, before passing it on.
+  void Progress(unsigned long long downloaded_size) {
+    long long elapsed_ms = transfer_.ElapsedMilliseconds();
+    if (first_byte_ms_ < 0) {
+      first_byte_ms_ = elapsed_ms;
     }
-    if (item.first == PACKAGEINFO_PACKAGE_HASH_ALGO_SHA1) {
-      if (xl::crypto::sha1_file(package_file.c_str()) != hash) {
-        return false;
-      }
+    if (downloaded_size < last_) {
+      // Bytes were dropped, either a failed segment, or the whole download starting over.
+      resumed_ = std::min(resumed_, downloaded_size);
+    } else {
+      fetched_ += downloaded_size - last_;
     }
-    if (item.first == PACKAGEINFO_PACKAGE_HASH_ALGO_SHA224) {
-      if (xl::crypto::sha224_file(package_file.c_str()) != hash) {
-        return false;
-      }
+    last_ = downloaded_size;
+    if (elapsed_ms >= next_sample_ms_) {
+      throughput_.push_back({elapsed_ms, fetched_});
+      next_sample_ms_ = elapsed_ms + THROUGHPUT_SAMPLE_INTERVAL_MS;
     }
-    if (item.first == PACKAGEINFO_PACKAGE_HASH_ALGO_SHA256) {
-      if (xl::crypto::sha256_file(package_file.c_str()) != hash) {
-        return false;
-      }
+  }
+
+  std::map<std::string, long long> &hash_ms() {
+    return hash_ms_;
+  }
+
+  // Called when the package was extracted while downloading.
+  void Extracted(unsigned long long entry_count) {
+    extracted_entries_ = (long long)entry_count;
+  }
+
+  void Record(long long download_ms) {
+    if (last_ > 0 && (throughput_.empty() || throughput_.back().downloaded_bytes != fetched_)) {
+      throughput_.push_back({transfer_.ElapsedMilliseconds(), fetched_});
     }
-    if (item.first == PACKAGEINFO_PACKAGE_HASH_ALGO_SHA384) {
-      if (xl::crypto::sha384_file(package_file.c_str()) != hash) {
-        return false;
+    RecordUpdateMetrics(UPDATE_PHASE_DOWNLOAD, [&](UpdateMetrics &metrics) {
+      metrics.download_first_byte_ms = first_byte_ms_;
+      metrics.download_ms = download_ms;
+      metrics.bytes_resumed = resumed_;
+      metrics.bytes_fetched = fetched_;
+      metrics.throughput = throughput_;
+      metrics.hash_ms = hash_ms_;
+      if (extracted_entries_ >= 0) {
+        metrics.extracted_entries = (unsigned long long)extracted_entries_;
       }
+    });
+  }
+
+private:
+  Stopwatch transfer_;
+  long long first_byte_ms_ = -1;
+  unsigned long long resumed_ = 0;
+  unsigned long long fetched_ = 0;
+  unsigned long long last_ = 0;
+  long long next_sample_ms_ = 0;
+  std::vector<UpdateMetrics::ThroughputSample> throughput_;
+  std::map<std::string, long long> hash_ms_;
+  long long extracted_entries_ = -1;
+};
+
+// Checks the size a response to "Range: bytes=<start_offset>-" announces against the expected package size. Passes if
+// the server announces none.
+bool CheckPackageSize(const xl::http::Headers &headers,
+                      unsigned long long start_offset,
+                      unsigned long long package_size) {
+  unsigned long long first = 0, last = 0;
+  long long total = -1;
+  const std::string *content_range = FindHeader(headers, "Content-Range");
+  if (content_range != nullptr) {
+    if (!ParseContentRange(*content_range, first, last, total) || first != start_offset ||
+        (total >= 0 && (unsigned long long)total != package_size)) {
+      XL_LOG_ERROR("Package size error, expected: ", package_size, ", got range: ", *content_range);
+      return false;
     }
-    if (item.first == PACKAGEINFO_PACKAGE_HASH_ALGO_SHA512) {
-      if (xl::crypto::sha512_file(package_file.c_str()) != hash) {
-        return false;
-      }
+    return true;
+  }
+  const std::string *content_length = FindHeader(headers, "Content-Length");
+  if (content_length != nullptr && (unsigned long long)atoll(content_length->c_str()) != package_size - start_offset) {
+    XL_LOG_ERROR("Package size error, expected: ", package_size - start_offset, ", got: ", *content_length);
+    return false;
+  }
+  return true;
+}
+
+// Downloads the package over a single connection, continuing from resume_state if the package file still holds the
+// bytes it claims, and the package on the server has not changed since.
+//
+// On failure, retry_after is set to the seconds the server asked to wait before trying again, 0 if it did not say, or
+// -1 if trying again would not help.
+bool DownloadSingle(const PackageInfo &package_info,
+                    const xl::native_string &package_file,
+                    ResumeJournal &journal,
+                    ResumeState &resume_state,
+                    MultiHasher &hasher,
+                    ZipStreamExtractor *extractor,
+                    const CancellationToken &cancellation_token,
+                    const BandwidthLimit &bandwidth_limit,
+                    DownloadProgressMonitor download_progress_monitor,
+                    long long &retry_after) {
+  retry_after = -1;
+  long long file_size = GetFileSize(package_file);
+  bool resume = resume_state.segment_size == 0 && resume_state.offset > 0 &&
+                (long long)resume_state.offset <= file_size && file_size <= (long long)package_info.package_size &&
+                hasher.LoadState(resume_state.hash_state);
+  if (!resume) {
+    hasher.Reset();
+    resume_state = ResumeState();
+    resume_state.hash_state = hasher.SaveState();
+  }
+
+  // Truncate only when starting over, the bytes before resume_state.offset are kept otherwise.
+  FILE *f = _tfopen(package_file.c_str(), resume ? _T("r+b") : _T("wb"));
+  if (f == NULL) {
+    XL_LOG_ERROR("Open local file error: ", package_file);
+    return false;
+  }
+  XL_ON_BLOCK_EXIT(fclose, f);
+
+  unsigned long long downloaded_size = resume_state.offset;
+  if (downloaded_size == package_info.package_size) {
+    return true;
+  }
+  // Allocated up front, the file does not fragment as it grows, and a full disk shows up before the transfer.
+  if (!ReserveFileSpace(f, package_info.package_size)) {
+    XL_LOG_ERROR("Not enough disk space for package: ", package_file, ", size: ", package_info.package_size);
+    return false;
+  }
+  fseek(f, downloaded_size, SEEK_SET);
+  // Chunks from curl are small and the disk may stall, the writer batches them up on a thread of its own. Destroyed
+  // before f is closed.
+  PackageWriter writer(f);
+  XL_LOG_INFO("Downloading from offset: ", downloaded_size);
+  if (downloaded_size > 0 && extractor != nullptr) {
+    XL_LOG_INFO("Resumed download, extracting after download instead of streaming.");
+    extractor = nullptr;
+  }
+
+  // Package data must be on disk before the journal claims it.
+  auto checkpoint = [&]() {
+    if (!writer.Sync()) {
+      return false;
+    }
+    resume_state.offset = downloaded_size;
+    resume_state.hash_state = hasher.SaveState();
+    journal.Write(resume_state);
+    return true;
+  };
+
+  // There is no HEAD request ahead of the GET, the package size and the validator for later resumes are taken from the
+  // GET response itself. If-Range makes the server send the whole package instead if it has changed since.
+  std::stringstream range_expr;
+  range_expr << "bytes=" << downloaded_size << "-";
+  xl::http::Headers request_headers = {
+      {"Range", range_expr.str()}
+  };
+  if (downloaded_size > 0 && !resume_state.validator.empty()) {
+    request_headers.insert({"If-Range", resume_state.validator});
+  }
+  unsigned long long start_offset = downloaded_size;
+  // Until the response is known to continue from start_offset, nothing it brings is checkpointed.
+  bool range_confirmed = start_offset == 0;
+  bool first_chunk = true;
+  bool overrun = false;
+  // Stopped on our side for a reason that would come up again.
+  bool aborted = false;
+  xl::http::Headers response_headers;
+  int status = HttpGet(
+      package_info.package_url, request_headers, response_headers, [&](const void *buffer, size_t size) -> size_t {
+        if (cancellation_token.IsCancelled()) {
+          return 0;
+        }
+        bandwidth_limit.Acquire(size);
+        if (first_chunk && !response_headers.empty()) {
+          // A full response to a ranged request means If-Range did not match, the whole package is coming.
+          if (start_offset > 0 && FindHeader(response_headers, "Content-Range") == nullptr) {
+            XL_LOG_INFO("Range not honored, restarting download from the beginning.");
+            if (!writer.Seek(0)) {
+              aborted = true;
+              return 0;
+            }
+            hasher.Reset();
+            downloaded_size = 0;
+            start_offset = 0;
+          }
+          if (!CheckPackageSize(response_headers, start_offset, package_info.package_size)) {
+            aborted = true;
+            return 0;
+          }
+          if (start_offset == 0) {
+            resume_state.validator = GetRangeValidator(response_headers);
+          }
+          range_confirmed = true;
+        }
+        first_chunk = false;
+        if (downloaded_size + size > package_info.package_size) {
+          overrun = true;
+          return 0;
+        }
+        if (!writer.Write(buffer, size)) {
+          aborted = true;
+          return 0;
+        }
+        hasher.Update(buffer, size);
+        if (extractor != nullptr) {
+          extractor->Write(buffer, size);
+        }
+        downloaded_size += size;
+        if (range_confirmed && journal.IsCheckpointDue(downloaded_size)) {
+          checkpoint();
+        }
+        if (download_progress_monitor != nullptr) {
+          download_progress_monitor(downloaded_size, package_info.package_size);
+        }
+        return size;
+      });
+  if (!range_confirmed && (status == 206 || !response_headers.empty())) {
+    range_confirmed = status == 206 || FindHeader(response_headers, "Content-Range") != nullptr;
+  }
+  if (start_offset > 0 && (status == 200 || overrun || (!range_confirmed && !response_headers.empty()))) {
+    // Response headers were not available while receiving, so the body went to the wrong offset. A server ignoring
+    // If-Range may also end in an overrun or a transfer error rather than status 200. Nothing after start_offset can
+    // be trusted, let the next attempt start over.
+    XL_LOG_ERROR("Range not honored by server: ", package_info.package_url);
+    hasher.Reset();
+    resume_state = ResumeState();
+    journal.Write(resume_state);
+    retry_after = 0;
+    return false;
+  }
+  // Without a HEAD request ahead, an error page may have been received in place of the package.
+  bool http_error = status >= 300 && status < 600;
+  bool written = false;
+  if (!http_error && !overrun && range_confirmed) {
+    if (start_offset == 0 && resume_state.validator.empty()) {
+      resume_state.validator = GetRangeValidator(response_headers);
     }
+    written = checkpoint();
+  }
+  XL_LOG_INFO("Resume journal checkpoints: ", journal.checkpoint_count(), ", downloaded: ", downloaded_size);
+  if (cancellation_token.IsCancelled()) {
+    XL_LOG_INFO("Download cancelled: ", package_info.package_url);
+    return false;
+  }
+  if (status != 200 && status != 206) {
+    XL_LOG_ERROR("Download package error: ", package_info.package_url, ", status/error: ", status);
+    if (!aborted && !overrun && IsRetryableStatus(status)) {
+      retry_after = std::max(GetRetryAfter(response_headers), 0LL);
+    }
+    return false;
+  }
+  if (!written) {
+    XL_LOG_ERROR("Write package file error: ", package_file);
+    return false;
+  }
+  if (downloaded_size != package_info.package_size) {
+    // The connection closed early.
+    retry_after = 0;
+    return false;
   }
   return true;
 }
 
-} // namespace
+// Spreads the downloads of a release over package_info.download_window, called before a download that has not started
+// yet.
+bool WaitDownloadWindow(const PackageInfo &package_info, const CancellationToken &cancellation_token) {
+  if (package_info.download_window == 0) {
+    return true;
+  }
+  long long delay_ms = GetRandomDelayMs(package_info.download_window * 1000LL);
+  XL_LOG_INFO("Waiting in the download window: ", delay_ms, "ms");
+  if (!SleepUnlessCancelled(delay_ms, cancellation_token)) {
+    XL_LOG_INFO("Download cancelled: ", package_info.package_url);
+    return false;
+  }
+  return true;
+}
 
-bool Download(const PackageInfo &package_info, DownloadProgressMonitor download_progress_monitor) {
+// Waits before retry attempt, returns false if it is not worth it, or if cancelled meanwhile.
+bool WaitRetry(unsigned attempt, long long retry_after, const CancellationToken &cancellation_token) {
+  if (attempt >= RETRY_ATTEMPT_COUNT || retry_after < 0 || retry_after > MAX_RETRY_AFTER_SECONDS ||
+      cancellation_token.IsCancelled()) {
+    return false;
+  }
+  long long delay_ms = GetRetryDelayMs(attempt, retry_after * 1000);
+  XL_LOG_WARN("Download failed, retrying in: ", delay_ms, "ms");
+  return SleepUnlessCancelled(delay_ms, cancellation_token);
+}
+
+// Opens the store given in download_options, shared by whoever can write to it, else the private one of the user.
+bool OpenPackageStore(const DownloadOptions &download_options, PackageStore &store) {
+  if (download_options.package_store_dir != nullptr) {
+    return store.Open(download_options.package_store_dir, true);
+  }
+  xl::native_string store_dir = GetPrivateTempDir(_T(PACKAGE_STORE_DIR_NAME));
+  if (store_dir.empty()) {
+    XL_LOG_WARN("Private package store not usable, downloading without it.");
+    return false;
+  }
+  return store.Open(store_dir, false);
+}
+
+// Makes package_file, where Install() looks for the package, a copy of the package in the store. A copy out of a shared
+// store is verified, whatever was verified in the store, as another user may replace a package there at any time. For
+// the same reason, a package is never hard linked out of a shared store. A package in the private store was verified
+// before it was left there complete, and is linked without reading it again.
+bool PublishStoredPackage(const PackageStore &store,
+                          const xl::native_string &stored_file,
+                          const xl::native_string &package_file,
+                          const std::map<std::string, std::string> &hashes,
+                          std::map<std::string, long long> &hash_ms) {
+  TouchFile(stored_file);
+  xl::fs::remove(package_file.c_str());
+  bool published =
+      store.shared() ? CloneOrCopyFile(stored_file, package_file) : LinkOrCopyFile(stored_file, package_file);
+  if (!published) {
+    XL_LOG_ERROR("Copy package from store error: ", stored_file, ", to: ", package_file);
+    return false;
+  }
+  if (store.shared() && !VerifyPackage(package_file, hashes, hash_ms)) {
+    XL_LOG_ERROR("Verify package from store error: ", stored_file);
+    xl::fs::remove(package_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+xl::native_string GetInstallLocation(const DownloadOptions &download_options) {
+  if (download_options.install_location != nullptr) {
+    return download_options.install_location;
+  }
+  return GetInstallLocationOf(xl::path::dirname(xl::process::executable_path().c_str()));
+}
+
+void RemoveStagingDir(const xl::native_string &staging_dir) {
+  if (!staging_dir.empty()) {
+    xl::fs::remove_all(staging_dir.c_str());
+  }
+}
+
+bool DownloadPackage(const PackageInfo &package_info,
+                     const DownloadOptions &download_options,
+                     DownloadTrace &trace,
+                     DownloadProgressMonitor download_progress_monitor) {
   XL_LOG_INFO("Downloanding: ", package_info.package_url);
   xl::native_string cache_dir = xl::fs::tmp_dir();
   if (cache_dir.empty()) {
@@ -109,105 +421,245 @@ bool Download(const PackageInfo &package_info, DownloadProgressMonitor download_
     XL_LOG_ERROR("Create cache dir error. dir: ", cache_dir);
     return false;
   }
-  XL_LOG_ERROR("Cache dir: ", cache_dir);
+  XL_LOG_INFO("Cache dir: ", cache_dir);
 
   std::string package_file_name = package_info.package_name + PACKAGE_NAME_VERSION_SEP + package_info.package_version +
                                   FILE_NAME_EXT_SEP + package_info.package_format;
   xl::native_string package_file = xl::path::join(cache_dir, xl::encoding::utf8_to_native(package_file_name));
-  XL_LOG_ERROR("Package file: ", package_file);
-  xl::native_string package_downloading_file =
-      xl::path::join(cache_dir, xl::encoding::utf8_to_native(package_file_name + DOWNLOADING_FILE_SUFFIX));
-  XL_LOG_ERROR("Downloading file: ", package_downloading_file);
-  long long downloaded_size = ReadInteger(package_downloading_file);
-
-  {
-    FILE *f = _tfopen(package_file.c_str(), _T("wb"));
-    if (f == NULL) {
-      XL_LOG_ERROR("Open local file error: ", package_file);
+  XL_LOG_INFO("Package file: ", package_file);
+  if (IsDeltaPackageFailed(package_info, package_file)) {
+    XL_LOG_INFO("Delta package did not apply, downloading the full package: ", package_info.full_package_url);
+    return DownloadPackage(GetFullPackageInfo(package_info), download_options, trace, download_progress_monitor);
+  }
+
+  if (package_info.package_format == PACKAGEINFO_PACKAGE_FORMAT_MANIFEST) {
+    if (!xl::fs::exists(package_file.c_str()) &&
+        !WaitDownloadWindow(package_info, download_options.cancellation_token)) {
       return false;
     }
-    XL_ON_BLOCK_EXIT(fclose, f);
-    fseek(f, 0, SEEK_END);
-    long long offset = ftell(f);
-    if (offset == package_info.package_size && downloaded_size < 0 &&
-        VerifyPackage(package_file, package_info.package_hash)) {
-      XL_LOG_INFO("Package file already downloaded and verified OK: ", package_file);
-      return {};
+    trace.Start(0);
+    // Files already staged are kept, a retry only fetches the rest. Failures are not told apart, any is retried.
+    for (unsigned attempt = 1;; ++attempt) {
+      if (DownloadManifestPackage(package_info, GetInstallLocation(download_options), package_file,
+                                  download_options.cancellation_token, download_options.bandwidth_limit,
+                                  download_progress_monitor)) {
+        return true;
+      }
+      if (!WaitRetry(attempt, 0, download_options.cancellation_token)) {
+        return false;
+      }
     }
+  }
 
-    if (downloaded_size > 0 && offset > downloaded_size) {
-      fseek(f, downloaded_size, SEEK_SET);
-    } else {
-      fseek(f, 0, SEEK_SET);
-      downloaded_size = 0;
-    }
-    xl::http::Request request;
-    request.url = package_info.package_url;
-    request.method = xl::http::METHOD_HEAD;
-    xl::http::Response response;
-    xl::http::Headers response_headers;
-    response.headers = &response_headers;
-    xl::http::Option option;
-    option.user_agent = SELFUPDATE_USER_AGENT;
-    int status = xl::http::send(request, &response);
-    if (status != 200) {
-      XL_LOG_ERROR("Request HEAD error: ", package_info.package_url, ", http status/error: ", status);
+  MultiHasher hasher;
+  if (!hasher.Init(package_info.package_hash)) {
+    XL_LOG_ERROR("Unsupported hash algorithm in package hash.");
+    return false;
+  }
+
+  // The package is downloaded into the store, by one process at a time, then copied to package_file. Straight into
+  // package_file if there is no store, or if the store entry is held for too long.
+  PackageStore store;
+  FileLock store_lock;
+  std::string store_key = PackageStore::GetKey(package_info.package_hash);
+  bool use_store = !store_key.empty() && OpenPackageStore(download_options, store);
+  // Waited out before taking the store lock, so that nobody waits behind it. Only a download that has not started yet
+  // waits.
+  auto started = [](const xl::native_string &file) {
+    return xl::fs::exists(file.c_str()) || xl::fs::exists((file + _T(DOWNLOADING_FILE_SUFFIX)).c_str());
+  };
+  if (!started(package_file) && !(use_store && started(store.GetPackageFile(store_key, package_info.package_format))) &&
+      !WaitDownloadWindow(package_info, download_options.cancellation_token)) {
+    return false;
+  }
+  xl::native_string download_file = package_file;
+  if (use_store) {
+    if (store.Lock(store_key, STORE_LOCK_TIMEOUT_MS, download_options.cancellation_token, store_lock)) {
+      download_file = store.GetPackageFile(store_key, package_info.package_format);
+      // Left by a download from before the store, the package file is replaced from the store anyway.
+      xl::fs::remove((package_file + _T(DOWNLOADING_FILE_SUFFIX)).c_str());
+    } else if (download_options.cancellation_token.IsCancelled()) {
+      XL_LOG_INFO("Download cancelled: ", package_info.package_url);
+      return false;
+    }
+  }
+  xl::native_string package_downloading_file = download_file + _T(DOWNLOADING_FILE_SUFFIX);
+  XL_LOG_INFO("Downloading file: ", package_downloading_file);
+  auto publish = [&]() {
+    if (download_file == package_file) {
+      return true;
+    }
+    if (!PublishStoredPackage(store, download_file, package_file, package_info.package_hash, trace.hash_ms())) {
       return false;
     }
+    store.Evict(download_options.package_store_max_size);
+    return true;
+  };
 
-    long long total_size = package_info.package_size;
-    auto it = response_headers.find("Content-Length");
-    if (it != response_headers.end()) {
-      std::string content_length = it->second;
-      total_size = atoll(content_length.c_str());
+  if (!xl::fs::exists(package_downloading_file.c_str()) &&
+      GetFileSize(download_file) == (long long)package_info.package_size) {
+    // A package in a shared store is only verified through its copy, one in the private store is trusted.
+    if (download_file == package_file ? VerifyPackage(download_file, package_info.package_hash, trace.hash_ms())
+                                      : publish()) {
+      XL_LOG_INFO("Package file already downloaded and verified OK: ", download_file);
+      return true;
     }
+    XL_LOG_WARN("Package file damaged, downloading it again: ", download_file);
+  }
 
-    if (total_size != package_info.package_size) {
-      XL_LOG_ERROR("Package size error, expected: ", package_info.package_size, ", got: ", total_size);
-      return false;
+  ResumeJournal journal;
+  if (!journal.Open(package_downloading_file)) {
+    XL_LOG_ERROR("Open downloading file error: ", package_downloading_file);
+    return false;
+  }
+  ResumeState resume_state;
+  if (journal.Load(resume_state) && resume_state.offset > 0 && !package_info.package_chunk_hashes.empty()) {
+    // The hasher state covers the bytes as they were received, make sure they are still intact on disk.
+    if (!RepairPackageChunks(package_info, download_file, resume_state.offset)) {
+      XL_LOG_WARN("Repair downloaded chunks failed, downloading from the beginning: ", download_file);
+      resume_state = ResumeState();
+      journal.Write(resume_state);
     }
+  }
 
-    std::stringstream range_expr;
-    range_expr << "bytes=";
-    range_expr << downloaded_size;
-    range_expr << "-";
-    request.headers = {
-        {"Range", range_expr.str()}
-    };
-    response_headers.clear();
-    status = xl::http::get(package_info.package_url, request.headers, response_headers,
-                           [&](const void *buffer, size_t size) -> size_t {
-                             fwrite(buffer, 1, size, f);
-                             fflush(f);
-                             downloaded_size += size;
-                             WriteInteger(package_downloading_file, downloaded_size);
-                             if (download_progress_monitor != nullptr) {
-                               download_progress_monitor(downloaded_size, total_size);
-                             }
-                             return size;
-                           });
-    if (status != 200) {
-      XL_LOG_ERROR("Download package error: ", package_info.package_url, ", status/error: ", status);
-      return false;
+  // Extracted files are only moved to where Install() looks for them after the whole package is verified.
+  xl::fs::remove((package_file + _T(STAGED_MARKER_SUFFIX)).c_str());
+  std::unique_ptr<ZipStreamExtractor> extractor;
+  xl::native_string install_location = GetInstallLocation(download_options);
+  // Only set when extracting, Stage() and other downloads may be using the staging directory otherwise.
+  xl::native_string staging_dir;
+  if (download_options.stream_extract && package_info.package_format == PACKAGEINFO_PACKAGE_FORMAT_ZIP) {
+    staging_dir = install_location + _T(INSTALL_LOCATION_STAGING_SUFFIX);
+  }
+  XL_ON_BLOCK_EXIT(RemoveStagingDir, staging_dir);
+  auto open_extractor = [&]() {
+    extractor.reset();
+    if (!staging_dir.empty()) {
+      extractor.reset(new ZipStreamExtractor);
+      if (!extractor->Open(staging_dir)) {
+        XL_LOG_ERROR("Open stream extractor failed, extracting after download: ", staging_dir);
+        extractor.reset();
+      }
     }
-    if (status != 200) {
-      XL_LOG_ERROR("Querying failed. http status: ", status);
-      return false;
+  };
+  open_extractor();
+
+  if (download_options.cancellation_token.IsCancelled()) {
+    XL_LOG_INFO("Download cancelled: ", package_info.package_url);
+    return false;
+  }
+  trace.Start(resume_state.offset);
+  bool downloaded = false;
+  bool segmented = download_options.connection_count > 1 && package_info.package_size > download_options.segment_size;
+  for (unsigned attempt = 1;; ++attempt) {
+    long long retry_after = -1;
+    unsigned long long resumed_offset = resume_state.offset;
+    if (segmented) {
+      bool range_unsupported = false;
+      downloaded = DownloadSegmented(package_info, download_options, download_file, journal, resume_state, hasher,
+                                     extractor.get(), download_progress_monitor, range_unsupported, retry_after);
+      if (!downloaded && range_unsupported) {
+        XL_LOG_WARN("Range requests not supported, downloading over a single connection: ", package_info.package_url);
+        segmented = false;
+        resume_state = ResumeState();
+        open_extractor();
+        downloaded = DownloadSingle(package_info, download_file, journal, resume_state, hasher, extractor.get(),
+                                    download_options.cancellation_token, download_options.bandwidth_limit,
+                                    download_progress_monitor, retry_after);
+      }
+    } else {
+      downloaded = DownloadSingle(package_info, download_file, journal, resume_state, hasher, extractor.get(),
+                                  download_options.cancellation_token, download_options.bandwidth_limit,
+                                  download_progress_monitor, retry_after);
+    }
+    // A request cut off by HTTP_TRANSFER_TIMEOUT_MS while still receiving is not a failure, a large package on a slow
+    // connection takes several. Only attempts that get nowhere are counted.
+    if (!downloaded && resume_state.offset > resumed_offset) {
+      attempt = 1;
+    }
+    if (downloaded || !WaitRetry(attempt, retry_after, download_options.cancellation_token)) {
+      break;
+    }
+    // The retry continues from the journal. Streaming extraction can only follow a download from the beginning.
+    if (resume_state.offset == 0) {
+      open_extractor();
+    } else {
+      extractor.reset();
     }
   }
+  hasher.AddElapsedMilliseconds(trace.hash_ms());
+  if (!downloaded) {
+    return false;
+  }
 
-  // if (downloaded_size != total_size) {
-  //   return make_selfupdate_error(SUE_PackageSizeError);
-  // }
+  // All bytes have passed through the hasher while downloading, no need to read the package file again.
+  bool stream_extracted = false;
+  if (hasher.Verify()) {
+    stream_extracted = extractor != nullptr && extractor->Finish(download_file);
+  } else {
+    XL_LOG_WARN("Verify package failed, checking chunks: ", download_file);
+    if (!RepairPackageChunks(package_info, download_file, package_info.package_size) ||
+        !VerifyPackage(download_file, package_info.package_hash, trace.hash_ms())) {
+      journal.Close();
+      xl::fs::remove(package_downloading_file.c_str());
+      xl::fs::remove(download_file.c_str());
+      XL_LOG_ERROR("Verify package error: ", download_file);
+      return false;
+    }
+  }
+  journal.Close();
   xl::fs::remove(package_downloading_file.c_str());
-  if (!VerifyPackage(package_file, package_info.package_hash)) {
-    xl::fs::remove(package_file.c_str());
-    XL_LOG_ERROR("Verify package error: ", package_file);
+  if (!publish()) {
     return false;
   }
+  if (stream_extracted && CommitStagedDirectory(package_file, staging_dir, install_location)) {
+    trace.Extracted(extractor->entry_count());
+  }
 
   XL_LOG_INFO("Downloaded package OK: ", package_file);
   return true;
 }
 
+} // namespace
+
+bool Download(const PackageInfo &package_info, DownloadProgressMonitor download_progress_monitor) {
+  return Download(package_info, DownloadOptions(), download_progress_monitor);
+}
+
+bool Download(const PackageInfo &package_info,
+              const DownloadOptions &download_options,
+              DownloadProgressMonitor download_progress_monitor) {
+  Stopwatch stopwatch;
+  DownloadTrace trace;
+  // Progress comes with every chunk received, which is far more often than anyone can watch.
+  Stopwatch since_progress;
+  bool progress_reported = false;
+  auto on_progress = [&](unsigned long long downloaded_bytes, unsigned long long total_bytes) {
+    trace.Progress(downloaded_bytes);
+    if (download_progress_monitor == nullptr) {
+      return;
+    }
+    if (downloaded_bytes == total_bytes || !progress_reported ||
+        since_progress.ElapsedMilliseconds() >= download_options.progress_interval_ms) {
+      progress_reported = true;
+      since_progress.Restart();
+      download_progress_monitor(downloaded_bytes, total_bytes);
+    }
+  };
+
+  bool downloaded = false;
+  if (download_options.background) {
+    // The priority can not be raised back on posix systems, so the caller's thread is left alone.
+    std::thread thread([&]() {
+      SetBackgroundThreadPriority();
+      downloaded = DownloadPackage(package_info, download_options, trace, on_progress);
+    });
+    thread.join();
+  } else {
+    downloaded = DownloadPackage(package_info, download_options, trace, on_progress);
+  }
+  trace.Record(stopwatch.ElapsedMilliseconds());
+  return downloaded;
+}
+
 } // namespace selfupdate
@@ -0,0 +1,99 @@
+#include "executor.h"
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+
+namespace selfupdate {
+
+namespace {
+
+// Enough for a query to go ahead while a download is running.
+const unsigned EXECUTOR_THREAD_COUNT = 2;
+
+class Executor {
+public:
+  Executor() {
+    for (unsigned i = 0; i < EXECUTOR_THREAD_COUNT; ++i) {
+      threads_.emplace_back(&Executor::Work, this);
+    }
+  }
+
+  // Destroyed at exit, along with the other statics. Tasks still waiting are dropped, running ones are waited for, so
+  // that none of them outlives the statics it uses. Cancel them before returning from main() not to wait long.
+  ~Executor() {
+    std::list<std::thread> threads;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+      tasks_.clear();
+      threads.swap(threads_);
+    }
+    condition_.notify_all();
+    for (auto &thread : threads) {
+      thread.join();
+    }
+  }
+
+  void Post(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (stopped_) {
+        return;
+      }
+      tasks_.push_back(std::move(task));
+    }
+    condition_.notify_one();
+  }
+
+  void PostLong(std::function<void()> task) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!stopped_) {
+      threads_.emplace_back(std::move(task));
+    }
+  }
+
+private:
+  void Work() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_.wait(lock, [this]() {
+          return stopped_ || !tasks_.empty();
+        });
+        if (stopped_) {
+          return;
+        }
+        task = std::move(tasks_.front());
+        tasks_.pop_front();
+      }
+      task();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<std::function<void()>> tasks_;
+  bool stopped_ = false;
+  // Joined in the destructor, long task threads included.
+  std::list<std::thread> threads_;
+};
+
+Executor &GetExecutor() {
+  static Executor executor;
+  return executor;
+}
+
+} // namespace
+
+void PostTask(std::function<void()> task) {
+  GetExecutor().Post(std::move(task));
+}
+
+void PostLongTask(std::function<void()> task) {
+  GetExecutor().PostLong(std::move(task));
+}
+
+} // namespace selfupdate
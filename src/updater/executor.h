@@ -0,0 +1,14 @@
+#pragma once
+
+#include <functional>
+
+namespace selfupdate {
+
+// Runs tasks on threads owned by the library, started on first use and joined at exit. Tasks may run concurrently, up
+// to EXECUTOR_THREAD_COUNT at a time, the rest wait in order. Tasks not started by exit are dropped.
+void PostTask(std::function<void()> task);
+
+// Runs task on a thread of its own, for work that would hold up queries and downloads for long.
+void PostLongTask(std::function<void()> task);
+
+} // namespace selfupdate
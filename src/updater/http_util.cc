@@ -0,0 +1,137 @@
+#include "http_util.h"
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <selfupdate/updater.h>
+
+namespace selfupdate {
+
+const std::string *FindHeader(const xl::http::Headers &headers, const char *name) {
+  size_t length = strlen(name);
+  for (const auto &item : headers) {
+    if (item.first.size() != length) {
+      continue;
+    }
+    bool equal = true;
+    for (size_t i = 0; i < length && equal; ++i) {
+      equal = tolower((unsigned char)item.first[i]) == tolower((unsigned char)name[i]);
+    }
+    if (equal) {
+      return &item.second;
+    }
+  }
+  return nullptr;
+}
+
+std::string GetRangeValidator(const xl::http::Headers &headers) {
+  const std::string *etag = FindHeader(headers, "ETag");
+  if (etag != nullptr && !etag->empty() && etag->compare(0, 2, "W/") != 0) {
+    return *etag;
+  }
+  const std::string *last_modified = FindHeader(headers, "Last-Modified");
+  if (last_modified != nullptr) {
+    return *last_modified;
+  }
+  return {};
+}
+
+long long GetMaxAge(const xl::http::Headers &headers) {
+  const std::string *cache_control = FindHeader(headers, "Cache-Control");
+  if (cache_control == nullptr) {
+    return 0;
+  }
+  std::string value = *cache_control;
+  for (auto &c : value) {
+    c = (char)tolower((unsigned char)c);
+  }
+  if (value.find("no-store") != std::string::npos) {
+    return -1;
+  }
+  if (value.find("no-cache") != std::string::npos) {
+    return 0;
+  }
+  size_t pos = value.find("max-age=");
+  if (pos == std::string::npos || (pos > 0 && value[pos - 1] != ' ' && value[pos - 1] != ',')) {
+    return 0;
+  }
+  long long max_age = atoll(value.c_str() + pos + strlen("max-age="));
+  const std::string *age = FindHeader(headers, "Age");
+  if (age != nullptr) {
+    max_age -= atoll(age->c_str());
+  }
+  return max_age > 0 ? max_age : 0;
+}
+
+long long GetRetryAfter(const xl::http::Headers &headers) {
+  const std::string *retry_after = FindHeader(headers, "Retry-After");
+  if (retry_after == nullptr || retry_after->empty()) {
+    return -1;
+  }
+  if (isdigit((unsigned char)(*retry_after)[0])) {
+    return atoll(retry_after->c_str());
+  }
+  // IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT", the only form servers are allowed to send.
+  static const char *MONTHS[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+  char month[4] = {};
+  tm date = {};
+  if (sscanf(retry_after->c_str(), "%*3s, %d %3s %d %d:%d:%d", &date.tm_mday, month, &date.tm_year, &date.tm_hour,
+             &date.tm_min, &date.tm_sec) != 6) {
+    return -1;
+  }
+  date.tm_mon = -1;
+  for (int i = 0; i < 12; ++i) {
+    if (strcmp(month, MONTHS[i]) == 0) {
+      date.tm_mon = i;
+    }
+  }
+  if (date.tm_mon < 0) {
+    return -1;
+  }
+  date.tm_year -= 1900;
+#ifdef _WIN32
+  long long at = (long long)_mkgmtime(&date);
+#else
+  long long at = (long long)timegm(&date);
+#endif
+  long long now = (long long)time(nullptr);
+  return at > now ? at - now : 0;
+}
+
+bool IsRetryableStatus(int status) {
+  // Anything that is not an HTTP status is a transport error.
+  return status < 100 || status > 599 || status == 408 || status == 429 || status == 500 || status == 502 ||
+         status == 503 || status == 504;
+}
+
+int HttpGet(const std::string &url,
+            const xl::http::Headers &request_headers,
+            xl::http::Headers &response_headers,
+            xl::http::ContentWriter writer) {
+  xl::http::Request request;
+  request.method = xl::http::METHOD_GET;
+  request.url = url;
+  request.headers = request_headers;
+  xl::http::Response response;
+  response.headers = &response_headers;
+  response.body = std::move(writer);
+  xl::http::Option option;
+  option.user_agent = SELFUPDATE_USER_AGENT;
+  option.timeout = HTTP_TRANSFER_TIMEOUT_MS;
+  return xl::http::send(request, &response, &option);
+}
+
+bool ParseContentRange(const std::string &value,
+                       unsigned long long &first,
+                       unsigned long long &last,
+                       long long &total) {
+  char total_expr[32] = {};
+  if (sscanf(value.c_str(), "bytes %llu-%llu/%31s", &first, &last, total_expr) != 3 || last < first) {
+    return false;
+  }
+  total = strcmp(total_expr, "*") == 0 ? -1 : atoll(total_expr);
+  return true;
+}
+
+} // namespace selfupdate
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <xl/http>
+
+namespace selfupdate {
+
+// Header names are case insensitive, and HTTP/2 servers send them in lower case.
+const std::string *FindHeader(const xl::http::Headers &headers, const char *name);
+
+// Returns the strong ETag, or Last-Modified, of a response, to be sent as If-Range. Weak ETags can not be used for
+// range requests. Returns an empty string if there is neither.
+std::string GetRangeValidator(const xl::http::Headers &headers);
+
+// Returns how many seconds a response may be reused without asking the server, from Cache-Control max-age less Age.
+// Returns 0 if it must be revalidated, and -1 if it must not be stored at all.
+long long GetMaxAge(const xl::http::Headers &headers);
+
+// Parses "bytes <first>-<last>/<total>". total is set to -1 if it is "*".
+bool ParseContentRange(const std::string &value,
+                       unsigned long long &first,
+                       unsigned long long &last,
+                       long long &total);
+
+// Returns the seconds to wait from Retry-After, given either as seconds or as an HTTP date. Returns -1 if there is none.
+long long GetRetryAfter(const xl::http::Headers &headers);
+
+// Whether a request that ended with status, an HTTP status or a transport error, may succeed if sent again later.
+bool IsRetryableStatus(int status);
+
+// Longest a download request may take. A connection that stalls without sending anything never reaches the writer,
+// where cancellation is checked, it is given up after this and the caller resumes it.
+const unsigned HTTP_TRANSFER_TIMEOUT_MS = 5 * 60 * 1000;
+
+// xl::http::get(), bounded by HTTP_TRANSFER_TIMEOUT_MS.
+int HttpGet(const std::string &url,
+            const xl::http::Headers &request_headers,
+            xl::http::Headers &response_headers,
+            xl::http::ContentWriter writer);
+
+} // namespace selfupdate
@@ -1,13 +1,178 @@
+#include "../base/file_util.h"
+#include "../base/hash.h"
+#include "../base/process_handoff.h"
+#include "../base/stopwatch.h"
+#include "../base/tar_extractor.h"
+#include "../base/thread_priority.h"
+#include "../base/update_trace.h"
+#include "../base/versioned_install.h"
+#include "../base/zip_extractor.h"
 #include "../common.h"
+#include "delta_package.h"
+#include "manifest_package.h"
+#include "staged_package.h"
+#include "update_metrics.h"
 #include <selfupdate/updater.h>
+#include <thread>
+#include <vector>
 #include <xl/file>
 #include <xl/log>
 #include <xl/native_string>
 #include <xl/process>
+#include <xl/zip>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace selfupdate {
 
+namespace {
+
+xl::native_string GetPackageFile(const xl::native_string &cache_dir, const PackageInfo &package_info) {
+  std::string package_file_name = package_info.package_name + PACKAGE_NAME_VERSION_SEP + package_info.package_version +
+                                  FILE_NAME_EXT_SEP + package_info.package_format;
+  return xl::path::join(cache_dir, xl::encoding::utf8_to_native(package_info.package_name),
+                        xl::encoding::utf8_to_native(package_file_name));
+}
+
+// The package may have been replaced or damaged since it was downloaded, it is in a directory other users can write to.
+bool VerifyPackageFile(const PackageInfo &package_info, const xl::native_string &package_file) {
+  MultiHasher hasher;
+  if (!hasher.Init(package_info.package_hash) || !HashFile(package_file, hasher) || !hasher.Verify()) {
+    XL_LOG_ERROR("Verify package failed: ", package_file);
+    return false;
+  }
+  return true;
+}
+
+// Puts a copy of installer_path at copied_installer_path for the installer to run from, as cheaply as possible. A copy
+// left there by an earlier Install() is reused if it still has the same content.
+bool ProvisionInstaller(const xl::native_string &installer_path, const xl::native_string &copied_installer_path) {
+  FileIdentity installer_identity, copied_identity;
+  if (GetFileIdentity(installer_path, installer_identity) && GetFileIdentity(copied_installer_path, copied_identity)) {
+    // The same file when hard linked, else only worth hashing if the size matches.
+    if (installer_identity == copied_identity) {
+      XL_LOG_INFO("Reusing installer: ", copied_installer_path);
+      return true;
+    }
+    const HashAlgorithm *algorithm = FindHashAlgorithm(PACKAGEINFO_PACKAGE_HASH_ALGO_SHA256);
+    if (installer_identity.size == copied_identity.size && algorithm != nullptr) {
+      std::string hash = HashFile(installer_path, *algorithm);
+      if (!hash.empty() && hash == HashFile(copied_installer_path, *algorithm)) {
+        XL_LOG_INFO("Reusing installer: ", copied_installer_path);
+        return true;
+      }
+    }
+  }
+  xl::fs::remove(copied_installer_path.c_str());
+#ifdef _WIN32
+  // A hard link to a running executable can not be deleted, the installation it replaces could not be emptied then.
+  bool provisioned = xl::fs::copy(installer_path.c_str(), copied_installer_path.c_str());
+#else
+  bool provisioned = LinkOrCopyFile(installer_path, copied_installer_path);
+#endif
+  if (!provisioned) {
+    XL_LOG_ERROR("Copy installer failed, from: ", installer_path, ", to: ", copied_installer_path);
+    return false;
+  }
+#ifndef _WIN32
+  // Clones and hard links are executable already, and a hard link shares its mode with the installed executable.
+  if (access(copied_installer_path.c_str(), X_OK) != 0) {
+    chmod(copied_installer_path.c_str(), S_IRUSR | S_IRGRP | S_IWUSR | S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH);
+  }
+#endif
+  return true;
+}
+
+// Marks a delta package that did not apply, so that the caller's next Download() fetches the full package.
+void OnDeltaPackageFailed(const PackageInfo &package_info, const xl::native_string &package_file) {
+  if (package_info.full_package_url.empty()) {
+    XL_LOG_ERROR("Apply delta package failed, and there is no full package.");
+    return;
+  }
+  XL_LOG_ERROR("Apply delta package failed, Download() again for the full package: ", package_info.full_package_url);
+  MarkDeltaPackageFailed(package_file);
+}
+
+// Reconstructs the changed files of a delta package next to install_location, for the installer to swap in. Fails if
+// the delta does not apply, the full package is used from the next Download() on then.
+bool PrepareDeltaPackage(const PackageInfo &package_info,
+                         const xl::native_string &package_file,
+                         const xl::native_string &install_location,
+                         xl::native_string &source) {
+  xl::native_string staged_dir = install_location + _T(INSTALL_LOCATION_NEW_SUFFIX);
+  xl::fs::remove_all(staged_dir.c_str());
+  if (ApplyDeltaPackage(package_file, install_location, staged_dir)) {
+    source = staged_dir;
+    return true;
+  }
+  xl::fs::remove_all(staged_dir.c_str());
+  OnDeltaPackageFailed(package_info, package_file);
+  return false;
+}
+
+// Extracts, or for delta and manifest packages builds, the new installation for package_file into a directory next to
+// install_location, apart from the one Download() extracts into while downloading, and commits it as staged.
+bool StagePackage(const PackageInfo &package_info,
+                  const InstallOptions &install_options,
+                  const xl::native_string &package_file,
+                  const xl::native_string &install_location) {
+  Stopwatch stopwatch;
+  xl::native_string staging_dir = install_location + _T(INSTALL_LOCATION_PREPARING_SUFFIX);
+  xl::fs::remove_all(staging_dir.c_str());
+  unsigned long long entry_count = 0;
+  bool prepared = false;
+  if (package_info.package_format == PACKAGEINFO_PACKAGE_FORMAT_MANIFEST) {
+    // Every file was verified as it was downloaded.
+    prepared = BuildManifestInstallation(package_info, package_file, install_location, staging_dir);
+  } else {
+    if (!VerifyPackageFile(package_info, package_file)) {
+      return false;
+    }
+    if (package_info.package_format == PACKAGEINFO_PACKAGE_FORMAT_ZIP) {
+      prepared = ExtractZip(package_file, staging_dir, install_options.extract_thread_count,
+                            install_options.incremental ? install_location : xl::native_string(), nullptr,
+                            nullptr, &entry_count);
+      if (!prepared) {
+        XL_LOG_WARN("Parallel extraction failed, retrying serially: ", package_file);
+        xl::fs::remove_all(staging_dir.c_str());
+        prepared = xl::zip::extract(package_file.c_str(), staging_dir.c_str());
+        entry_count = prepared ? CountDirectoryEntries(staging_dir) : 0;
+      }
+    } else if (package_info.package_format == PACKAGEINFO_PACKAGE_FORMAT_TAR_ZSTD) {
+      prepared = ExtractTarZstd(package_file, staging_dir, nullptr, &entry_count);
+    } else if (package_info.package_format == PACKAGEINFO_PACKAGE_FORMAT_DELTA) {
+      prepared = ApplyDeltaPackage(package_file, install_location, staging_dir);
+      if (!prepared) {
+        OnDeltaPackageFailed(package_info, package_file);
+      }
+    }
+  }
+  if (!prepared || !CommitStagedDirectory(package_file, staging_dir, install_location)) {
+    XL_LOG_ERROR("Stage package failed: ", package_file);
+    xl::fs::remove_all(staging_dir.c_str());
+    return false;
+  }
+  long long stage_ms = stopwatch.ElapsedMilliseconds();
+  RecordUpdateMetrics(UPDATE_PHASE_STAGE, [&](UpdateMetrics &metrics) {
+    metrics.stage_ms = stage_ms;
+    metrics.extracted_entries = entry_count;
+  });
+  return true;
+}
+
+} // namespace
+
 bool Install(const PackageInfo &package_info, const TCHAR *installer_path, const TCHAR *install_location) {
+  return Install(package_info, InstallOptions(), installer_path, install_location);
+}
+
+bool Install(const PackageInfo &package_info,
+             const InstallOptions &install_options,
+             const TCHAR *installer_path,
+             const TCHAR *install_location) {
   XL_LOG_INFO("Installing: ", package_info.package_name);
 
   xl::native_string cache_dir = xl::fs::tmp_dir();
@@ -15,69 +180,202 @@ bool Install(const PackageInfo &package_info, const TCHAR *installer_path, const
     XL_LOG_ERROR("Get temp dir error.");
     return false;
   }
-  std::string package_file_name = package_info.package_name + PACKAGE_NAME_VERSION_SEP + package_info.package_version +
-                                  FILE_NAME_EXT_SEP + package_info.package_format;
-  xl::native_string package_file = xl::path::join(cache_dir, xl::encoding::utf8_to_native(package_info.package_name),
-                                                  xl::encoding::utf8_to_native(package_file_name));
+  xl::native_string package_file = GetPackageFile(cache_dir, package_info);
+  if (IsDeltaPackageFailed(package_info, package_file)) {
+    XL_LOG_INFO("Delta package did not apply, installing the full package.");
+    return Install(GetFullPackageInfo(package_info), install_options, installer_path, install_location);
+  }
   if (!xl::fs::exists(package_file.c_str())) {
     XL_LOG_ERROR("Package file missing: ", package_file);
     return false;
   }
 
   xl::native_string exe_path = xl::process::executable_path();
-  xl::native_string exe_dir = xl::path::dirname(exe_path.c_str());
+  // The installation the executable is in, the executable directory unless it is a version of a versioned install.
+  xl::native_string exe_install_location = GetInstallLocationOf(xl::path::dirname(exe_path.c_str()));
   xl::native_string exe_file = xl::path::filename(exe_path.c_str());
 
   if (installer_path == nullptr) {
     installer_path = exe_path.c_str();
   }
   if (install_location == nullptr) {
-    install_location = exe_dir.c_str();
+    install_location = exe_install_location.c_str();
+  }
+  xl::native_string version;
+  if (install_options.keep_versions > 0) {
+    version = xl::encoding::utf8_to_native(package_info.package_version);
+    if (IsValidVersionName(version)) {
+      XL_LOG_INFO("Installing side by side, as version: ", version);
+    } else {
+      XL_LOG_WARN("Package version can not name a directory, installing in place: ", package_info.package_version);
+      version.clear();
+    }
+  }
+
+  xl::native_string source = package_file;
+  bool staged = FindStagedDirectory(package_file, install_location, source);
+  if (staged) {
+    XL_LOG_INFO("Using staged installation: ", source);
+  } else if (package_info.package_format != PACKAGEINFO_PACKAGE_FORMAT_MANIFEST &&
+             !VerifyPackageFile(package_info, package_file)) {
+    // Manifest packages are directories, every file was verified as it was downloaded.
+    return false;
+  }
+  if (!staged && package_info.package_format == PACKAGEINFO_PACKAGE_FORMAT_DELTA &&
+      !PrepareDeltaPackage(package_info, package_file, install_location, source)) {
+    return false;
+  }
+  if (!staged && package_info.package_format == PACKAGEINFO_PACKAGE_FORMAT_MANIFEST) {
+    source = xl::native_string(install_location) + _T(INSTALL_LOCATION_NEW_SUFFIX);
+    xl::fs::remove_all(source.c_str());
+    if (!BuildManifestInstallation(package_info, package_file, install_location, source)) {
+      xl::fs::remove_all(source.c_str());
+      return false;
+    }
   }
 
   xl::native_string copied_installer_path =
       xl::path::join(xl::path::dirname(package_file.c_str()), xl::path::filename(installer_path));
-  if (!xl::fs::copy(installer_path, copied_installer_path.c_str())) {
-    XL_LOG_ERROR("Copy installer failed, from: ", installer_path, ", to: ", copied_installer_path.c_str());
+  if (!ProvisionInstaller(installer_path, copied_installer_path)) {
     return false;
   }
+  // A separate installer does not change with the application, it is kept for the next update instead of deleting
+  // itself. A copy of the executable is only reused if the update failed.
+  bool keep_installer = exe_path != installer_path;
 
-#ifndef _WIN32
-  chmod(copied_installer_path.c_str(), S_IRUSR | S_IRGRP | S_IWUSR | S_IWGRP | S_IXUSR | S_IXGRP | S_IXOTH);
-#endif
+  // The installer adds its own metrics, and hands the file to the new version.
+  xl::native_string trace_file = package_file + _T(UPDATE_TRACE_FILE_SUFFIX);
+  WriteUpdateTrace(trace_file, GetUpdateMetrics());
+
+  // Keeps Download() and Stage() from replacing the staged directory while the installer waits to swap it in.
+  xl::native_string staged_dir = xl::native_string(install_location) + _T(INSTALL_LOCATION_NEW_SUFFIX);
+  if (source == staged_dir) {
+    ClaimStagedDirectory(install_location, _T(STAGED_OWNER_INSTALLER));
+  }
+
+  // Lets the installer start the moment NotifyFilesReleased() is called, ahead of this process exiting.
+  xl::native_string handoff = OpenHandoffChannel(package_file + _T(HANDOFF_FILE_SUFFIX));
 
   long pid = xl::process::pid();
   XL_LOG_INFO(_T("Launching installer. Command line: "), copied_installer_path.c_str(),
               _T(" --" INSTALLER_ARGUMENT_UPDATE " "), _T(" --" INSTALLER_ARGUMENT_WAIT_PID " "), pid,
               _T(" --" INSTALLER_ARGUMENT_FORCE_UPDATE " "), package_info.force_update ? _T("1") : _T("0"),
-              _T(" --" INSTALLER_ARGUMENT_SOURCE " "), package_file.c_str(), _T(" --" INSTALLER_ARGUMENT_TARGET " "),
-              install_location, _T(" --" INSTALLER_ARGUMENT_LAUNCH_FILE " "), exe_file.c_str());
-  long installer_pid = xl::process::start(copied_installer_path,
-                                          {
-                                              _T("--" INSTALLER_ARGUMENT_UPDATE),
-                                              _T("--" INSTALLER_ARGUMENT_WAIT_PID),
-                                              xl::to_native_string(pid),
-                                              _T("--" INSTALLER_ARGUMENT_FORCE_UPDATE),
-                                              package_info.force_update ? _T("1") : _T("0"),
-                                              _T("--" INSTALLER_ARGUMENT_SOURCE),
-                                              package_file,
-                                              _T("--" INSTALLER_ARGUMENT_TARGET),
-                                              install_location,
-                                              _T("--" INSTALLER_ARGUMENT_LAUNCH_FILE),
-                                              exe_file,
-                                          },
-                                          xl::path::dirname(copied_installer_path.c_str()));
+              _T(" --" INSTALLER_ARGUMENT_SOURCE " "), source.c_str(), _T(" --" INSTALLER_ARGUMENT_TARGET " "),
+              install_location, _T(" --" INSTALLER_ARGUMENT_LAUNCH_FILE " "), exe_file.c_str(),
+              _T(" --" INSTALLER_ARGUMENT_EXTRACT_THREADS " "), install_options.extract_thread_count,
+              _T(" --" INSTALLER_ARGUMENT_INCREMENTAL " "), install_options.incremental ? _T("1") : _T("0"),
+              _T(" --" INSTALLER_ARGUMENT_TRACE_FILE " "), trace_file.c_str(), _T(" --" INSTALLER_ARGUMENT_HANDOFF " "),
+              handoff.c_str());
+  std::vector<xl::native_string> installer_args = {
+      _T("--" INSTALLER_ARGUMENT_UPDATE),
+      _T("--" INSTALLER_ARGUMENT_WAIT_PID),
+      xl::to_native_string(pid),
+      _T("--" INSTALLER_ARGUMENT_FORCE_UPDATE),
+      package_info.force_update ? _T("1") : _T("0"),
+      _T("--" INSTALLER_ARGUMENT_SOURCE),
+      source,
+      _T("--" INSTALLER_ARGUMENT_TARGET),
+      install_location,
+      _T("--" INSTALLER_ARGUMENT_LAUNCH_FILE),
+      exe_file,
+      _T("--" INSTALLER_ARGUMENT_EXTRACT_THREADS),
+      xl::to_native_string(install_options.extract_thread_count),
+      _T("--" INSTALLER_ARGUMENT_INCREMENTAL),
+      install_options.incremental ? _T("1") : _T("0"),
+      _T("--" INSTALLER_ARGUMENT_TRACE_FILE),
+      trace_file,
+  };
+  if (!handoff.empty()) {
+    installer_args.push_back(_T("--" INSTALLER_ARGUMENT_HANDOFF));
+    installer_args.push_back(handoff);
+  }
+  if (keep_installer) {
+    installer_args.push_back(_T("--" INSTALLER_ARGUMENT_KEEP_INSTALLER));
+    installer_args.push_back(_T("1"));
+  }
+  if (!version.empty()) {
+    installer_args.push_back(_T("--" INSTALLER_ARGUMENT_VERSION));
+    installer_args.push_back(version);
+    installer_args.push_back(_T("--" INSTALLER_ARGUMENT_KEEP_VERSIONS));
+    installer_args.push_back(xl::to_native_string(install_options.keep_versions));
+  }
+  long installer_pid =
+      xl::process::start(copied_installer_path, installer_args, xl::path::dirname(copied_installer_path.c_str()));
   if (installer_pid == 0) {
     XL_LOG_ERROR(_T("Launch installer failed. Command line: "), copied_installer_path.c_str(),
                  _T(" --" INSTALLER_ARGUMENT_UPDATE " "), _T("--" INSTALLER_ARGUMENT_WAIT_PID " "), pid,
                  _T(" --" INSTALLER_ARGUMENT_FORCE_UPDATE " "), package_info.force_update ? _T("1") : _T("0"),
-                 _T(" --" INSTALLER_ARGUMENT_SOURCE " "), package_file.c_str(), _T(" --" INSTALLER_ARGUMENT_TARGET " "),
-                 install_location, _T(" --" INSTALLER_ARGUMENT_LAUNCH_FILE " "), exe_file.c_str());
+                 _T(" --" INSTALLER_ARGUMENT_SOURCE " "), source.c_str(), _T(" --" INSTALLER_ARGUMENT_TARGET " "),
+                 install_location, _T(" --" INSTALLER_ARGUMENT_LAUNCH_FILE " "), exe_file.c_str(),
+                 _T(" --" INSTALLER_ARGUMENT_EXTRACT_THREADS " "), install_options.extract_thread_count,
+                 _T(" --" INSTALLER_ARGUMENT_INCREMENTAL " "), install_options.incremental ? _T("1") : _T("0"),
+                 _T(" --" INSTALLER_ARGUMENT_TRACE_FILE " "), trace_file.c_str(),
+                 _T(" --" INSTALLER_ARGUMENT_HANDOFF " "), handoff.c_str());
+    xl::fs::remove(trace_file.c_str());
+    if (source == staged_dir) {
+      ClaimStagedDirectory(install_location, package_file);
+    }
     return false;
   }
 
+  // The installer only needs the staged directory.
+  if (package_info.package_format == PACKAGEINFO_PACKAGE_FORMAT_MANIFEST) {
+    xl::fs::remove_all(package_file.c_str());
+  } else if (source != package_file) {
+    xl::fs::remove(package_file.c_str());
+  }
+  xl::fs::remove((package_file + _T(STAGED_MARKER_SUFFIX)).c_str());
+
   XL_LOG_INFO("Launched installer");
   return true;
 }
 
+bool Stage(const PackageInfo &package_info, const InstallOptions &install_options, const TCHAR *install_location) {
+  XL_LOG_INFO("Staging: ", package_info.package_name);
+
+  xl::native_string cache_dir = xl::fs::tmp_dir();
+  if (cache_dir.empty()) {
+    XL_LOG_ERROR("Get temp dir error.");
+    return false;
+  }
+  xl::native_string package_file = GetPackageFile(cache_dir, package_info);
+  if (IsDeltaPackageFailed(package_info, package_file)) {
+    XL_LOG_INFO("Delta package did not apply, staging the full package.");
+    return Stage(GetFullPackageInfo(package_info), install_options, install_location);
+  }
+  if (!xl::fs::exists(package_file.c_str())) {
+    XL_LOG_ERROR("Package file missing: ", package_file);
+    return false;
+  }
+  xl::native_string location = install_location != nullptr
+                                   ? xl::native_string(install_location)
+                                   : GetInstallLocationOf(xl::path::dirname(xl::process::executable_path().c_str()));
+  xl::native_string staged_dir;
+  if (FindStagedDirectory(package_file, location, staged_dir)) {
+    XL_LOG_INFO("Package already staged: ", staged_dir);
+    return true;
+  }
+
+  bool staged = false;
+  // The priority can not be raised back on posix systems, so the caller's thread is left alone.
+  std::thread thread([&]() {
+    SetBackgroundThreadPriority();
+    staged = StagePackage(package_info, install_options, package_file, location);
+  });
+  thread.join();
+  return staged;
+}
+
+bool Rollback(const TCHAR *install_location) {
+  xl::native_string location = install_location != nullptr
+                                   ? xl::native_string(install_location)
+                                   : GetInstallLocationOf(xl::path::dirname(xl::process::executable_path().c_str()));
+  return RollbackVersion(location);
+}
+
+void NotifyFilesReleased() {
+  XL_LOG_INFO("Notifying installer that files are released.");
+  SignalHandoffChannel();
+}
+
 } // namespace selfupdate
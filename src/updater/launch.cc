@@ -1,6 +1,9 @@
+#include "../base/update_trace.h"
 #include "../common.h"
+#include "update_metrics.h"
 #include <selfupdate/updater.h>
 #include <xl/cmdline_options>
+#include <xl/file>
 #include <xl/native_string>
 
 namespace selfupdate {
@@ -15,6 +18,50 @@ bool IsForceUpdated(const xl::cmdline_options::parsed_options &options) {
   return options.get_as<bool>(_T(INSTALLER_ARGUMENT_FORCE_UPDATE));
 }
 
+bool IsSeparator(TCHAR c) {
+#ifdef _WIN32
+  return c == _T('\\') || c == _T('/');
+#else
+  return c == '/';
+#endif
+}
+
+// A trace file Install() could have written, next to a package in the cache directory. Anything else that comes on the
+// command line is left alone.
+bool IsTraceFileInCache(const xl::native_string &trace_file) {
+  xl::native_string cache_dir = xl::fs::tmp_dir();
+  xl::native_string suffix = _T(UPDATE_TRACE_FILE_SUFFIX);
+  if (cache_dir.empty() || trace_file.size() <= cache_dir.size() + suffix.size() ||
+      trace_file.compare(0, cache_dir.size(), cache_dir) != 0 ||
+      trace_file.compare(trace_file.size() - suffix.size(), suffix.size(), suffix) != 0) {
+    return false;
+  }
+  if (!IsSeparator(cache_dir.back()) && !IsSeparator(trace_file[cache_dir.size()])) {
+    return false;
+  }
+  return trace_file.find(_T("..")) == xl::native_string::npos;
+}
+
+bool LoadUpdateMetrics(const xl::cmdline_options::parsed_options &options, UpdateMetrics &metrics) {
+  if (!options.has(_T(INSTALLER_ARGUMENT_NEW_VERSION)) || !options.has(_T(INSTALLER_ARGUMENT_TRACE_FILE))) {
+    return false;
+  }
+  xl::native_string trace_file = options.get(_T(INSTALLER_ARGUMENT_TRACE_FILE));
+  trace_file.erase(0, trace_file.find_first_not_of(_T('"'), 0));
+  trace_file.erase(trace_file.find_last_not_of(_T('"')) + 1);
+  bool loaded = ReadUpdateTrace(trace_file, metrics);
+  if (IsTraceFileInCache(trace_file)) {
+    xl::fs::remove(trace_file.c_str());
+  }
+  if (!loaded) {
+    return false;
+  }
+  RecordUpdateMetrics(UPDATE_PHASE_INSTALL, [&metrics](UpdateMetrics &current) {
+    current = metrics;
+  });
+  return true;
+}
+
 } // namespace
 
 bool IsNewVersionFirstLaunched(int argc, const TCHAR *argv[]) {
@@ -25,6 +72,10 @@ bool IsForceUpdated(int argc, const TCHAR *argv[]) {
   return IsForceUpdated(xl::cmdline_options::parse(argc, argv));
 }
 
+bool LoadUpdateMetrics(int argc, const TCHAR *argv[], UpdateMetrics &metrics) {
+  return LoadUpdateMetrics(xl::cmdline_options::parse(argc, argv), metrics);
+}
+
 #ifdef _WIN32
 
 bool IsNewVersionFirstLaunched(const TCHAR *command_line) {
@@ -35,6 +86,10 @@ bool IsForceUpdated(const TCHAR *command_line) {
   return IsForceUpdated(xl::cmdline_options::parse(command_line));
 }
 
+bool LoadUpdateMetrics(const TCHAR *command_line, UpdateMetrics &metrics) {
+  return LoadUpdateMetrics(xl::cmdline_options::parse(command_line), metrics);
+}
+
 #endif
 
 } // namespace selfupdate
\ No newline at end of file
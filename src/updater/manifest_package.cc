@@ -0,0 +1,184 @@
+#include "manifest_package.h"
+#include "../base/file_util.h"
+#include "../base/hash.h"
+#include "../common.h"
+#include "http_util.h"
+#include <cstdio>
+#include <sstream>
+#include <vector>
+#include <xl/file>
+#include <xl/http>
+#include <xl/log>
+#include <xl/scope_exit>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif
+
+namespace selfupdate {
+
+namespace {
+
+bool FileMatches(const xl::native_string &path, const PackageFile &file) {
+  if (GetFileSize(path) != (long long)file.size) {
+    return false;
+  }
+  MultiHasher hasher;
+  return hasher.Init(file.hash) && HashFile(path, hasher) && hasher.Verify();
+}
+
+bool FetchPackageFile(const PackageInfo &package_info,
+                      const PackageFile &file,
+                      const xl::native_string &staged_file,
+                      const CancellationToken &cancellation_token,
+                      const BandwidthLimit &bandwidth_limit,
+                      const std::function<void(size_t)> &on_received) {
+  MultiHasher hasher;
+  if (!hasher.Init(file.hash)) {
+    return false;
+  }
+  FILE *f = _tfopen(staged_file.c_str(), _T("wb"));
+  if (f == nullptr) {
+    XL_LOG_ERROR("Open local file error: ", staged_file);
+    return false;
+  }
+
+  // Files stored in the package are fetched with a Range request, others from their own url.
+  std::string url = file.url;
+  xl::http::Headers request_headers;
+  if (url.empty()) {
+    url = package_info.package_url;
+    std::stringstream range_expr;
+    range_expr << "bytes=" << file.offset << "-" << file.offset + file.size - 1;
+    request_headers.insert({"Range", range_expr.str()});
+  }
+  xl::http::Headers response_headers;
+  unsigned long long received = 0;
+  int status = 0;
+  if (file.size > 0) {
+    status = HttpGet(url, request_headers, response_headers, [&](const void *buffer, size_t size) -> size_t {
+      if (cancellation_token.IsCancelled()) {
+        return 0;
+      }
+      bandwidth_limit.Acquire(size);
+      if (received + size > file.size || fwrite(buffer, 1, size, f) != size) {
+        return 0;
+      }
+      hasher.Update(buffer, size);
+      received += size;
+      on_received(size);
+      return size;
+    });
+  }
+  fclose(f);
+
+  bool ok = file.size == 0 || (status == (file.url.empty() ? 206 : 200) && received == file.size);
+  if (!ok || !hasher.Verify()) {
+    XL_LOG_ERROR("Download package file error: ", file.path, ", url: ", url, ", status/error: ", status,
+                 ", received: ", received);
+    xl::fs::remove(staged_file.c_str());
+    return false;
+  }
+#ifndef _WIN32
+  if (file.executable) {
+    chmod(staged_file.c_str(), S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+  }
+#endif
+  return true;
+}
+
+} // namespace
+
+bool DownloadManifestPackage(const PackageInfo &package_info,
+                             const xl::native_string &install_location,
+                             const xl::native_string &staged_dir,
+                             const CancellationToken &cancellation_token,
+                             const BandwidthLimit &bandwidth_limit,
+                             DownloadProgressMonitor download_progress_monitor) {
+  XL_LOG_INFO(_T("Downloading manifest package, compared with: "), install_location.c_str(), _T(", to: "),
+              staged_dir.c_str());
+  xl::fs::mkdirs(staged_dir.c_str());
+  if (!xl::fs::exists(staged_dir.c_str())) {
+    XL_LOG_ERROR("Create staged dir error: ", staged_dir);
+    return false;
+  }
+
+  std::vector<const PackageFile *> changed_files;
+  unsigned long long total_size = 0;
+  for (const auto &file : package_info.package_files) {
+    xl::native_string native_path;
+    if (!ToRelativeNativePath(file.path, native_path)) {
+      return false;
+    }
+    if (FileMatches(xl::path::join(install_location, native_path), file) ||
+        FileMatches(xl::path::join(staged_dir, native_path), file)) {
+      continue;
+    }
+    changed_files.push_back(&file);
+    total_size += file.size;
+  }
+  XL_LOG_INFO("Manifest files: ", package_info.package_files.size(), ", changed: ", changed_files.size(),
+              ", bytes to download: ", total_size);
+
+  unsigned long long downloaded_size = 0;
+  auto on_received = [&](size_t size) {
+    downloaded_size += size;
+    if (download_progress_monitor != nullptr) {
+      download_progress_monitor(downloaded_size, total_size);
+    }
+  };
+  for (const PackageFile *file : changed_files) {
+    xl::native_string native_path;
+    ToRelativeNativePath(file->path, native_path);
+    xl::native_string staged_file = xl::path::join(staged_dir, native_path);
+    xl::fs::mkdirs(xl::path::dirname(staged_file.c_str()).c_str());
+    if (cancellation_token.IsCancelled()) {
+      XL_LOG_INFO("Download cancelled, files staged so far are kept: ", staged_dir);
+      return false;
+    }
+    if (!FetchPackageFile(package_info, *file, staged_file, cancellation_token, bandwidth_limit, on_received)) {
+      return false;
+    }
+  }
+
+  XL_LOG_INFO("Downloaded manifest package OK: ", staged_dir);
+  return true;
+}
+
+bool BuildManifestInstallation(const PackageInfo &package_info,
+                               const xl::native_string &staged_dir,
+                               const xl::native_string &install_location,
+                               const xl::native_string &target_dir) {
+  XL_LOG_INFO(_T("Building new installation: "), target_dir.c_str());
+  xl::fs::mkdirs(target_dir.c_str());
+  size_t linked_count = 0;
+  for (const auto &file : package_info.package_files) {
+    xl::native_string native_path;
+    if (!ToRelativeNativePath(file.path, native_path)) {
+      return false;
+    }
+    xl::native_string target_file = xl::path::join(target_dir, native_path);
+    xl::fs::mkdirs(xl::path::dirname(target_file.c_str()).c_str());
+
+    // Staged files were verified when downloaded. Installed ones matched then, but may have been changed since.
+    xl::native_string staged_file = xl::path::join(staged_dir, native_path);
+    xl::native_string source_file = staged_file;
+    if (GetFileSize(staged_file) != (long long)file.size) {
+      source_file = xl::path::join(install_location, native_path);
+      if (!FileMatches(source_file, file)) {
+        XL_LOG_ERROR("Package file missing or changed: ", file.path);
+        return false;
+      }
+      ++linked_count;
+    }
+    if (!LinkOrCopyFile(source_file, target_file)) {
+      XL_LOG_ERROR(_T("Copy file failed, from: "), source_file.c_str(), _T(", to: "), target_file.c_str());
+      return false;
+    }
+  }
+
+  XL_LOG_INFO("New installation built, files: ", package_info.package_files.size(), ", unchanged: ", linked_count);
+  return true;
+}
+
+} // namespace selfupdate
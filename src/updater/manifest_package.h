@@ -0,0 +1,25 @@
+#pragma once
+
+#include <selfupdate/updater.h>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// Fetches the files of a manifest package that differ from the ones in install_location into staged_dir, each with
+// its own request. Files staged by an interrupted or cancelled run are kept if they still match.
+bool DownloadManifestPackage(const PackageInfo &package_info,
+                             const xl::native_string &install_location,
+                             const xl::native_string &staged_dir,
+                             const CancellationToken &cancellation_token,
+                             const BandwidthLimit &bandwidth_limit,
+                             DownloadProgressMonitor download_progress_monitor);
+
+// Builds the complete new installation in target_dir, taking changed files from staged_dir, and cloning or hard linking
+// unchanged ones from install_location. Those are hashed again, fails if one was modified since, Download() fetches it
+// then.
+bool BuildManifestInstallation(const PackageInfo &package_info,
+                               const xl::native_string &staged_dir,
+                               const xl::native_string &install_location,
+                               const xl::native_string &target_dir);
+
+} // namespace selfupdate
@@ -0,0 +1,160 @@
+#include "package_store.h"
+#include "../base/stopwatch.h"
+#include "../common.h"
+#include "backoff.h"
+#include <algorithm>
+#include <ctime>
+#include <vector>
+#include <xl/encoding>
+#include <xl/file>
+#include <xl/log>
+
+namespace selfupdate {
+
+namespace {
+
+const TCHAR *LOCK_FILE_SUFFIX = _T(".lock");
+const long long LOCK_POLL_INTERVAL_MS = 200;
+// A partial download whose journal has not been written for this long is given up.
+const long long ORPHAN_AGE_SECONDS = 7 * 24 * 3600;
+
+// Strongest first.
+const char *KEY_HASH_ALGORITHMS[] = {
+    PACKAGEINFO_PACKAGE_HASH_ALGO_SHA512, PACKAGEINFO_PACKAGE_HASH_ALGO_SHA384, PACKAGEINFO_PACKAGE_HASH_ALGO_SHA256,
+    PACKAGEINFO_PACKAGE_HASH_ALGO_SHA224, PACKAGEINFO_PACKAGE_HASH_ALGO_SHA1,   PACKAGEINFO_PACKAGE_HASH_ALGO_MD5,
+};
+
+bool EndsWith(const xl::native_string &s, const TCHAR *suffix) {
+  xl::native_string tail = suffix;
+  return s.size() >= tail.size() && s.compare(s.size() - tail.size(), tail.size(), tail) == 0;
+}
+
+// Files of one key in the store directory.
+struct StoreEntry {
+  std::vector<xl::native_string> files;
+  unsigned long long size = 0;
+  long long last_used = 0;
+  long long last_written = -1; // of the resume journal, -1 if the package is complete
+};
+
+} // namespace
+
+bool PackageStore::Open(const xl::native_string &store_dir, bool shared) {
+  xl::fs::mkdirs(store_dir.c_str());
+  if (!IsDirectory(store_dir)) {
+    XL_LOG_WARN("Create package store error: ", store_dir);
+    return false;
+  }
+  store_dir_ = store_dir;
+  shared_ = shared;
+  return true;
+}
+
+std::string PackageStore::GetKey(const std::map<std::string, std::string> &package_hash) {
+  for (const char *algorithm : KEY_HASH_ALGORITHMS) {
+    auto it = package_hash.find(algorithm);
+    if (it == package_hash.end() || it->second.empty()) {
+      continue;
+    }
+    // The digest comes from the server, it must not be able to name another file.
+    std::string digest = it->second;
+    std::transform(digest.begin(), digest.end(), digest.begin(), ::tolower);
+    if (digest.find_first_not_of("0123456789abcdef") != std::string::npos) {
+      return {};
+    }
+    return std::string(algorithm) + "-" + digest;
+  }
+  return {};
+}
+
+xl::native_string PackageStore::GetPackageFile(const std::string &key, const std::string &format) const {
+  return xl::path::join(store_dir_, xl::encoding::utf8_to_native(key + FILE_NAME_EXT_SEP + format));
+}
+
+bool PackageStore::Lock(const std::string &key,
+                        long long timeout_ms,
+                        const CancellationToken &cancellation_token,
+                        FileLock &lock) const {
+  xl::native_string lock_file = xl::path::join(store_dir_, xl::encoding::utf8_to_native(key)) + LOCK_FILE_SUFFIX;
+  Stopwatch stopwatch;
+  for (bool waiting = false;; waiting = true) {
+    if (lock.TryLock(lock_file, shared_)) {
+      if (waiting) {
+        XL_LOG_INFO("Package store entry released: ", key);
+      }
+      return true;
+    }
+    if (GetFileSize(lock_file) < 0) {
+      XL_LOG_ERROR("Create lock file error: ", lock_file);
+      return false;
+    }
+    if (!waiting) {
+      XL_LOG_INFO("Package being downloaded by another process, waiting: ", key);
+    }
+    if (stopwatch.ElapsedMilliseconds() >= timeout_ms) {
+      XL_LOG_WARN("Package store entry still held, giving up waiting: ", key);
+      return false;
+    }
+    if (!SleepUnlessCancelled(LOCK_POLL_INTERVAL_MS, cancellation_token)) {
+      return false;
+    }
+  }
+}
+
+void PackageStore::Evict(unsigned long long max_size) const {
+  std::map<xl::native_string, StoreEntry> entries;
+  xl::fs::enum_dir(store_dir_.c_str(), [&](const xl::native_string &path, bool is_dir) -> bool {
+    xl::native_string name = xl::path::filename(path.c_str());
+    size_t dot = name.find(_T('.'));
+    if (is_dir || dot == xl::native_string::npos || EndsWith(name, LOCK_FILE_SUFFIX)) {
+      return true;
+    }
+    xl::native_string file = xl::path::join(store_dir_, name);
+    StoreEntry &entry = entries[name.substr(0, dot)];
+    entry.files.push_back(file);
+    entry.size += (unsigned long long)std::max(GetFileSize(file), 0LL);
+    if (EndsWith(name, _T(DOWNLOADING_FILE_SUFFIX))) {
+      entry.last_written = GetFileModifiedTime(file);
+    } else {
+      entry.last_used = GetFileModifiedTime(file);
+    }
+    return true;
+  });
+
+  unsigned long long total_size = 0;
+  std::vector<std::pair<long long, const xl::native_string *>> lru;
+  long long now = (long long)time(nullptr);
+  for (const auto &item : entries) {
+    const StoreEntry &entry = item.second;
+    if (entry.last_written >= 0 && now - entry.last_written < ORPHAN_AGE_SECONDS) {
+      total_size += entry.size;
+    } else if (entry.last_written >= 0) {
+      lru.push_back({-1, &item.first});
+    } else {
+      total_size += entry.size;
+      lru.push_back({entry.last_used, &item.first});
+    }
+  }
+  // Orphans go first, whatever the size of the store.
+  std::sort(lru.begin(), lru.end());
+  for (const auto &item : lru) {
+    if (item.first >= 0 && total_size <= max_size) {
+      break;
+    }
+    const StoreEntry &entry = entries[*item.second];
+    FileLock lock;
+    if (!lock.TryLock(xl::path::join(store_dir_, *item.second) + LOCK_FILE_SUFFIX, shared_)) {
+      continue;
+    }
+    XL_LOG_INFO(item.first < 0 ? "Removing abandoned download: " : "Evicting package: ", *item.second,
+                ", size: ", entry.size);
+    for (const auto &file : entry.files) {
+      xl::fs::remove(file.c_str());
+    }
+    if (item.first >= 0) {
+      total_size -= entry.size;
+    }
+  }
+}
+
+} // namespace selfupdate
@@ -0,0 +1,45 @@
+#pragma once
+
+#include "../base/file_util.h"
+#include <map>
+#include <selfupdate/updater.h>
+#include <string>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// Packages shared by every process that uses the same store directory, named after their hash, so that a package is
+// downloaded and stored once whoever asks for it. Each entry has a lock file, whoever holds it is the only one
+// downloading, verifying or removing the entry. The files are "<key>.<format>", with the resume journal next to it
+// while it is being downloaded, and "<key>.lock", which is never removed, so that every process locks the same file.
+//
+// The store is private to the user unless it is opened as shared. Other users may change a package in a shared store
+// at any time, it must be copied out and verified again before it is used.
+class PackageStore {
+public:
+  bool Open(const xl::native_string &store_dir, bool shared);
+
+  bool shared() const {
+    return shared_;
+  }
+
+  // Names the package after the strongest of its hashes. Returns an empty string if there is no usable one.
+  static std::string GetKey(const std::map<std::string, std::string> &package_hash);
+
+  xl::native_string GetPackageFile(const std::string &key, const std::string &format) const;
+  // Waits until no other process holds the entry. Returns false if cancelled meanwhile, if the entry is still held
+  // after timeout_ms, e.g. by a hung process, or if the lock file can not be created.
+  bool Lock(const std::string &key,
+            long long timeout_ms,
+            const CancellationToken &cancellation_token,
+            FileLock &lock) const;
+  // Removes partial downloads nobody has resumed for a while, then the least recently used packages until the store
+  // fits in max_size. Entries locked by anyone, including the caller, are left alone.
+  void Evict(unsigned long long max_size) const;
+
+private:
+  xl::native_string store_dir_;
+  bool shared_ = false;
+};
+
+} // namespace selfupdate
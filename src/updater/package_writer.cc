@@ -0,0 +1,147 @@
+#include "package_writer.h"
+#include "../base/file_util.h"
+#include <algorithm>
+#include <cstring>
+#include <xl/log>
+
+#ifdef _WIN32
+#define ftell _ftelli64
+#define fseek _fseeki64
+#else
+#define _FILE_OFFSET_BITS 64
+#define ftell ftello
+#define fseek fseeko
+#endif
+
+namespace selfupdate {
+
+namespace {
+
+const size_t WRITE_BUFFER_SIZE = 1024 * 1024;
+const size_t WRITE_BUFFER_COUNT = 8;
+
+} // namespace
+
+PackageWriter::PackageWriter(FILE *f) : file_(f), buffers_(WRITE_BUFFER_COUNT) {
+  // Buffers are written as they are, stdio would only copy them once more.
+  setvbuf(file_, nullptr, _IONBF, 0);
+  long long offset = ftell(file_);
+  offset_ = offset > 0 ? (unsigned long long)offset : 0;
+  for (size_t i = 0; i < buffers_.size(); ++i) {
+    buffers_[i].data.reset(new char[WRITE_BUFFER_SIZE]);
+    free_.push_back(i);
+  }
+  thread_ = std::thread(&PackageWriter::Run, this);
+}
+
+PackageWriter::~PackageWriter() {
+  Drain();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  changed_.notify_all();
+  thread_.join();
+}
+
+// Called with mutex_ held, and a free buffer available. The first buffer after a seek only goes up to the next aligned
+// offset.
+void PackageWriter::StartBuffer() {
+  current_ = free_.front();
+  free_.pop_front();
+  has_current_ = true;
+  Buffer &buffer = buffers_[current_];
+  buffer.size = 0;
+  buffer.capacity = WRITE_BUFFER_SIZE - (size_t)(offset_ % WRITE_BUFFER_SIZE);
+}
+
+bool PackageWriter::Write(const void *data, size_t size) {
+  const char *p = (const char *)data;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (size > 0) {
+    if (failed_) {
+      return false;
+    }
+    if (!has_current_) {
+      // Waits only when the disk is behind by all buffers.
+      changed_.wait(lock, [this]() {
+        return failed_ || !free_.empty();
+      });
+      if (failed_) {
+        return false;
+      }
+      StartBuffer();
+    }
+    Buffer &buffer = buffers_[current_];
+    size_t n = std::min(size, buffer.capacity - buffer.size);
+    memcpy(buffer.data.get() + buffer.size, p, n);
+    buffer.size += n;
+    offset_ += n;
+    p += n;
+    size -= n;
+    if (buffer.size == buffer.capacity) {
+      full_.push_back(current_);
+      has_current_ = false;
+      changed_.notify_all();
+    }
+  }
+  return !failed_;
+}
+
+bool PackageWriter::Drain() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (has_current_) {
+    if (buffers_[current_].size > 0) {
+      full_.push_back(current_);
+    } else {
+      free_.push_back(current_);
+    }
+    has_current_ = false;
+    changed_.notify_all();
+  }
+  changed_.wait(lock, [this]() {
+    return failed_ || (full_.empty() && !writing_);
+  });
+  return !failed_;
+}
+
+bool PackageWriter::Sync() {
+  return Drain() && SyncFile(file_);
+}
+
+bool PackageWriter::Seek(unsigned long long offset) {
+  if (!Drain() || fseek(file_, (long long)offset, SEEK_SET) != 0) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  offset_ = offset;
+  return true;
+}
+
+void PackageWriter::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    changed_.wait(lock, [this]() {
+      return stopping_ || !full_.empty();
+    });
+    if (full_.empty()) {
+      return;
+    }
+    size_t index = full_.front();
+    full_.pop_front();
+    writing_ = true;
+    lock.unlock();
+    Buffer &buffer = buffers_[index];
+    bool written = failed_ || fwrite(buffer.data.get(), 1, buffer.size, file_) == buffer.size;
+    lock.lock();
+    if (!written && !failed_) {
+      XL_LOG_ERROR("Write package file error.");
+      failed_ = true;
+    }
+    writing_ = false;
+    free_.push_back(index);
+    changed_.notify_all();
+  }
+}
+
+} // namespace selfupdate
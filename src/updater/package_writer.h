@@ -0,0 +1,60 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace selfupdate {
+
+// Writes received data to the package file on a thread of its own, so that a slow disk does not hold up the socket
+// until it falls behind by all of its buffers. Data is gathered into a ring of reusable buffers, each written with one
+// call once full, at offsets aligned to the buffer size.
+//
+// f must be positioned where the data goes, and must not be used by anyone else until Sync() or Seek() returns, or the
+// writer is destroyed, which writes what is pending first.
+class PackageWriter {
+public:
+  explicit PackageWriter(FILE *f);
+  ~PackageWriter();
+  PackageWriter(const PackageWriter &) = delete;
+  PackageWriter &operator=(const PackageWriter &) = delete;
+
+  // Returns false once a write has failed.
+  bool Write(const void *data, size_t size);
+  // Writes everything pending and asks the system to put it on disk.
+  bool Sync();
+  // Writes everything pending, then continues at offset.
+  bool Seek(unsigned long long offset);
+
+private:
+  struct Buffer {
+    std::unique_ptr<char[]> data;
+    size_t size = 0;
+    size_t capacity = 0;
+  };
+
+  bool Drain();
+  void StartBuffer();
+  void Run();
+
+  FILE *file_;
+  unsigned long long offset_ = 0;
+  std::vector<Buffer> buffers_;
+  // Indices into buffers_.
+  std::deque<size_t> free_;
+  std::deque<size_t> full_;
+  size_t current_ = 0;
+  bool has_current_ = false;
+  bool writing_ = false;
+  bool failed_ = false;
+  bool stopping_ = false;
+  std::mutex mutex_;
+  std::condition_variable changed_;
+  std::thread thread_;
+};
+
+} // namespace selfupdate
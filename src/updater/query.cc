@@ -1,15 +1,40 @@
+#include "../base/file_util.h"
+#include "../base/hash.h"
+#include "../base/stopwatch.h"
 #include "../common.h"
+#include "backoff.h"
+#include "http_util.h"
+#include "query_cache.h"
+#include "update_metrics.h"
+#include <algorithm>
+#include <climits>
+#include <ctime>
+#include <mutex>
 #include <selfupdate/updater.h>
+#include <xl/file>
 #include <xl/http>
 #include <xl/json>
 #include <xl/log>
 #include <xl/native_string>
+#include <yyjson.h>
 
 namespace selfupdate {
 
 namespace {
 
 typedef std::map<std::string, std::string> StringMap;
+typedef std::vector<std::string> StringVector;
+
+XL_JSON_BEGIN(PackageFileInternal)
+  XL_JSON_MEMBER(std::string, path)
+  XL_JSON_MEMBER(unsigned long long, size)
+  XL_JSON_MEMBER(StringMap, hash)
+  XL_JSON_MEMBER(bool, executable)
+  XL_JSON_MEMBER(std::string, url)
+  XL_JSON_MEMBER(unsigned long long, offset)
+XL_JSON_END()
+
+typedef std::vector<PackageFileInternal> PackageFileVector;
 
 XL_JSON_BEGIN(PackageInfoInternal)
   XL_JSON_MEMBER(std::string, package_name)
@@ -20,35 +45,37 @@ XL_JSON_BEGIN(PackageInfoInternal)
   XL_JSON_MEMBER(unsigned long long, package_size)
   XL_JSON_MEMBER(std::string, package_format)
   XL_JSON_MEMBER(StringMap, package_hash)
+  XL_JSON_MEMBER(unsigned long long, package_chunk_size)
+  XL_JSON_MEMBER(std::string, package_chunk_hash_algo)
+  XL_JSON_MEMBER(StringVector, package_chunk_hashes)
+  XL_JSON_MEMBER(std::string, full_package_url)
+  XL_JSON_MEMBER(unsigned long long, full_package_size)
+  XL_JSON_MEMBER(StringMap, full_package_hash)
+  XL_JSON_MEMBER(PackageFileVector, package_files)
   XL_JSON_MEMBER(std::string, update_title)
   XL_JSON_MEMBER(std::string, update_description)
+  XL_JSON_MEMBER(unsigned long long, rollout_percentage)
+  XL_JSON_MEMBER(unsigned long long, retry_after)
+  XL_JSON_MEMBER(unsigned long long, download_window)
 XL_JSON_END()
 
 const unsigned QUERY_TIMEOUT = 10000;
+const unsigned HTTP_STATUS_NOT_MODIFIED = 304;
 
-} // namespace
-
-bool Query(const std::string &query_url,
-           const std::multimap<std::string, std::string> &headers,
-           const std::string &query_body,
-           PackageInfo &package_info) {
-  XL_LOG_INFO("Querying: ", query_url, ", headers: ", headers.size(), ", body: ", query_body);
-  xl::http::Request request;
-  request.url = query_url;
-  request.method = query_body.empty() ? xl::http::METHOD_GET : xl::http::METHOD_POST;
-  xl::http::Response response;
-  std::string response_body;
-  response.body = xl::http::buffer_writer(&response_body);
-  xl::http::Option option;
-  option.user_agent = SELFUPDATE_USER_AGENT;
-
-  unsigned status = xl::http::send(request, &response, &option);
-  if (status != 200) {
-    XL_LOG_ERROR("Querying failed. http status/error: ", status);
+// xl::json leaves missing members at 0, whether one is there at all is looked up among the top-level keys of the
+// document, with yyjson that xl::json is built on.
+bool HasJsonMember(const std::string &json, const char *name) {
+  yyjson_doc *doc = yyjson_read(json.c_str(), json.size(), 0);
+  if (doc == nullptr) {
     return false;
   }
-  XL_LOG_INFO("Quering succeeded. Result: ", response_body);
+  yyjson_val *root = yyjson_doc_get_root(doc);
+  bool has_member = yyjson_is_obj(root) && yyjson_obj_get(root, name) != nullptr;
+  yyjson_doc_free(doc);
+  return has_member;
+}
 
+bool ParsePackageInfo(const std::string &response_body, PackageInfo &package_info) {
   PackageInfoInternal json;
   if (!json.json_parse(response_body.c_str())) {
     XL_LOG_ERROR("Parsing json failed.");
@@ -63,27 +90,277 @@ bool Query(const std::string &query_url,
   package_info.package_size = std::move(json.package_size);
   package_info.package_format = std::move(json.package_format);
   package_info.package_hash = std::move(json.package_hash);
+  package_info.package_chunk_size = json.package_chunk_size;
+  package_info.package_chunk_hash_algo = std::move(json.package_chunk_hash_algo);
+  package_info.package_chunk_hashes = std::move(json.package_chunk_hashes);
+  package_info.full_package_url = std::move(json.full_package_url);
+  package_info.full_package_size = json.full_package_size;
+  package_info.full_package_hash = std::move(json.full_package_hash);
+  package_info.package_files.clear();
+  for (auto &item : json.package_files) {
+    PackageFile file;
+    file.path = std::move(item.path);
+    file.size = item.size;
+    file.hash = std::move(item.hash);
+    file.executable = item.executable;
+    file.url = std::move(item.url);
+    file.offset = item.offset;
+    package_info.package_files.push_back(std::move(file));
+  }
   package_info.update_title = std::move(json.update_title);
   package_info.update_description = std::move(json.update_description);
+  package_info.rollout_percentage =
+      HasJsonMember(response_body, "rollout_percentage") ? (unsigned)std::min(json.rollout_percentage, 100ULL) : 100;
+  package_info.retry_after = (unsigned)std::min(json.retry_after, (unsigned long long)UINT_MAX);
+  package_info.download_window = (unsigned)std::min(json.download_window, (unsigned long long)UINT_MAX);
 
+  if (package_info.has_new_version && package_info.rollout_percentage < 100) {
+    unsigned bucket =
+        GetRolloutBucket(package_info.package_name + PACKAGE_NAME_VERSION_SEP + package_info.package_version);
+    if (bucket >= package_info.rollout_percentage) {
+      XL_LOG_INFO("New version not rolled out to this installation yet: ", package_info.package_version,
+                  ", rollout: ", package_info.rollout_percentage, "%, bucket: ", bucket);
+      package_info.has_new_version = false;
+    }
+  }
   if (!package_info.has_new_version) {
     XL_LOG_INFO("No new version.");
     return true;
   }
-  if (package_info.package_format != PACKAGEINFO_PACKAGE_FORMAT_ZIP) {
+  if (package_info.package_format != PACKAGEINFO_PACKAGE_FORMAT_ZIP &&
+      package_info.package_format != PACKAGEINFO_PACKAGE_FORMAT_TAR_ZSTD &&
+      package_info.package_format != PACKAGEINFO_PACKAGE_FORMAT_DELTA &&
+      package_info.package_format != PACKAGEINFO_PACKAGE_FORMAT_MANIFEST) {
     XL_LOG_ERROR("Unsupported package format: ", package_info.package_format);
     return false;
   }
   for (const auto &item : package_info.package_hash) {
-    if (item.first != PACKAGEINFO_PACKAGE_HASH_ALGO_MD5 && item.first != PACKAGEINFO_PACKAGE_HASH_ALGO_SHA1 &&
-        item.first != PACKAGEINFO_PACKAGE_HASH_ALGO_SHA224 && item.first != PACKAGEINFO_PACKAGE_HASH_ALGO_SHA256 &&
-        item.first != PACKAGEINFO_PACKAGE_HASH_ALGO_SHA384 && item.first != PACKAGEINFO_PACKAGE_HASH_ALGO_SHA512) {
+    if (FindHashAlgorithm(item.first) == nullptr) {
+      XL_LOG_ERROR("Unsupported hash algorithm: ", item.first);
+      return false;
+    }
+  }
+  for (const auto &item : package_info.full_package_hash) {
+    if (FindHashAlgorithm(item.first) == nullptr) {
       XL_LOG_ERROR("Unsupported hash algorithm: ", item.first);
       return false;
     }
   }
+  if (package_info.package_format == PACKAGEINFO_PACKAGE_FORMAT_MANIFEST && package_info.package_files.empty()) {
+    XL_LOG_ERROR("Manifest package without files.");
+    return false;
+  }
+  for (const auto &file : package_info.package_files) {
+    xl::native_string native_path;
+    if (!ToRelativeNativePath(file.path, native_path) || file.hash.empty()) {
+      XL_LOG_ERROR("Invalid package file: ", file.path);
+      return false;
+    }
+    for (const auto &item : file.hash) {
+      if (FindHashAlgorithm(item.first) == nullptr) {
+        XL_LOG_ERROR("Unsupported hash algorithm: ", item.first);
+        return false;
+      }
+    }
+  }
+  if (package_info.package_chunk_size > 0) {
+    unsigned long long chunk_count =
+        (package_info.package_size + package_info.package_chunk_size - 1) / package_info.package_chunk_size;
+    if (FindHashAlgorithm(package_info.package_chunk_hash_algo) == nullptr ||
+        package_info.package_chunk_hashes.size() != chunk_count) {
+      XL_LOG_WARN("Invalid package chunk hashes, ignored. algorithm: ", package_info.package_chunk_hash_algo,
+                  ", chunks: ", package_info.package_chunk_hashes.size(), ", expected: ", chunk_count);
+      package_info.package_chunk_size = 0;
+      package_info.package_chunk_hash_algo.clear();
+      package_info.package_chunk_hashes.clear();
+    }
+  }
   XL_LOG_INFO("New version found: ", package_info.package_version, ", url: ", package_info.package_url);
   return true;
 }
 
+// Responses parsed by this process, by cache file, so that a response answered from the cache is parsed only once.
+std::mutex parsed_responses_mutex;
+std::map<xl::native_string, std::pair<std::string, PackageInfo>> parsed_responses;
+
+bool ParseResponse(const xl::native_string &cache_file, const std::string &response_body, PackageInfo &package_info) {
+  if (!cache_file.empty()) {
+    std::lock_guard<std::mutex> lock(parsed_responses_mutex);
+    auto it = parsed_responses.find(cache_file);
+    if (it != parsed_responses.end() && it->second.first == response_body) {
+      package_info = it->second.second;
+      return true;
+    }
+  }
+  if (!ParsePackageInfo(response_body, package_info)) {
+    return false;
+  }
+  if (!cache_file.empty()) {
+    std::lock_guard<std::mutex> lock(parsed_responses_mutex);
+    parsed_responses[cache_file] = {response_body, package_info};
+  }
+  return true;
+}
+
+bool QueryPackageInfo(const std::string &query_url,
+                      const std::multimap<std::string, std::string> &headers,
+                      const std::string &query_body,
+                      PackageInfo &package_info,
+                      const CancellationToken &cancellation_token,
+                      bool &from_cache,
+                      bool &not_modified) {
+  XL_LOG_INFO("Querying: ", query_url, ", headers: ", headers.size(), ", body: ", query_body);
+  xl::native_string cache_file = GetQueryCacheFile(query_url, headers, query_body);
+  QueryCacheEntry cached;
+  bool has_cache = !cache_file.empty() && LoadQueryCache(cache_file, cached);
+  long long now = (long long)time(nullptr);
+  if (has_cache && now < cached.expires) {
+    XL_LOG_INFO("Query answered from cache, expires in: ", cached.expires - now, "s");
+    from_cache = true;
+    return ParseResponse(cache_file, cached.body, package_info);
+  }
+  long long retry_at = cache_file.empty() ? 0 : LoadQueryBackoff(cache_file);
+  if (now < retry_at) {
+    // The server asked for a break, an outdated answer is better than none.
+    if (!has_cache) {
+      XL_LOG_ERROR("Query backing off, retry in: ", retry_at - now, "s");
+      return false;
+    }
+    XL_LOG_INFO("Query backing off, answered from cache, retry in: ", retry_at - now, "s");
+    from_cache = true;
+    return ParseResponse(cache_file, cached.body, package_info);
+  }
+
+  xl::http::Request request;
+  request.url = query_url;
+  request.method = query_body.empty() ? xl::http::METHOD_GET : xl::http::METHOD_POST;
+  request.headers = headers;
+  request.body = query_body;
+  if (has_cache && !cached.etag.empty()) {
+    request.headers.insert({"If-None-Match", cached.etag});
+  }
+  if (has_cache && !cached.last_modified.empty()) {
+    request.headers.insert({"If-Modified-Since", cached.last_modified});
+  }
+  xl::http::Response response;
+  xl::http::Headers response_headers;
+  response.headers = &response_headers;
+  std::string response_body;
+  response.body = [&response_body, &cancellation_token](const void *data, size_t size) -> size_t {
+    if (cancellation_token.IsCancelled()) {
+      return 0;
+    }
+    response_body.append((const char *)data, size);
+    return size;
+  };
+  xl::http::Option option;
+  option.user_agent = SELFUPDATE_USER_AGENT;
+  option.timeout = QUERY_TIMEOUT;
+
+  unsigned status = 0;
+  for (unsigned attempt = 1;; ++attempt) {
+    if (cancellation_token.IsCancelled()) {
+      XL_LOG_INFO("Query cancelled.");
+      return false;
+    }
+    response_headers.clear();
+    response_body.clear();
+    status = xl::http::send(request, &response, &option);
+    if (cancellation_token.IsCancelled()) {
+      XL_LOG_INFO("Query cancelled.");
+      return false;
+    }
+    long long retry_after = GetRetryAfter(response_headers);
+    if (!IsRetryableStatus(status) || attempt >= RETRY_ATTEMPT_COUNT || retry_after > MAX_RETRY_AFTER_SECONDS) {
+      break;
+    }
+    long long delay_ms = GetRetryDelayMs(attempt, retry_after * 1000);
+    XL_LOG_WARN("Querying failed, retrying in: ", delay_ms, "ms, http status/error: ", status);
+    if (!SleepUnlessCancelled(delay_ms, cancellation_token)) {
+      XL_LOG_INFO("Query cancelled.");
+      return false;
+    }
+  }
+  now = (long long)time(nullptr);
+  long long max_age = GetMaxAge(response_headers);
+  if (status == HTTP_STATUS_NOT_MODIFIED && has_cache) {
+    XL_LOG_INFO("Query not modified, max age: ", max_age);
+    not_modified = true;
+    if (!ParseResponse(cache_file, cached.body, package_info)) {
+      return false;
+    }
+    SaveQueryBackoff(cache_file, 0);
+    max_age = std::max(max_age, (long long)package_info.retry_after);
+    if (max_age >= 0) {
+      const std::string *etag = FindHeader(response_headers, "ETag");
+      if (etag != nullptr) {
+        cached.etag = *etag;
+      }
+      cached.expires = now + max_age;
+      SaveQueryCache(cache_file, cached);
+    }
+    return true;
+  }
+  if (status != 200) {
+    XL_LOG_ERROR("Querying failed. http status/error: ", status);
+    long long retry_after = GetRetryAfter(response_headers);
+    if (retry_after > 0 && !cache_file.empty()) {
+      SaveQueryBackoff(cache_file, now + retry_after);
+    }
+    return false;
+  }
+  XL_LOG_INFO("Quering succeeded, response size: ", response_body.size());
+
+  if (!ParseResponse(cache_file, response_body, package_info)) {
+    return false;
+  }
+  if (cache_file.empty()) {
+    return true;
+  }
+  SaveQueryBackoff(cache_file, 0);
+  // Only worth storing if it can be reused as is, or revalidated.
+  QueryCacheEntry entry;
+  const std::string *etag = FindHeader(response_headers, "ETag");
+  const std::string *last_modified = FindHeader(response_headers, "Last-Modified");
+  entry.etag = etag != nullptr ? *etag : std::string();
+  entry.last_modified = last_modified != nullptr ? *last_modified : std::string();
+  // The retry_after hint keeps the response in use regardless of the HTTP caching headers.
+  max_age = std::max(max_age, (long long)package_info.retry_after);
+  if (max_age < 0 || (max_age == 0 && entry.etag.empty() && entry.last_modified.empty())) {
+    xl::fs::remove(cache_file.c_str());
+    return true;
+  }
+  entry.expires = now + max_age;
+  entry.body = std::move(response_body);
+  SaveQueryCache(cache_file, entry);
+  return true;
+}
+
+} // namespace
+
+bool Query(const std::string &query_url,
+           const std::multimap<std::string, std::string> &headers,
+           const std::string &query_body,
+           PackageInfo &package_info) {
+  return Query(query_url, headers, query_body, package_info, CancellationToken());
+}
+
+bool Query(const std::string &query_url,
+           const std::multimap<std::string, std::string> &headers,
+           const std::string &query_body,
+           PackageInfo &package_info,
+           const CancellationToken &cancellation_token) {
+  Stopwatch stopwatch;
+  bool from_cache = false;
+  bool not_modified = false;
+  bool queried =
+      QueryPackageInfo(query_url, headers, query_body, package_info, cancellation_token, from_cache, not_modified);
+  RecordUpdateMetrics(UPDATE_PHASE_QUERY, [&](UpdateMetrics &metrics) {
+    metrics.query_ms = stopwatch.ElapsedMilliseconds();
+    metrics.query_from_cache = from_cache;
+    metrics.query_not_modified = not_modified;
+  });
+  return queried;
+}
+
 } // namespace selfupdate
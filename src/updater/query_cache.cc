@@ -0,0 +1,139 @@
+#include "query_cache.h"
+#include "../base/file_util.h"
+#include "../base/hash.h"
+#include "../common.h"
+#include <cstdio>
+#include <cstdlib>
+#include <xl/encoding>
+#include <xl/file>
+#include <xl/log>
+
+namespace selfupdate {
+
+namespace {
+
+const char QUERY_CACHE_MAGIC[] = "SUQC1";
+const TCHAR *QUERY_BACKOFF_FILE_SUFFIX = _T(".backoff");
+
+bool ReadLine(const std::string &content, size_t &pos, std::string &line) {
+  size_t end = content.find('\n', pos);
+  if (end == std::string::npos) {
+    return false;
+  }
+  line = content.substr(pos, end - pos);
+  pos = end + 1;
+  return true;
+}
+
+} // namespace
+
+xl::native_string GetQueryCacheFile(const std::string &query_url,
+                                    const std::multimap<std::string, std::string> &headers,
+                                    const std::string &query_body) {
+  // A cached response decides what is installed, nobody else may be able to plant one.
+  xl::native_string cache_dir = GetPrivateTempDir(_T(QUERY_CACHE_DIR_NAME));
+  if (cache_dir.empty()) {
+    XL_LOG_WARN("Query cache dir not usable, querying without cache.");
+    return {};
+  }
+
+  // Sizes go first, so that different splits of the same bytes do not collide.
+  auto hasher = FindHashAlgorithm(PACKAGEINFO_PACKAGE_HASH_ALGO_SHA256)->create();
+  auto update = [&hasher](const std::string &s) {
+    std::string size = std::to_string(s.size()) + ":";
+    hasher->Update(size.data(), size.size());
+    hasher->Update(s.data(), s.size());
+  };
+  update(query_url);
+  for (const auto &item : headers) {
+    update(item.first);
+    update(item.second);
+  }
+  update(query_body);
+  return xl::path::join(cache_dir, xl::encoding::utf8_to_native(hasher->Final()));
+}
+
+bool LoadQueryCache(const xl::native_string &cache_file, QueryCacheEntry &entry) {
+  if (xl::fs::exists(cache_file.c_str()) && !IsOwnedByCurrentUser(cache_file)) {
+    XL_LOG_WARN("Query cache file not owned by the current user, ignored: ", cache_file);
+    return false;
+  }
+  FILE *f = _tfopen(cache_file.c_str(), _T("rb"));
+  if (f == nullptr) {
+    return false;
+  }
+  std::string content;
+  char buffer[4096];
+  size_t size = 0;
+  while ((size = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+    content.append(buffer, size);
+  }
+  fclose(f);
+
+  size_t pos = 0;
+  std::string magic, expires;
+  if (!ReadLine(content, pos, magic) || magic != QUERY_CACHE_MAGIC || !ReadLine(content, pos, expires) ||
+      !ReadLine(content, pos, entry.etag) || !ReadLine(content, pos, entry.last_modified)) {
+    XL_LOG_WARN("Invalid query cache file: ", cache_file);
+    return false;
+  }
+  entry.expires = atoll(expires.c_str());
+  entry.body = content.substr(pos);
+  return true;
+}
+
+bool SaveQueryCache(const xl::native_string &cache_file, const QueryCacheEntry &entry) {
+  if (entry.etag.find('\n') != std::string::npos || entry.last_modified.find('\n') != std::string::npos) {
+    return false;
+  }
+  xl::native_string temp_file = cache_file + _T(".tmp");
+  FILE *f = _tfopen(temp_file.c_str(), _T("wb"));
+  if (f == nullptr) {
+    return false;
+  }
+  std::string header = std::string(QUERY_CACHE_MAGIC) + "\n" + std::to_string(entry.expires) + "\n" + entry.etag +
+                       "\n" + entry.last_modified + "\n";
+  bool ok = fwrite(header.data(), 1, header.size(), f) == header.size() &&
+            fwrite(entry.body.data(), 1, entry.body.size(), f) == entry.body.size();
+  ok = fclose(f) == 0 && ok;
+  if (ok) {
+    xl::fs::remove(cache_file.c_str());
+  }
+  if (!ok || !xl::fs::move(temp_file.c_str(), cache_file.c_str())) {
+    xl::fs::remove(temp_file.c_str());
+    return false;
+  }
+  return true;
+}
+
+long long LoadQueryBackoff(const xl::native_string &cache_file) {
+  xl::native_string backoff_file = cache_file + QUERY_BACKOFF_FILE_SUFFIX;
+  if (xl::fs::exists(backoff_file.c_str()) && !IsOwnedByCurrentUser(backoff_file)) {
+    return 0;
+  }
+  FILE *f = _tfopen(backoff_file.c_str(), _T("rb"));
+  if (f == nullptr) {
+    return 0;
+  }
+  char buffer[32] = {};
+  fread(buffer, 1, sizeof(buffer) - 1, f);
+  fclose(f);
+  return atoll(buffer);
+}
+
+void SaveQueryBackoff(const xl::native_string &cache_file, long long retry_at) {
+  xl::native_string backoff_file = cache_file + QUERY_BACKOFF_FILE_SUFFIX;
+  if (retry_at <= 0) {
+    xl::fs::remove(backoff_file.c_str());
+    return;
+  }
+  FILE *f = _tfopen(backoff_file.c_str(), _T("wb"));
+  if (f == nullptr) {
+    return;
+  }
+  std::string value = std::to_string(retry_at);
+  fwrite(value.data(), 1, value.size(), f);
+  fclose(f);
+}
+
+} // namespace selfupdate
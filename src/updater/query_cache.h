@@ -0,0 +1,31 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// A stored query response. The cache file is "SUQC1", expires, ETag and Last-Modified on one line each, then the body.
+struct QueryCacheEntry {
+  // Unix time until which body may be used without asking the server.
+  long long expires = 0;
+  std::string etag;
+  std::string last_modified;
+  std::string body;
+};
+
+// One file per query, named after a hash of everything that may change the response.
+xl::native_string GetQueryCacheFile(const std::string &query_url,
+                                    const std::multimap<std::string, std::string> &headers,
+                                    const std::string &query_body);
+
+bool LoadQueryCache(const xl::native_string &cache_file, QueryCacheEntry &entry);
+bool SaveQueryCache(const xl::native_string &cache_file, const QueryCacheEntry &entry);
+
+// Unix time before which the server asked not to be queried again, kept in a file of its own next to cache_file, since
+// there may be no response worth caching. Returns 0 if there is none.
+long long LoadQueryBackoff(const xl::native_string &cache_file);
+void SaveQueryBackoff(const xl::native_string &cache_file, long long retry_at);
+
+} // namespace selfupdate
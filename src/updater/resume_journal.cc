@@ -0,0 +1,235 @@
+#include "resume_journal.h"
+#include "../base/crc32.h"
+#include "../base/file_util.h"
+#include <cstdint>
+#include <cstring>
+
+namespace selfupdate {
+
+namespace {
+
+const uint32_t JOURNAL_MAGIC = 0x314a5553; // "SUJ1"
+const size_t JOURNAL_SLOT_SIZE = 4096;
+const size_t JOURNAL_SLOT_COUNT = 2;
+// magic, sequence, payload size, ..., crc32
+const size_t JOURNAL_SLOT_HEADER_SIZE = 4 + 8 + 4;
+const size_t JOURNAL_SLOT_MAX_PAYLOAD_SIZE = JOURNAL_SLOT_SIZE - JOURNAL_SLOT_HEADER_SIZE - 4;
+
+const unsigned long long CHECKPOINT_BYTES = 4 * 1024 * 1024;
+const std::chrono::milliseconds CHECKPOINT_INTERVAL(1000);
+
+// Payload fields, each as 1 byte tag, 4 bytes size and the value. Unknown tags are skipped.
+enum ResumeStateTag : uint8_t {
+  RESUME_STATE_TAG_OFFSET = 1,
+  RESUME_STATE_TAG_HASH_STATE = 2,
+  RESUME_STATE_TAG_SEGMENT_SIZE = 3,
+  RESUME_STATE_TAG_SEGMENTS = 4,
+  RESUME_STATE_TAG_VALIDATOR = 5,
+};
+
+void PutInteger(std::string &s, uint64_t v, size_t size) {
+  for (size_t i = 0; i < size; ++i) {
+    s.push_back((char)(v >> (i * 8)));
+  }
+}
+
+uint64_t GetInteger(const char *p, size_t size) {
+  uint64_t v = 0;
+  for (size_t i = size; i > 0; --i) {
+    v = (v << 8) | (uint8_t)p[i - 1];
+  }
+  return v;
+}
+
+void PutField(std::string &s, ResumeStateTag tag, const std::string &value) {
+  s.push_back((char)tag);
+  PutInteger(s, value.size(), 4);
+  s.append(value);
+}
+
+std::string SerializeResumeState(const ResumeState &state) {
+  std::string payload;
+  std::string offset;
+  PutInteger(offset, state.offset, 8);
+  PutField(payload, RESUME_STATE_TAG_OFFSET, offset);
+  PutField(payload, RESUME_STATE_TAG_HASH_STATE, state.hash_state);
+  if (!state.validator.empty()) {
+    PutField(payload, RESUME_STATE_TAG_VALIDATOR, state.validator);
+  }
+  if (state.segment_size > 0) {
+    std::string segment_size;
+    PutInteger(segment_size, state.segment_size, 8);
+    PutField(payload, RESUME_STATE_TAG_SEGMENT_SIZE, segment_size);
+    // Segment count, then one bit per segment.
+    std::string segments;
+    PutInteger(segments, state.segments.size(), 4);
+    segments.resize(4 + (state.segments.size() + 7) / 8);
+    for (size_t i = 0; i < state.segments.size(); ++i) {
+      if (state.segments[i]) {
+        segments[4 + i / 8] |= (char)(1 << (i % 8));
+      }
+    }
+    PutField(payload, RESUME_STATE_TAG_SEGMENTS, segments);
+  }
+  return payload;
+}
+
+bool ParseResumeState(const std::string &payload, ResumeState &state) {
+  ResumeState result;
+  bool has_offset = false;
+  for (size_t pos = 0; pos < payload.size();) {
+    if (pos + 5 > payload.size()) {
+      return false;
+    }
+    uint8_t tag = (uint8_t)payload[pos];
+    size_t size = (size_t)GetInteger(&payload[pos + 1], 4);
+    pos += 5;
+    if (pos + size > payload.size()) {
+      return false;
+    }
+    switch (tag) {
+    case RESUME_STATE_TAG_OFFSET:
+      if (size != 8) {
+        return false;
+      }
+      result.offset = GetInteger(&payload[pos], 8);
+      has_offset = true;
+      break;
+    case RESUME_STATE_TAG_HASH_STATE:
+      result.hash_state = payload.substr(pos, size);
+      break;
+    case RESUME_STATE_TAG_VALIDATOR:
+      result.validator = payload.substr(pos, size);
+      break;
+    case RESUME_STATE_TAG_SEGMENT_SIZE:
+      if (size != 8) {
+        return false;
+      }
+      result.segment_size = GetInteger(&payload[pos], 8);
+      break;
+    case RESUME_STATE_TAG_SEGMENTS: {
+      size_t count = size >= 4 ? (size_t)GetInteger(&payload[pos], 4) : 0;
+      if (size < 4 || size != 4 + (count + 7) / 8) {
+        return false;
+      }
+      result.segments.resize(count);
+      for (size_t i = 0; i < count; ++i) {
+        result.segments[i] = (payload[pos + 4 + i / 8] & (1 << (i % 8))) != 0;
+      }
+      break;
+    }
+    default:
+      break;
+    }
+    pos += size;
+  }
+  if (!has_offset) {
+    return false;
+  }
+  state = std::move(result);
+  return true;
+}
+
+} // namespace
+
+ResumeJournal::~ResumeJournal() {
+  Close();
+}
+
+bool ResumeJournal::Open(const xl::native_string &file) {
+  Close();
+  file_ = _tfopen(file.c_str(), _T("r+b"));
+  if (file_ == nullptr) {
+    file_ = _tfopen(file.c_str(), _T("w+b"));
+  }
+  if (file_ == nullptr) {
+    return false;
+  }
+  sequence_ = 0;
+  checkpoint_offset_ = 0;
+  checkpoint_time_ = std::chrono::steady_clock::now();
+  checkpoint_count_ = 0;
+  return true;
+}
+
+void ResumeJournal::Close() {
+  if (file_ != nullptr) {
+    fclose(file_);
+    file_ = nullptr;
+  }
+}
+
+bool ResumeJournal::Load(ResumeState &state) {
+  if (file_ == nullptr) {
+    return false;
+  }
+  bool found = false;
+  char slot[JOURNAL_SLOT_SIZE];
+  for (size_t i = 0; i < JOURNAL_SLOT_COUNT; ++i) {
+    if (fseek(file_, (long)(i * JOURNAL_SLOT_SIZE), SEEK_SET) != 0) {
+      break;
+    }
+    size_t size = fread(slot, 1, JOURNAL_SLOT_SIZE, file_);
+    if (size < JOURNAL_SLOT_HEADER_SIZE + 4 || GetInteger(slot, 4) != JOURNAL_MAGIC) {
+      continue;
+    }
+    uint64_t sequence = GetInteger(slot + 4, 8);
+    size_t payload_size = (size_t)GetInteger(slot + 12, 4);
+    if (payload_size > JOURNAL_SLOT_MAX_PAYLOAD_SIZE || JOURNAL_SLOT_HEADER_SIZE + payload_size + 4 > size) {
+      continue;
+    }
+    size_t crc_offset = JOURNAL_SLOT_HEADER_SIZE + payload_size;
+    if (Crc32(0, slot, crc_offset) != GetInteger(slot + crc_offset, 4)) {
+      continue;
+    }
+    ResumeState slot_state;
+    if (found && sequence <= sequence_) {
+      continue;
+    }
+    if (!ParseResumeState(std::string(slot + JOURNAL_SLOT_HEADER_SIZE, payload_size), slot_state)) {
+      continue;
+    }
+    state = std::move(slot_state);
+    sequence_ = sequence;
+    found = true;
+  }
+  if (found) {
+    checkpoint_offset_ = state.offset;
+  }
+  return found;
+}
+
+bool ResumeJournal::IsCheckpointDue(unsigned long long offset) const {
+  return offset >= checkpoint_offset_ + CHECKPOINT_BYTES ||
+         (offset != checkpoint_offset_ && std::chrono::steady_clock::now() - checkpoint_time_ >= CHECKPOINT_INTERVAL);
+}
+
+bool ResumeJournal::Write(const ResumeState &state) {
+  if (file_ == nullptr) {
+    return false;
+  }
+  std::string payload = SerializeResumeState(state);
+  if (payload.size() > JOURNAL_SLOT_MAX_PAYLOAD_SIZE) {
+    return false;
+  }
+  uint64_t sequence = sequence_ + 1;
+  std::string slot;
+  slot.reserve(JOURNAL_SLOT_HEADER_SIZE + payload.size() + 4);
+  PutInteger(slot, JOURNAL_MAGIC, 4);
+  PutInteger(slot, sequence, 8);
+  PutInteger(slot, payload.size(), 4);
+  slot.append(payload);
+  PutInteger(slot, Crc32(0, slot.data(), slot.size()), 4);
+
+  if (fseek(file_, (long)((sequence % JOURNAL_SLOT_COUNT) * JOURNAL_SLOT_SIZE), SEEK_SET) != 0 ||
+      fwrite(slot.data(), 1, slot.size(), file_) != slot.size() || !SyncFile(file_)) {
+    return false;
+  }
+  sequence_ = sequence;
+  checkpoint_offset_ = state.offset;
+  checkpoint_time_ = std::chrono::steady_clock::now();
+  ++checkpoint_count_;
+  return true;
+}
+
+} // namespace selfupdate
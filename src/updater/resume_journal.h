@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+struct ResumeState {
+  // Bytes at the beginning of the package file that are known to be on disk.
+  unsigned long long offset = 0;
+  // MultiHasher state after hashing the first offset bytes.
+  std::string hash_state;
+  // ETag or Last-Modified of the package when the download started, sent as If-Range when resuming.
+  std::string validator;
+  // Segmented downloads only: the segment size, and which segments are on disk. Segments after offset may complete
+  // out of order.
+  unsigned long long segment_size = 0;
+  std::vector<bool> segments;
+};
+
+// Resume journal of a downloading package.
+//
+// The journal is a fixed-size file with two slots which are written alternately, each slot carries a sequence number
+// and a checksum. A torn write therefore only damages the newer slot, and loading falls back to the older one. The
+// file stays open for the whole download, and checkpoints are written only when IsCheckpointDue() says so, instead of
+// reopening a sidecar file for every received chunk.
+class ResumeJournal {
+public:
+  ResumeJournal() = default;
+  ~ResumeJournal();
+  ResumeJournal(const ResumeJournal &) = delete;
+  ResumeJournal &operator=(const ResumeJournal &) = delete;
+
+  bool Open(const xl::native_string &file);
+  void Close();
+
+  // Loads the newest valid checkpoint. Returns false if there is none.
+  bool Load(ResumeState &state);
+
+  // Checkpoints are due every CHECKPOINT_BYTES bytes or CHECKPOINT_INTERVAL, whichever comes first.
+  bool IsCheckpointDue(unsigned long long offset) const;
+  // Writes a checkpoint and syncs the journal. The caller must have synced the package file up to state.offset.
+  bool Write(const ResumeState &state);
+
+  unsigned long long checkpoint_count() const {
+    return checkpoint_count_;
+  }
+
+private:
+  FILE *file_ = nullptr;
+  unsigned long long sequence_ = 0;
+  unsigned long long checkpoint_offset_ = 0;
+  std::chrono::steady_clock::time_point checkpoint_time_;
+  unsigned long long checkpoint_count_ = 0;
+};
+
+} // namespace selfupdate
@@ -0,0 +1,329 @@
+#include "segmented_download.h"
+#include "../base/file_util.h"
+#include "../base/thread_priority.h"
+#include "http_util.h"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <xl/http>
+#include <xl/log>
+
+namespace selfupdate {
+
+namespace {
+
+// Keeps the segment bitmap well inside a journal slot.
+const size_t MAX_SEGMENT_COUNT = 16384;
+const unsigned MAX_CONNECTION_COUNT = 16;
+const size_t HASH_READ_BUFFER_SIZE = 1024 * 1024;
+
+class SegmentedDownloader {
+public:
+  SegmentedDownloader(const PackageInfo &package_info,
+                      ResumeJournal &journal,
+                      ResumeState &resume_state,
+                      MultiHasher &hasher,
+                      ZipStreamExtractor *extractor,
+                      DownloadProgressMonitor download_progress_monitor)
+      : package_info_(package_info), journal_(journal), resume_state_(resume_state), hasher_(hasher),
+        extractor_(extractor), download_progress_monitor_(download_progress_monitor) {
+  }
+
+  bool Run(const DownloadOptions &download_options,
+           const xl::native_string &package_file,
+           bool &range_unsupported,
+           long long &retry_after) {
+    cancellation_token_ = download_options.cancellation_token;
+    bandwidth_limit_ = download_options.bandwidth_limit;
+    background_ = download_options.background;
+    unsigned long long total_size = package_info_.package_size;
+    unsigned long long segment_size = std::max(download_options.segment_size, 1ULL);
+    if ((total_size + segment_size - 1) / segment_size > MAX_SEGMENT_COUNT) {
+      segment_size = (total_size + MAX_SEGMENT_COUNT - 1) / MAX_SEGMENT_COUNT;
+    }
+    size_t segment_count = (size_t)((total_size + segment_size - 1) / segment_size);
+
+    if (resume_state_.segment_size != segment_size || resume_state_.segments.size() != segment_count ||
+        resume_state_.offset > total_size || !hasher_.LoadState(resume_state_.hash_state)) {
+      resume_state_.offset = 0;
+      resume_state_.validator.clear();
+      resume_state_.segment_size = segment_size;
+      resume_state_.segments.assign(segment_count, false);
+      hasher_.Reset();
+    }
+    resume_state_.hash_state = hasher_.SaveState();
+    if (resume_state_.offset > 0 && extractor_ != nullptr) {
+      XL_LOG_INFO("Resumed download, extracting after download instead of streaming.");
+      extractor_ = nullptr;
+    }
+    for (size_t i = 0; i < segment_count; ++i) {
+      if (resume_state_.segments[i]) {
+        downloaded_size_ += SegmentLength(i);
+      }
+    }
+    XL_LOG_INFO("Segmented download, segments: ", segment_count, ", segment size: ", segment_size,
+                ", downloaded: ", downloaded_size_.load());
+
+    if (!file_.Open(package_file)) {
+      XL_LOG_ERROR("Open local file error: ", package_file);
+      retry_after = -1;
+      return false;
+    }
+    if (!file_.Reserve(total_size)) {
+      XL_LOG_ERROR("Not enough disk space for package: ", package_file, ", size: ", total_size);
+      retry_after = -1;
+      return false;
+    }
+    // Segments completed in a previous run may still be waiting to be hashed.
+    AdvanceHash();
+
+    unsigned connection_count = std::min({download_options.connection_count, MAX_CONNECTION_COUNT,
+                                          (unsigned)std::max(segment_count, (size_t)1)});
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < connection_count; ++i) {
+      workers.emplace_back(&SegmentedDownloader::Work, this);
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+
+    file_.Sync();
+    journal_.Write(resume_state_);
+    file_.Close();
+    range_unsupported = range_unsupported_;
+    retry_after = retry_after_;
+    return !failed_ && resume_state_.offset == total_size;
+  }
+
+private:
+  unsigned long long SegmentLength(size_t index) const {
+    unsigned long long start = index * resume_state_.segment_size;
+    return std::min(resume_state_.segment_size, package_info_.package_size - start);
+  }
+
+  void Work() {
+    // Only inherited from the downloading thread on Linux.
+    if (background_) {
+      SetBackgroundThreadPriority();
+    }
+    for (;;) {
+      size_t index = 0;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        while (next_segment_ < resume_state_.segments.size() && resume_state_.segments[next_segment_]) {
+          ++next_segment_;
+        }
+        if (failed_ || next_segment_ >= resume_state_.segments.size() || cancellation_token_.IsCancelled()) {
+          return;
+        }
+        index = next_segment_++;
+      }
+      if (!FetchSegment(index)) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        failed_ = true;
+        return;
+      }
+    }
+  }
+
+  bool FetchSegment(size_t index) {
+    unsigned long long start = index * resume_state_.segment_size;
+    unsigned long long length = SegmentLength(index);
+    std::stringstream range_expr;
+    range_expr << "bytes=" << start << "-" << start + length - 1;
+    xl::http::Headers request_headers = {
+        {"Range", range_expr.str()}
+    };
+    {
+      // If the package changed since the first segment, the server answers with the whole package and the segment
+      // overflows, which falls back to a fresh single connection download.
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!resume_state_.validator.empty()) {
+        request_headers.insert({"If-Range", resume_state_.validator});
+      }
+    }
+    xl::http::Headers response_headers;
+    unsigned long long received = 0;
+    bool overflow = false;
+    bool write_failed = false;
+    int status = HttpGet(package_info_.package_url, request_headers, response_headers,
+                         [&](const void *buffer, size_t size) -> size_t {
+                           if (cancellation_token_.IsCancelled()) {
+                             return 0;
+                           }
+                           bandwidth_limit_.Acquire(size);
+                           if (received + size > length) {
+                             overflow = true;
+                             return 0;
+                           }
+                           if (!file_.WriteAt(start + received, buffer, size)) {
+                             write_failed = true;
+                             return 0;
+                           }
+                           received += size;
+                           downloaded_size_ += size;
+                           if (download_progress_monitor_ != nullptr) {
+                             // Read under the lock, so that reports do not go backwards.
+                             std::lock_guard<std::mutex> lock(progress_mutex_);
+                             download_progress_monitor_(downloaded_size_.load(), package_info_.package_size);
+                           }
+                           return size;
+                         });
+
+    bool whole_file = start == 0 && length == package_info_.package_size;
+    bool ok = (status == 206 || (status == 200 && whole_file)) && received == length;
+    bool retryable = !overflow && !write_failed && (IsRetryableStatus(status) || status == 206 || status == 200);
+    if (ok && status == 206) {
+      const std::string *content_range = FindHeader(response_headers, "Content-Range");
+      unsigned long long first = 0, last = 0;
+      long long total = 0;
+      if (content_range != nullptr &&
+          (!ParseContentRange(*content_range, first, last, total) || first != start || last != start + length - 1 ||
+           (total >= 0 && (unsigned long long)total != package_info_.package_size))) {
+        XL_LOG_ERROR("Content-Range mismatch: ", *content_range, ", expected: ", range_expr.str(),
+                     ", package size: ", package_info_.package_size);
+        ok = false;
+        retryable = false;
+      }
+    }
+
+    if (!ok) {
+      XL_LOG_ERROR("Download segment error: ", range_expr.str(), ", status/error: ", status, ", received: ", received);
+      downloaded_size_ -= received;
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (overflow || (status == 200 && !whole_file)) {
+        range_unsupported_ = true;
+      }
+      if (!retryable || (status == 200 && !whole_file)) {
+        retry_after_ = -1;
+      } else if (retry_after_ >= 0) {
+        retry_after_ = std::max(retry_after_, GetRetryAfter(response_headers));
+      }
+      return false;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (resume_state_.validator.empty()) {
+        resume_state_.validator = GetRangeValidator(response_headers);
+      }
+      resume_state_.segments[index] = true;
+    }
+    AdvanceHash();
+
+    // Segments are large, record each of them as soon as it is on disk. Every segment the snapshot claims was written
+    // before it was taken, so the sync that follows covers it.
+    ResumeState snapshot;
+    unsigned long long snapshot_number = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      snapshot = resume_state_;
+      snapshot_number = ++snapshot_count_;
+    }
+    if (file_.Sync()) {
+      std::lock_guard<std::mutex> lock(journal_mutex_);
+      // Another connection may have recorded a later snapshot meanwhile.
+      if (snapshot_number > journaled_snapshot_) {
+        journal_.Write(snapshot);
+        journaled_snapshot_ = snapshot_number;
+      }
+    }
+    return true;
+  }
+
+  // Hashes contiguous completed segments following resume_state_.offset, and feeds them to extractor_, one thread at a
+  // time. mutex_ is only taken to look at the segments and to record progress, the other connections go on receiving
+  // meanwhile. The data is read back while it is still in the page cache.
+  void AdvanceHash() {
+    std::lock_guard<std::mutex> hash_lock(hash_mutex_);
+    if (hash_buffer_ == nullptr) {
+      hash_buffer_.reset(new char[HASH_READ_BUFFER_SIZE]);
+    }
+    for (;;) {
+      size_t index = 0;
+      unsigned long long offset = 0;
+      unsigned long long end = 0;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        index = (size_t)(resume_state_.offset / resume_state_.segment_size);
+        if (index >= resume_state_.segments.size() || !resume_state_.segments[index]) {
+          return;
+        }
+        offset = resume_state_.offset;
+        end = index * resume_state_.segment_size + SegmentLength(index);
+      }
+      while (offset < end) {
+        size_t size = (size_t)std::min((unsigned long long)HASH_READ_BUFFER_SIZE, end - offset);
+        if (file_.ReadAt(offset, hash_buffer_.get(), size) != size) {
+          // The hasher is now ahead of resume_state_, which still holds the last consistent state.
+          XL_LOG_ERROR("Read back segment error, offset: ", offset);
+          std::lock_guard<std::mutex> lock(mutex_);
+          resume_state_.segments[index] = false;
+          failed_ = true;
+          retry_after_ = -1;
+          return;
+        }
+        hasher_.Update(hash_buffer_.get(), size);
+        if (extractor_ != nullptr) {
+          extractor_->Write(hash_buffer_.get(), size);
+        }
+        offset += size;
+      }
+      std::string hash_state = hasher_.SaveState();
+      std::lock_guard<std::mutex> lock(mutex_);
+      resume_state_.offset = end;
+      resume_state_.hash_state = hash_state;
+    }
+  }
+
+  const PackageInfo &package_info_;
+  ResumeJournal &journal_;
+  ResumeState &resume_state_;
+  MultiHasher &hasher_;
+  ZipStreamExtractor *extractor_;
+  DownloadProgressMonitor download_progress_monitor_;
+  CancellationToken cancellation_token_;
+  BandwidthLimit bandwidth_limit_;
+  bool background_ = false;
+
+  PositionalFile file_;
+  // Guards resume_state_, next_segment_, failed_, range_unsupported_ and retry_after_, held only briefly.
+  std::mutex mutex_;
+  // Held while hashing, over hasher_, extractor_ and hash_buffer_.
+  std::mutex hash_mutex_;
+  // Held while writing the journal.
+  std::mutex journal_mutex_;
+  // Serializes progress reports.
+  std::mutex progress_mutex_;
+  std::atomic<unsigned long long> downloaded_size_{0};
+  unsigned long long snapshot_count_ = 0;
+  unsigned long long journaled_snapshot_ = 0;
+  size_t next_segment_ = 0;
+  bool failed_ = false;
+  bool range_unsupported_ = false;
+  long long retry_after_ = 0;
+  std::unique_ptr<char[]> hash_buffer_;
+};
+
+} // namespace
+
+bool DownloadSegmented(const PackageInfo &package_info,
+                       const DownloadOptions &download_options,
+                       const xl::native_string &package_file,
+                       ResumeJournal &journal,
+                       ResumeState &resume_state,
+                       MultiHasher &hasher,
+                       ZipStreamExtractor *extractor,
+                       DownloadProgressMonitor download_progress_monitor,
+                       bool &range_unsupported,
+                       long long &retry_after) {
+  range_unsupported = false;
+  retry_after = 0;
+  SegmentedDownloader downloader(package_info, journal, resume_state, hasher, extractor, download_progress_monitor);
+  return downloader.Run(download_options, package_file, range_unsupported, retry_after);
+}
+
+} // namespace selfupdate
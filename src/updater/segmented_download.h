@@ -0,0 +1,34 @@
+#pragma once
+
+#include "../base/hash.h"
+#include "../base/zip_stream_extractor.h"
+#include "resume_journal.h"
+#include <selfupdate/updater.h>
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// Downloads the package into package_file over download_options.connection_count connections, each fetching one
+// segment of download_options.segment_size bytes at a time and writing it at its offset. Completed segments are
+// recorded in resume_state and the journal, so a resumed download only fetches missing segments. Bytes are hashed in
+// file order, as soon as all segments before them are complete, and fed to extractor in the same order when it is not
+// null and the download starts from the beginning.
+//
+// download_progress_monitor is called from the connection threads, one call at a time.
+//
+// Returns true when the whole package is on disk and has passed through hasher. range_unsupported is set if the
+// server ignored the Range header, the caller should fall back to a single connection then. Otherwise on failure,
+// retry_after is set to the longest Retry-After of the failed segments in seconds, 0 if there was none, or -1 if
+// trying again would not help.
+bool DownloadSegmented(const PackageInfo &package_info,
+                       const DownloadOptions &download_options,
+                       const xl::native_string &package_file,
+                       ResumeJournal &journal,
+                       ResumeState &resume_state,
+                       MultiHasher &hasher,
+                       ZipStreamExtractor *extractor,
+                       DownloadProgressMonitor download_progress_monitor,
+                       bool &range_unsupported,
+                       long long &retry_after);
+
+} // namespace selfupdate
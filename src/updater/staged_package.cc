@@ -0,0 +1,90 @@
+#include "staged_package.h"
+#include "../base/file_util.h"
+#include "../common.h"
+#include <cstdio>
+#include <xl/file>
+#include <xl/log>
+
+namespace selfupdate {
+
+namespace {
+
+bool ReadContent(const xl::native_string &file, xl::native_string &content) {
+  FILE *f = _tfopen(file.c_str(), _T("rb"));
+  if (f == nullptr) {
+    return false;
+  }
+  content.clear();
+  TCHAR buffer[1024];
+  size_t size = 0;
+  while ((size = fread(buffer, sizeof(TCHAR), sizeof(buffer) / sizeof(TCHAR), f)) > 0) {
+    content.append(buffer, size);
+  }
+  fclose(f);
+  return true;
+}
+
+bool WriteContent(const xl::native_string &file, const xl::native_string &content) {
+  FILE *f = _tfopen(file.c_str(), _T("wb"));
+  if (f == nullptr) {
+    return false;
+  }
+  bool written = fwrite(content.data(), sizeof(TCHAR), content.size(), f) == content.size();
+  fclose(f);
+  return written;
+}
+
+} // namespace
+
+bool CommitStagedDirectory(const xl::native_string &package_file,
+                           const xl::native_string &staging_dir,
+                           const xl::native_string &install_location) {
+  xl::native_string staged_dir = install_location + _T(INSTALL_LOCATION_NEW_SUFFIX);
+  xl::native_string owner;
+  if (IsDirectory(staged_dir) && ReadContent(staged_dir + _T(STAGED_OWNER_SUFFIX), owner) &&
+      owner == _T(STAGED_OWNER_INSTALLER)) {
+    XL_LOG_WARN("Staged directory is waiting for the installer, leaving it: ", staged_dir);
+    return false;
+  }
+  // Staged for another package otherwise, which finds it is not its own any more.
+  xl::fs::remove_all(staged_dir.c_str());
+  if (!xl::fs::move(staging_dir.c_str(), staged_dir.c_str())) {
+    XL_LOG_WARN("Move extracted package failed, from: ", staging_dir, ", to: ", staged_dir);
+    return false;
+  }
+  if (!ClaimStagedDirectory(install_location, package_file) ||
+      !WriteContent(package_file + _T(STAGED_MARKER_SUFFIX), staged_dir)) {
+    return false;
+  }
+  XL_LOG_INFO("Package staged: ", staged_dir);
+  return true;
+}
+
+bool FindStagedDirectory(const xl::native_string &package_file,
+                         const xl::native_string &install_location,
+                         xl::native_string &staged_dir) {
+  xl::native_string content;
+  if (!ReadContent(package_file + _T(STAGED_MARKER_SUFFIX), content)) {
+    return false;
+  }
+  xl::native_string expected_dir = install_location + _T(INSTALL_LOCATION_NEW_SUFFIX);
+  xl::native_string owner;
+  if (content != expected_dir || !IsDirectory(expected_dir) ||
+      !ReadContent(expected_dir + _T(STAGED_OWNER_SUFFIX), owner) || owner != package_file) {
+    XL_LOG_WARN("Staged package not usable, preparing it again: ", content);
+    return false;
+  }
+  staged_dir = expected_dir;
+  return true;
+}
+
+bool ClaimStagedDirectory(const xl::native_string &install_location, const xl::native_string &owner) {
+  xl::native_string owner_file = install_location + _T(INSTALL_LOCATION_NEW_SUFFIX STAGED_OWNER_SUFFIX);
+  if (!WriteContent(owner_file, owner)) {
+    XL_LOG_WARN("Write staged directory owner failed: ", owner_file);
+    return false;
+  }
+  return true;
+}
+
+} // namespace selfupdate
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <xl/native_string>
+
+namespace selfupdate {
+
+// A package is staged when its new installation, or for a delta package its changed files, is waiting in
+// install_location + INSTALL_LOCATION_NEW_SUFFIX, so that the installer only has to swap it in. A marker next to the
+// package file records that, and which directory. An owner file next to the directory records which package it was
+// prepared for, or that an installer is about to swap it in.
+
+// Moves staging_dir, the extracted package, to install_location + INSTALL_LOCATION_NEW_SUFFIX, and writes the
+// marker for package_file. Fails without touching it if the directory is claimed by an installer.
+bool CommitStagedDirectory(const xl::native_string &package_file,
+                           const xl::native_string &staging_dir,
+                           const xl::native_string &install_location);
+
+// Returns true if package_file is staged for install_location, by Stage() or by Download() extracting while
+// downloading. staged_dir is set to the new installation then.
+bool FindStagedDirectory(const xl::native_string &package_file,
+                         const xl::native_string &install_location,
+                         xl::native_string &staged_dir);
+
+// Records owner, a package file or STAGED_OWNER_INSTALLER, as the one install_location + INSTALL_LOCATION_NEW_SUFFIX
+// was prepared for.
+bool ClaimStagedDirectory(const xl::native_string &install_location, const xl::native_string &owner);
+
+} // namespace selfupdate
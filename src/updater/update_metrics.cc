@@ -0,0 +1,39 @@
+#include "update_metrics.h"
+#include <mutex>
+
+namespace selfupdate {
+
+namespace {
+
+std::mutex metrics_mutex;
+UpdateMetrics metrics;
+UpdateMetricsCallback metrics_callback;
+
+} // namespace
+
+void SetUpdateMetricsCallback(UpdateMetricsCallback callback) {
+  std::lock_guard<std::mutex> lock(metrics_mutex);
+  metrics_callback = std::move(callback);
+}
+
+void RecordUpdateMetrics(UpdatePhase phase, const std::function<void(UpdateMetrics &)> &update) {
+  UpdateMetrics snapshot;
+  UpdateMetricsCallback callback;
+  {
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    update(metrics);
+    if (metrics_callback == nullptr) {
+      return;
+    }
+    snapshot = metrics;
+    callback = metrics_callback;
+  }
+  callback(phase, snapshot);
+}
+
+UpdateMetrics GetUpdateMetrics() {
+  std::lock_guard<std::mutex> lock(metrics_mutex);
+  return metrics;
+}
+
+} // namespace selfupdate
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <functional>
+#include <selfupdate/updater.h>
+
+namespace selfupdate {
+
+// Applies update to the metrics kept for this process, then passes a copy to the callback set with
+// SetUpdateMetricsCallback(). Safe to call from any thread.
+void RecordUpdateMetrics(UpdatePhase phase, const std::function<void(UpdateMetrics &)> &update);
+UpdateMetrics GetUpdateMetrics();
+
+} // namespace selfupdate
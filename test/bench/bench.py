@@ -0,0 +1,129 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+
+# Runs package_bench and download_bench against bench_server.py for every combination of the given settings, and
+# writes all results to one JSON file, each result tagged with the settings it ran with.
+
+import os
+import sys
+import json
+import shutil
+import tarfile
+import zipfile
+import argparse
+import itertools
+import subprocess
+import tempfile
+
+PACKAGE_BENCH = 'package_bench'
+DOWNLOAD_BENCH = 'download_bench'
+if sys.platform == 'win32':
+    PACKAGE_BENCH += '.exe'
+    DOWNLOAD_BENCH += '.exe'
+PACKAGE_FILE = 'bench_package.zip'
+TAR_ZSTD_PACKAGE_FILE = 'bench_package.tar.zst'
+
+
+def int_list(value):
+    return [int(v) for v in value.split(',')]
+
+
+def float_list(value):
+    return [float(v) for v in value.split(',')]
+
+
+def start_server(port, size_mb, files, compressible, throttle_kbps, latency_ms):
+    cmd = [sys.executable, 'bench_server.py', '--port', str(port),
+           '--size-mb', str(size_mb), '--files', str(files),
+           '--throttle-kbps', str(throttle_kbps), '--latency-ms', str(latency_ms),
+           '--package', PACKAGE_FILE]
+    if compressible:
+        cmd.append('--compressible')
+    print(' '.join(cmd), file=sys.stderr)
+    process = subprocess.Popen(cmd, stdout=subprocess.PIPE)
+    # The package is generated before the server starts listening.
+    if process.stdout.readline().strip() != b'ready':
+        process.kill()
+        raise RuntimeError('bench_server.py failed to start')
+    return process
+
+
+def make_tar_zstd_package():
+    # Repacks the zip package, with the zstd command line tool, which is needed for the long window.
+    zstd = shutil.which('zstd')
+    if zstd is None:
+        return None
+    with tempfile.TemporaryDirectory() as dir:
+        with zipfile.ZipFile(PACKAGE_FILE) as z:
+            z.extractall(dir)
+        tar_file = os.path.join(dir, 'package.tar')
+        with tarfile.open(tar_file, 'w') as tar:
+            for name in sorted(os.listdir(dir)):
+                if name != 'package.tar':
+                    tar.add(os.path.join(dir, name), name)
+        subprocess.run([zstd, '-q', '-f', '-19', '-T0', '--long=31', tar_file, '-o', TAR_ZSTD_PACKAGE_FILE],
+                       check=True)
+    return TAR_ZSTD_PACKAGE_FILE
+
+
+def run(cmd):
+    print(' '.join(cmd), file=sys.stderr)
+    output = subprocess.run(cmd, stdout=subprocess.PIPE, check=True).stdout
+    return [json.loads(line) for line in output.decode().splitlines()
+            if line.startswith('{')]
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--port', type=int, default=8090)
+    parser.add_argument('--size-mb', type=float_list, default=[16, 256])
+    parser.add_argument('--files', type=int_list, default=[10, 5000])
+    parser.add_argument('--compressible', action='store_true')
+    parser.add_argument('--connections', type=int_list, default=[1, 4])
+    parser.add_argument('--stream-extract', type=int_list, default=[0, 1])
+    parser.add_argument('--throttle-kbps', type=int_list, default=[0])
+    parser.add_argument('--latency-ms', type=int_list, default=[0, 50])
+    parser.add_argument('--repeat', type=int, default=3)
+    parser.add_argument('--output', default='bench_results.json')
+    args = parser.parse_args()
+
+    results = []
+    for size_mb, files in itertools.product(args.size_mb, args.files):
+        package_settings = {'size_mb': size_mb, 'files': files,
+                            'compressible': args.compressible}
+        package_benched = False
+        for throttle_kbps, latency_ms in itertools.product(args.throttle_kbps, args.latency_ms):
+            settings = dict(package_settings, throttle_kbps=throttle_kbps,
+                            latency_ms=latency_ms)
+            server = start_server(args.port, size_mb, files,
+                                  args.compressible, throttle_kbps, latency_ms)
+            try:
+                if not package_benched:
+                    # Network settings make no difference once the package is on disk.
+                    cmd = [os.path.join('.', PACKAGE_BENCH), PACKAGE_FILE, str(args.repeat)]
+                    tar_zstd_package = make_tar_zstd_package()
+                    if tar_zstd_package is not None:
+                        cmd.append(tar_zstd_package)
+                    for result in run(cmd):
+                        results.append(dict(result, **package_settings))
+                    if tar_zstd_package is not None:
+                        os.remove(tar_zstd_package)
+                    package_benched = True
+                for connections, stream_extract in itertools.product(args.connections, args.stream_extract):
+                    for _ in range(args.repeat):
+                        for result in run([os.path.join('.', DOWNLOAD_BENCH), str(args.port),
+                                           str(connections), str(stream_extract)]):
+                            results.append(dict(result, **settings))
+            finally:
+                server.kill()
+                server.wait()
+
+    os.remove(PACKAGE_FILE)
+    with open(args.output, 'w') as f:
+        json.dump(results, f, indent=2)
+    print('%d results written to %s' % (len(results), args.output), file=sys.stderr)
+
+
+if __name__ == '__main__':
+    os.chdir(os.path.dirname(os.path.realpath(__file__)))
+    main()
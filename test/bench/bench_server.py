@@ -0,0 +1,151 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+
+# Serves a generated package for download_bench, like tools/server.py does for the end-to-end test, with the package
+# size, the file count, the bandwidth and the latency configurable.
+
+import os
+import sys
+import json
+import time
+import random
+import zipfile
+import hashlib
+import argparse
+import http.server
+import socketserver
+
+PACKAGE_NAME = 'selfupdate-bench'
+PACKAGE_FILE = 'bench_package.zip'
+WRITE_CHUNK_SIZE = 64 * 1024
+
+
+def make_package(path, size, file_count, compressible):
+    rng = random.Random(size * 1000003 + file_count)
+    words = [b'selfupdate', b'package', b'download', b'install', b'bench', b'\n']
+    file_size = max(1, size // file_count)
+    with zipfile.ZipFile(path, 'w', zipfile.ZIP_DEFLATED) as zip:
+        for i in range(file_count):
+            if compressible:
+                data = b' '.join(rng.choice(words) for _ in range(file_size // 6 + 1))[:file_size]
+            else:
+                data = rng.getrandbits(file_size * 8).to_bytes(file_size, 'little')
+            zip.writestr('dir%03d/file%06d.bin' % (i % 100, i), data)
+
+
+def package_info(path, port):
+    sha256 = hashlib.sha256()
+    with open(path, 'rb') as f:
+        while True:
+            buffer = f.read(1024 * 1024)
+            if not buffer:
+                break
+            sha256.update(buffer)
+    return {
+        'package_name': PACKAGE_NAME,
+        'has_new_version': True,
+        'package_version': '1.0',
+        'package_url': 'http://localhost:%d/download' % port,
+        'package_size': os.stat(path).st_size,
+        'package_format': 'zip',
+        'package_hash': {
+            'sha256': sha256.hexdigest().lower(),
+        },
+    }
+
+
+class BenchServer(http.server.BaseHTTPRequestHandler):
+    protocol_version = 'HTTP/1.1'
+
+    def log_message(self, format, *args):
+        pass
+
+    def send_body(self, data):
+        rate = self.server.throttle
+        start = time.time()
+        sent = 0
+        while sent < len(data):
+            chunk = data[sent:sent + WRITE_CHUNK_SIZE]
+            self.wfile.write(chunk)
+            sent += len(chunk)
+            if rate > 0:
+                ahead = sent / rate - (time.time() - start)
+                if ahead > 0:
+                    time.sleep(ahead)
+
+    def do_REQUEST(self):
+        if self.server.latency > 0:
+            time.sleep(self.server.latency)
+        if self.path == '/query':
+            body = json.dumps(self.server.package_info).encode()
+            self.send_response(200)
+            self.send_header('Content-Type', 'application/json')
+            self.send_header('Content-Length', str(len(body)))
+            self.end_headers()
+            if self.command != 'HEAD':
+                self.wfile.write(body)
+        elif self.path == '/download':
+            data = self.server.package
+            etag = self.server.etag
+            first, last = 0, len(data) - 1
+            range_header = self.headers.get('Range')
+            if_range = self.headers.get('If-Range')
+            partial = range_header is not None and range_header.startswith(
+                'bytes=') and (if_range is None or if_range == etag)
+            if partial:
+                begin, _, end = range_header[len('bytes='):].partition('-')
+                first = int(begin)
+                if end:
+                    last = min(int(end), last)
+                self.send_response(206)
+                self.send_header('Content-Range',
+                                 'bytes %d-%d/%d' % (first, last, len(data)))
+            else:
+                self.send_response(200)
+            self.send_header('ETag', etag)
+            self.send_header('Accept-Ranges', 'bytes')
+            self.send_header('Content-Length', str(last - first + 1))
+            self.end_headers()
+            if self.command != 'HEAD':
+                self.send_body(data[first:last + 1])
+        else:
+            self.send_error(404)
+
+    do_HEAD = do_REQUEST
+    do_GET = do_REQUEST
+    do_POST = do_REQUEST
+
+
+class ThreadingServer(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--port', type=int, default=8090)
+    parser.add_argument('--size-mb', type=float, default=64,
+                        help='uncompressed size of all files in the package')
+    parser.add_argument('--files', type=int, default=100)
+    parser.add_argument('--compressible', action='store_true')
+    parser.add_argument('--throttle-kbps', type=int, default=0,
+                        help='bandwidth of each connection in KiB/s, 0 for unlimited')
+    parser.add_argument('--latency-ms', type=int, default=0,
+                        help='delay before answering each request')
+    parser.add_argument('--package', default=PACKAGE_FILE)
+    args = parser.parse_args()
+
+    make_package(args.package, int(args.size_mb * 1024 * 1024), args.files,
+                 args.compressible)
+    httpd = ThreadingServer(('localhost', args.port), BenchServer)
+    httpd.package_info = package_info(args.package, args.port)
+    with open(args.package, 'rb') as f:
+        httpd.package = f.read()
+    httpd.etag = '"%s"' % httpd.package_info['package_hash']['sha256']
+    httpd.throttle = args.throttle_kbps * 1024
+    httpd.latency = args.latency_ms / 1000.0
+    print('ready', flush=True)
+    httpd.serve_forever()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,100 @@
+// End-to-end benchmark of one update against bench_server.py on localhost: Query(), Download(), then installing the
+// package into a scratch directory the way the installer does, without relaunching anything.
+//
+// Usage: download_bench <port> [connection_count] [stream_extract]
+//
+// Prints one JSON object with the wall time of each step and the UpdateMetrics collected along the way.
+
+#include "../../src/base/file_util.h"
+#include "../../src/common.h"
+#include "../../src/installer/installation.h"
+#include "../../src/installer/zip_installer.h"
+#include <chrono>
+#include <cstdio>
+#include <selfupdate/updater.h>
+#include <string>
+#include <xl/encoding>
+#include <xl/file>
+#include <xl/native_string>
+
+namespace {
+
+double SecondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+} // namespace
+
+int _tmain(int argc, const TCHAR *argv[]) {
+  if (argc < 2) {
+    return -1;
+  }
+  std::string query_url = "http://localhost:" + std::to_string(std::stoul(argv[1])) + "/query";
+  selfupdate::DownloadOptions download_options;
+  download_options.connection_count = argc > 2 ? (unsigned)std::stoul(argv[2]) : 1;
+  download_options.stream_extract = argc > 3 && std::stoul(argv[3]) != 0;
+
+  xl::native_string dir = xl::path::join(xl::fs::tmp_dir(), _T("selfupdate-bench"));
+  xl::native_string install_location = xl::path::join(dir, _T("install"));
+  xl::fs::remove_all(dir.c_str());
+  xl::fs::mkdirs(install_location.c_str());
+  download_options.install_location = install_location.c_str();
+
+  selfupdate::UpdateMetrics metrics;
+  selfupdate::SetUpdateMetricsCallback([&metrics](selfupdate::UpdatePhase, const selfupdate::UpdateMetrics &current) {
+    metrics = current;
+  });
+
+  auto start = std::chrono::steady_clock::now();
+  selfupdate::PackageInfo package_info;
+  if (!selfupdate::Query(query_url, {}, "", package_info) || !package_info.has_new_version) {
+    return -1;
+  }
+  double query_seconds = SecondsSince(start);
+
+  // Always a cold download.
+  xl::native_string cache_dir =
+      xl::path::join(xl::fs::tmp_dir(), xl::encoding::utf8_to_native(package_info.package_name));
+  xl::fs::remove_all(cache_dir.c_str());
+  xl::native_string package_file =
+      xl::path::join(cache_dir, xl::encoding::utf8_to_native(package_info.package_name + PACKAGE_NAME_VERSION_SEP +
+                                                             package_info.package_version + FILE_NAME_EXT_SEP +
+                                                             package_info.package_format));
+  start = std::chrono::steady_clock::now();
+  if (!selfupdate::Download(package_info, download_options, nullptr)) {
+    return -1;
+  }
+  double download_seconds = SecondsSince(start);
+
+  start = std::chrono::steady_clock::now();
+  selfupdate::UpdateMetrics install_metrics;
+  xl::native_string staged_dir = install_location + _T(INSTALL_LOCATION_NEW_SUFFIX);
+  bool installed = download_options.stream_extract && selfupdate::IsDirectory(staged_dir)
+                       ? selfupdate::InstallStagedDirectory(staged_dir, install_location, &install_metrics)
+                       : selfupdate::InstallZipPackage(package_file, install_location, 0, false, &install_metrics);
+  if (!installed) {
+    return -1;
+  }
+  double install_seconds = SecondsSince(start);
+  start = std::chrono::steady_clock::now();
+  selfupdate::EmptyTrash(install_location);
+  double empty_trash_seconds = SecondsSince(start);
+
+  std::string hash_ms;
+  for (const auto &item : metrics.hash_ms) {
+    hash_ms += (hash_ms.empty() ? "\"" : ", \"") + item.first + "\": " + std::to_string(item.second);
+  }
+  printf("{\"bench\": \"update\", \"package_size\": %llu, \"connection_count\": %u, \"stream_extract\": %s, "
+         "\"query_seconds\": %.4f, \"download_seconds\": %.4f, \"install_seconds\": %.4f, "
+         "\"empty_trash_seconds\": %.4f, \"mb_per_second\": %.1f, \"first_byte_ms\": %lld, \"bytes_fetched\": %llu, "
+         "\"hash_ms\": {%s}, \"extract_ms\": %lld, \"extracted_entries\": %llu, \"rename_retries\": %u}\n",
+         package_info.package_size, download_options.connection_count,
+         download_options.stream_extract ? "true" : "false", query_seconds, download_seconds, install_seconds,
+         empty_trash_seconds,
+         download_seconds > 0 ? package_info.package_size / download_seconds / (1024 * 1024) : -1.0,
+         metrics.download_first_byte_ms, metrics.bytes_fetched, hash_ms.c_str(), install_metrics.extract_ms,
+         install_metrics.extracted_entries, install_metrics.rename_retries);
+  xl::fs::remove_all(cache_dir.c_str());
+  xl::fs::remove_all(dir.c_str());
+  return 0;
+}
@@ -0,0 +1,135 @@
+// Compares the resume bookkeeping cost of the old per-chunk sidecar rewrite with the resume journal.
+//
+// Usage: journal_bench [size_mb] [chunk_size]
+//
+// The chunk size defaults to 16 KiB, which is what curl hands to the write callback. On Linux the write syscall
+// count is read from /proc/self/io, open/close calls are counted by the benchmark itself. Run it under `strace -c` to
+// see the full syscall breakdown.
+
+#include "../../src/base/file_util.h"
+#include "../../src/updater/resume_journal.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <selfupdate/updater.h>
+#include <vector>
+#include <xl/file>
+#include <xl/native_string>
+
+namespace {
+
+long long ReadWriteSyscalls() {
+#ifdef __linux__
+  FILE *f = fopen("/proc/self/io", "r");
+  if (f == nullptr) {
+    return -1;
+  }
+  char line[128];
+  long long v = -1;
+  while (fgets(line, sizeof(line), f) != nullptr) {
+    if (strncmp(line, "syscw:", 6) == 0) {
+      v = atoll(line + 6);
+    }
+  }
+  fclose(f);
+  return v;
+#else
+  return -1;
+#endif
+}
+
+struct Result {
+  const char *name;
+  double seconds;
+  long long write_syscalls;
+  unsigned long long open_close_calls;
+  unsigned long long sync_calls;
+};
+
+Result RunLegacy(const xl::native_string &dir, unsigned long long size, size_t chunk_size) {
+  xl::native_string package_file = xl::path::join(dir, _T("legacy.bin"));
+  xl::native_string state_file = xl::path::join(dir, _T("legacy.bin.downloading"));
+  std::vector<char> chunk(chunk_size, 'x');
+  Result result = {"legacy", 0, 0, 0, 0};
+
+  long long syscalls = ReadWriteSyscalls();
+  auto start = std::chrono::steady_clock::now();
+  FILE *f = _tfopen(package_file.c_str(), _T("wb"));
+  for (unsigned long long written = 0; written < size; written += chunk_size) {
+    fwrite(chunk.data(), 1, chunk_size, f);
+    fflush(f);
+    FILE *s = _tfopen(state_file.c_str(), _T("w"));
+    fprintf(s, "%lld", written + chunk_size);
+    fclose(s);
+    result.open_close_calls += 2;
+  }
+  fclose(f);
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  result.write_syscalls = syscalls < 0 ? -1 : ReadWriteSyscalls() - syscalls;
+
+  xl::fs::remove(package_file.c_str());
+  xl::fs::remove(state_file.c_str());
+  return result;
+}
+
+Result RunJournal(const xl::native_string &dir, unsigned long long size, size_t chunk_size) {
+  xl::native_string package_file = xl::path::join(dir, _T("journal.bin"));
+  xl::native_string journal_file = xl::path::join(dir, _T("journal.bin.downloading"));
+  std::vector<char> chunk(chunk_size, 'x');
+  Result result = {"journal", 0, 0, 0, 0};
+
+  long long syscalls = ReadWriteSyscalls();
+  auto start = std::chrono::steady_clock::now();
+  std::vector<char> write_buffer(1024 * 1024);
+  FILE *f = _tfopen(package_file.c_str(), _T("wb"));
+  setvbuf(f, write_buffer.data(), _IOFBF, write_buffer.size());
+  selfupdate::ResumeJournal journal;
+  journal.Open(journal_file);
+  selfupdate::ResumeState state;
+  state.hash_state.assign(256, 'h');
+  for (unsigned long long written = 0; written < size; written += chunk_size) {
+    fwrite(chunk.data(), 1, chunk_size, f);
+    state.offset = written + chunk_size;
+    if (journal.IsCheckpointDue(state.offset)) {
+      selfupdate::SyncFile(f);
+      journal.Write(state);
+      result.sync_calls += 2;
+    }
+  }
+  selfupdate::SyncFile(f);
+  journal.Write(state);
+  result.sync_calls += 2;
+  journal.Close();
+  fclose(f);
+  result.open_close_calls = 4;
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  result.write_syscalls = syscalls < 0 ? -1 : ReadWriteSyscalls() - syscalls;
+
+  xl::fs::remove(package_file.c_str());
+  xl::fs::remove(journal_file.c_str());
+  return result;
+}
+
+void Print(const Result &result, unsigned long long size_mb) {
+  printf("{\"bench\": \"resume_journal\", \"mode\": \"%s\", \"size_mb\": %llu, \"seconds\": %.3f, "
+         "\"write_syscalls_per_mb\": %.1f, \"open_close_per_mb\": %.1f, \"sync_per_mb\": %.2f}\n",
+         result.name, size_mb, result.seconds,
+         result.write_syscalls < 0 ? -1.0 : (double)result.write_syscalls / size_mb,
+         (double)result.open_close_calls / size_mb, (double)result.sync_calls / size_mb);
+}
+
+} // namespace
+
+int _tmain(int argc, const TCHAR *argv[]) {
+  unsigned long long size_mb = argc > 1 ? std::stoull(argv[1]) : 100;
+  size_t chunk_size = argc > 2 ? (size_t)std::stoull(argv[2]) : 16 * 1024;
+  xl::native_string dir = xl::fs::tmp_dir();
+  if (size_mb == 0 || chunk_size == 0 || dir.empty()) {
+    return -1;
+  }
+
+  Print(RunLegacy(dir, size_mb * 1024 * 1024, chunk_size), size_mb);
+  Print(RunJournal(dir, size_mb * 1024 * 1024, chunk_size), size_mb);
+  return 0;
+}
@@ -0,0 +1,218 @@
+// Microbenchmarks of the package paths that run after the download: hashing the package, extracting it, and swapping
+// the extracted installation in. Crc32() is checked against zlib first, and fails the run if they differ.
+//
+// Usage: package_bench <zip_file> [repeat] [tar_zst_file]
+//
+// bench.py generates the package with bench_server.py, and the same files as a tar.zst package if zstd is installed.
+// Every result is printed as one JSON object per line, times are the best of repeat runs, 3 by default.
+
+#include "../../src/base/crc32.h"
+#include "../../src/base/file_util.h"
+#include "../../src/base/hash.h"
+#include "../../src/base/tar_extractor.h"
+#include "../../src/base/versioned_install.h"
+#include "../../src/base/zip_extractor.h"
+#include "../../src/common.h"
+#include "../../src/installer/installation.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <selfupdate/updater.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include <xl/encoding>
+#include <xl/file>
+#include <xl/native_string>
+#include <xl/zip>
+#include <zlib.h>
+
+namespace {
+
+const char *HASH_ALGORITHMS[] = {"md5", "sha1", "sha256", "sha512"};
+
+// Returns the best time of repeat runs of run, in seconds. prepare runs before each one, untimed.
+double Measure(unsigned repeat, const std::function<void()> &prepare, const std::function<bool()> &run) {
+  double best = -1;
+  for (unsigned i = 0; i < repeat; ++i) {
+    if (prepare != nullptr) {
+      prepare();
+    }
+    auto start = std::chrono::steady_clock::now();
+    if (!run()) {
+      return -1;
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    best = best < 0 ? seconds : std::min(best, seconds);
+  }
+  return best;
+}
+
+void Print(const char *bench, const std::string &mode, double seconds, unsigned long long bytes) {
+  printf("{\"bench\": \"%s\", \"mode\": \"%s\", \"bytes\": %llu, \"seconds\": %.4f, \"mb_per_second\": %.1f}\n", bench,
+         mode.c_str(), bytes, seconds, seconds > 0 ? bytes / seconds / (1024 * 1024) : -1.0);
+  fflush(stdout);
+}
+
+// Compares Crc32() with zlib's crc32() for every size up to a few blocks of the folding loops, at every alignment, in
+// one call and continued across two.
+bool CheckCrc32() {
+  const size_t max_size = 1024;
+  const size_t max_offset = 16;
+  std::vector<unsigned char> data(max_size + max_offset);
+  unsigned seed = 1;
+  for (auto &c : data) {
+    seed = seed * 1103515245 + 12345;
+    c = (unsigned char)(seed >> 16);
+  }
+  for (size_t offset = 0; offset < max_offset; ++offset) {
+    for (size_t size = 0; size <= max_size; ++size) {
+      const unsigned char *p = data.data() + offset;
+      uint32_t expected = (uint32_t)crc32(0, p, (uInt)size);
+      size_t split = size / 3;
+      if (selfupdate::Crc32(0, p, size) != expected ||
+          selfupdate::Crc32(selfupdate::Crc32(0, p, split), p + split, size - split) != expected) {
+        fprintf(stderr, "Crc32 differs from zlib, offset: %zu, size: %zu\n", offset, size);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void BenchCrc32(unsigned repeat) {
+  std::vector<unsigned char> data(64 * 1024 * 1024, 0x5a);
+  volatile uint32_t crc = 0;
+  Print("crc32", "selfupdate", Measure(repeat, nullptr, [&]() {
+          crc = selfupdate::Crc32(0, data.data(), data.size());
+          return true;
+        }),
+        data.size());
+  Print("crc32", "zlib", Measure(repeat, nullptr, [&]() {
+          crc = (uint32_t)crc32(0, data.data(), (uInt)data.size());
+          return true;
+        }),
+        data.size());
+}
+
+void BenchHash(const xl::native_string &package_file, unsigned long long size, unsigned repeat) {
+  for (const char *algorithm : HASH_ALGORITHMS) {
+    double seconds = Measure(repeat, nullptr, [&]() {
+      selfupdate::MultiHasher hasher;
+      // Any value, only the time to compute it matters.
+      return hasher.Init({{algorithm, ""}}) && selfupdate::HashFile(package_file, hasher);
+    });
+    Print("hash", algorithm, seconds, size);
+  }
+}
+
+void BenchExtract(const xl::native_string &package_file,
+                  unsigned long long size,
+                  const xl::native_string &dir,
+                  unsigned repeat) {
+  xl::native_string target_dir = xl::path::join(dir, _T("extract"));
+  auto prepare = [&]() {
+    xl::fs::remove_all(target_dir.c_str());
+  };
+  Print("extract", "xl::zip", Measure(repeat, prepare, [&]() {
+          return xl::zip::extract(package_file.c_str(), target_dir.c_str());
+        }),
+        size);
+  unsigned processors = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned threads = 1; threads <= processors; threads *= 2) {
+    Print("extract", "threads=" + std::to_string(threads), Measure(repeat, prepare, [&]() {
+            return selfupdate::ExtractZip(package_file, target_dir, threads);
+          }),
+          size);
+  }
+  xl::fs::remove_all(target_dir.c_str());
+}
+
+void BenchExtractTarZstd(const xl::native_string &package_file, const xl::native_string &dir, unsigned repeat) {
+  xl::native_string target_dir = xl::path::join(dir, _T("extract"));
+  auto prepare = [&]() {
+    xl::fs::remove_all(target_dir.c_str());
+  };
+  Print("extract", "tar.zst", Measure(repeat, prepare, [&]() {
+          return selfupdate::ExtractTarZstd(package_file, target_dir);
+        }),
+        selfupdate::GetFileSize(package_file));
+  xl::fs::remove_all(target_dir.c_str());
+}
+
+// Times ReplaceInstallation() on an installation and a new one both extracted from the package, then emptying the
+// trash it leaves, which the installer does after the new version is launched. Then the same as versions of a versioned
+// install, where the new one is copied the extra files and switched to.
+void BenchSwap(const xl::native_string &package_file,
+               unsigned long long size,
+               const xl::native_string &dir,
+               unsigned repeat) {
+  xl::native_string install_location = xl::path::join(dir, _T("install"));
+  auto prepare = [&]() {
+    xl::fs::remove_all(install_location.c_str());
+    xl::fs::remove_all((install_location + _T(INSTALL_LOCATION_TRASH_SUFFIX)).c_str());
+    selfupdate::ExtractZip(package_file, install_location, 0);
+    selfupdate::ExtractZip(package_file, install_location + _T(INSTALL_LOCATION_NEW_SUFFIX), 0);
+  };
+  Print("swap", "replace", Measure(repeat, prepare, [&]() {
+          return selfupdate::ReplaceInstallation(install_location);
+        }),
+        size);
+  auto prepare_trash = [&]() {
+    prepare();
+    selfupdate::ReplaceInstallation(install_location);
+  };
+  Print("swap", "empty trash", Measure(repeat, prepare_trash, [&]() {
+          selfupdate::EmptyTrash(install_location);
+          return true;
+        }),
+        size);
+  xl::fs::remove_all(install_location.c_str());
+
+#ifndef _WIN32
+  xl::native_string versions_dir = selfupdate::GetVersionsDir(install_location);
+  auto prepare_versioned = [&]() {
+    prepare();
+    xl::fs::remove_all(versions_dir.c_str());
+    selfupdate::ReplaceInstallation(install_location, nullptr, nullptr, _T("1"));
+    selfupdate::ExtractZip(package_file, install_location + _T(INSTALL_LOCATION_NEW_SUFFIX), 0);
+  };
+  Print("swap", "versioned", Measure(repeat, prepare_versioned, [&]() {
+          return selfupdate::ReplaceInstallation(install_location, nullptr, nullptr, _T("2"));
+        }),
+        size);
+  xl::fs::remove(install_location.c_str());
+  xl::fs::remove_all(versions_dir.c_str());
+  xl::fs::remove_all((install_location + _T(INSTALL_LOCATION_TRASH_SUFFIX)).c_str());
+#endif
+}
+
+} // namespace
+
+int _tmain(int argc, const TCHAR *argv[]) {
+  if (argc < 2) {
+    return -1;
+  }
+  xl::native_string package_file = argv[1];
+  unsigned repeat = argc > 2 ? (unsigned)std::stoul(argv[2]) : 3;
+  long long size = selfupdate::GetFileSize(package_file);
+  xl::native_string dir = xl::path::join(xl::fs::tmp_dir(), _T("selfupdate-bench"));
+  xl::fs::mkdirs(dir.c_str());
+  if (size < 0 || repeat == 0 || !xl::fs::exists(dir.c_str())) {
+    return -1;
+  }
+
+  if (!CheckCrc32()) {
+    return -1;
+  }
+  BenchCrc32(repeat);
+  BenchHash(package_file, size, repeat);
+  BenchExtract(package_file, size, dir, repeat);
+  if (argc > 3) {
+    BenchExtractTarZstd(argv[3], dir, repeat);
+  }
+  BenchSwap(package_file, size, dir, repeat);
+  xl::fs::remove_all(dir.c_str());
+  return 0;
+}
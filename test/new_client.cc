@@ -10,6 +10,17 @@ int _tmain(int argc, const TCHAR *argv[]) {
 
   if (selfupdate::IsNewVersionFirstLaunched(argc, argv)) {
     XL_LOG_INFO("This is the first launching since upgraded. Force updated: ", selfupdate::IsForceUpdated(argc, argv));
+    selfupdate::UpdateMetrics metrics;
+    if (selfupdate::LoadUpdateMetrics(argc, argv, metrics)) {
+      XL_LOG_INFO("Update metrics. query: ", metrics.query_ms, "ms, download: ", metrics.download_ms,
+                  "ms, fetched: ", metrics.bytes_fetched, ", resumed: ", metrics.bytes_resumed,
+                  ", stage: ", metrics.stage_ms, "ms, extract: ", metrics.extract_ms, "ms, entries: ",
+                  metrics.extracted_entries, ", rename retries: ", metrics.rename_retries,
+                  ", downtime: ", metrics.downtime_ms, "ms",
+                  ", files released: ", metrics.files_released);
+    }
+  } else if (argc > 1 && xl::native_string(argv[1]) == _T("--rollback")) {
+    XL_LOG_INFO("Rolled back: ", selfupdate::Rollback());
   } else {
     XL_LOG_INFO("This is an ordinary launching.");
   }
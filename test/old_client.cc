@@ -1,6 +1,7 @@
 #include <cmath>
 #include <selfupdate/installer.h>
 #include <selfupdate/updater.h>
+#include <string>
 #include <xl/log_setup>
 #include <xl/native_string>
 #include <xl/scope_exit>
@@ -25,6 +26,12 @@ int _tmain(int argc, const TCHAR *argv[]) {
 
   XL_LOG_INFO("old_client launched.");
 
+  // --keep-versions <count> installs side by side, see InstallOptions::keep_versions.
+  selfupdate::InstallOptions install_options;
+  if (argc > 2 && xl::native_string(argv[1]) == _T("--keep-versions")) {
+    install_options.keep_versions = (unsigned)std::stoul(xl::native_string(argv[2]));
+  }
+
   XL_LOG_INFO("Step 1: query package info");
   selfupdate::PackageInfo package_info;
   if (!selfupdate::Query("http://localhost:8080/query", {}, "", package_info)) {
@@ -55,7 +62,7 @@ int _tmain(int argc, const TCHAR *argv[]) {
   }
 
   XL_LOG_INFO("Step 3: install package");
-  if (!selfupdate::Install(package_info)) {
+  if (!selfupdate::Install(package_info, install_options)) {
     return -1;
   }
 
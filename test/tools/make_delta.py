@@ -0,0 +1,94 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+
+# Makes a delta package that turns the installation in old_dir into the one in new_dir.
+# See src/updater/delta_package.h for the format.
+
+import os
+import sys
+import struct
+import hashlib
+
+DELTA_MAGIC = b'SUDELTA1'
+DELTA_ENTRY_END = 0
+DELTA_ENTRY_FILE = 1
+DELTA_ENTRY_DELETED = 2
+DELTA_FILE_EXECUTABLE = 1
+DELTA_OP_END = 0
+DELTA_OP_COPY = 1
+DELTA_OP_ADD = 2
+BLOCK_SIZE = 64
+
+
+def pack_string(s):
+    return struct.pack('<I', len(s)) + s
+
+
+def diff(source, target):
+    blocks = {}
+    for offset in range(0, len(source) - BLOCK_SIZE + 1, BLOCK_SIZE):
+        blocks.setdefault(source[offset:offset + BLOCK_SIZE], offset)
+    ops = []
+    literal = bytearray()
+    i = 0
+    while i < len(target):
+        offset = blocks.get(target[i:i + BLOCK_SIZE])
+        if offset is None:
+            literal.append(target[i])
+            i += 1
+            continue
+        length = BLOCK_SIZE
+        while i + length < len(target) and offset + length < len(source) and target[i + length] == source[offset + length]:
+            length += 1
+        if literal:
+            ops.append(struct.pack('<BQ', DELTA_OP_ADD, len(literal)) + bytes(literal))
+            literal = bytearray()
+        ops.append(struct.pack('<BQQ', DELTA_OP_COPY, offset, length))
+        i += length
+    if literal:
+        ops.append(struct.pack('<BQ', DELTA_OP_ADD, len(literal)) + bytes(literal))
+    ops.append(struct.pack('<B', DELTA_OP_END))
+    return b''.join(ops)
+
+
+def make_delta(old_dir, new_dir, delta_file):
+    with open(delta_file, 'wb') as out:
+        out.write(DELTA_MAGIC)
+        for root, _, files in os.walk(new_dir):
+            for name in sorted(files):
+                new_path = os.path.join(root, name)
+                path = os.path.relpath(new_path, new_dir).replace(os.sep, '/')
+                with open(new_path, 'rb') as f:
+                    target = f.read()
+                source = b''
+                source_hash = b''
+                old_path = os.path.join(old_dir, path)
+                if os.path.isfile(old_path):
+                    with open(old_path, 'rb') as f:
+                        source = f.read()
+                    if source == target:
+                        continue
+                    source_hash = hashlib.sha256(source).hexdigest().encode()
+                flags = DELTA_FILE_EXECUTABLE if os.access(new_path, os.X_OK) else 0
+                out.write(struct.pack('<B', DELTA_ENTRY_FILE))
+                out.write(pack_string(path.encode('utf-8')))
+                out.write(struct.pack('<B', flags))
+                out.write(pack_string(source_hash))
+                out.write(struct.pack('<Q', len(target)))
+                out.write(pack_string(hashlib.sha256(target).hexdigest().encode()))
+                out.write(diff(source, target))
+        # Everything in a deleted directory is listed too, the installer does not look into it.
+        for root, dirs, files in os.walk(old_dir):
+            for name in sorted(dirs + files):
+                path = os.path.relpath(os.path.join(root, name), old_dir).replace(os.sep, '/')
+                if not os.path.exists(os.path.join(new_dir, path)):
+                    out.write(struct.pack('<B', DELTA_ENTRY_DELETED))
+                    out.write(pack_string(path.encode('utf-8')))
+        out.write(struct.pack('<B', DELTA_ENTRY_END))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 4:
+        print('Usage: make_delta.py <old_dir> <new_dir> <delta_file>')
+        sys.exit(1)
+    make_delta(sys.argv[1], sys.argv[2], sys.argv[3])
@@ -1,34 +1,76 @@
 #!/usr/bin/python
 # -*- coding: utf-8 -*-
 
+import io
 import os
 import sys
 import json
+import shutil
+import tarfile
 import zipfile
 import hashlib
+import tempfile
+import subprocess
 import http.server
 
+import make_delta
+
 NEW_FILENAME = 'new_client'
 TARGET_FILENAME = 'client'
 if sys.platform == 'win32':
     NEW_FILENAME += '.exe'
     TARGET_FILENAME += '.exe'
+OLD_FILENAME = 'old_client'
+if sys.platform == 'win32':
+    OLD_FILENAME += '.exe'
+# Served as package.<format>, the format is the first argument, zip by default.
+PACKAGE_FORMATS = ['zip', 'tar.zst', 'delta']
 PACKAGE_FILE = 'package.zip'
 PACKAGE_INFO_FILE = 'package_info.json'
+PACKAGE_CHUNK_SIZE = 64 * 1024
+
+
+def make_tar_zstd_package():
+    data = io.BytesIO()
+    with tarfile.open(fileobj=data, mode='w') as tar:
+        tar.add(NEW_FILENAME, TARGET_FILENAME)
+    with open(PACKAGE_FILE, 'wb') as f:
+        subprocess.run(['zstd', '-q', '-19'], input=data.getvalue(), stdout=f, check=True)
 
 
-def make_package():
-    with zipfile.ZipFile(PACKAGE_FILE, 'w') as zip:
-        zip.write(NEW_FILENAME, TARGET_FILENAME)
+# Against the installation test.py starts from, with old_client as the client.
+def make_delta_package():
+    temp_dir = tempfile.mkdtemp()
+    try:
+        old_dir = os.path.join(temp_dir, 'old')
+        new_dir = os.path.join(temp_dir, 'new')
+        os.makedirs(old_dir)
+        os.makedirs(new_dir)
+        shutil.copy(OLD_FILENAME, os.path.join(old_dir, TARGET_FILENAME))
+        shutil.copy(NEW_FILENAME, os.path.join(new_dir, TARGET_FILENAME))
+        make_delta.make_delta(old_dir, new_dir, PACKAGE_FILE)
+    finally:
+        shutil.rmtree(temp_dir)
+
+
+def make_package(package_format):
+    if package_format == 'tar.zst':
+        make_tar_zstd_package()
+    elif package_format == 'delta':
+        make_delta_package()
+    else:
+        with zipfile.ZipFile(PACKAGE_FILE, 'w') as zip:
+            zip.write(NEW_FILENAME, TARGET_FILENAME)
     package_file_size = os.stat(PACKAGE_FILE).st_size
     sha256 = hashlib.sha256()
+    chunk_hashes = []
     with open(PACKAGE_FILE, 'rb') as f:
-        BLOCK_SIZE = 1024 * 1024
         while True:
-            buffer = f.read(BLOCK_SIZE)
+            buffer = f.read(PACKAGE_CHUNK_SIZE)
             if buffer is None or len(buffer) == 0:
                 break
             sha256.update(buffer)
+            chunk_hashes.append(hashlib.sha256(buffer).hexdigest().lower())
     sha256_hash = sha256.hexdigest().lower()
 
     package_info = {
@@ -37,10 +79,13 @@ def make_package():
         'package_version': '1.0',
         'package_url': 'http://localhost:8080/download',
         'package_size': package_file_size,
-        'package_format': 'zip',
+        'package_format': package_format,
         'package_hash': {
             "sha256": sha256_hash,
         },
+        'package_chunk_size': PACKAGE_CHUNK_SIZE,
+        'package_chunk_hash_algo': 'sha256',
+        'package_chunk_hashes': chunk_hashes,
         'update_title': 'SelfUpdate 1.0',
         'update_description': 'This upgrade is very important!',
     }
@@ -57,13 +102,30 @@ class WebServer(http.server.BaseHTTPRequestHandler):
                 with open(PACKAGE_INFO_FILE, 'rb') as f:
                     self.wfile.write(f.read())
         elif self.path == '/download':
-            self.send_response(200)
-            self.send_header("Content-Length",
-                             str(os.stat(PACKAGE_FILE).st_size))
+            with open(PACKAGE_FILE, 'rb') as f:
+                data = f.read()
+            etag = '"%s"' % hashlib.sha256(data).hexdigest()
+            first, last = 0, len(data) - 1
+            range_header = self.headers.get('Range')
+            if_range = self.headers.get('If-Range')
+            partial = range_header is not None and range_header.startswith(
+                'bytes=') and (if_range is None or if_range == etag)
+            if partial:
+                begin, _, end = range_header[len('bytes='):].partition('-')
+                first = int(begin)
+                if end:
+                    last = min(int(end), last)
+                self.send_response(206)
+                self.send_header("Content-Range",
+                                 "bytes %d-%d/%d" % (first, last, len(data)))
+            else:
+                self.send_response(200)
+            self.send_header("ETag", etag)
+            self.send_header("Accept-Ranges", "bytes")
+            self.send_header("Content-Length", str(last - first + 1))
             self.end_headers()
             if self.command != 'HEAD':
-                with open(PACKAGE_FILE, 'rb') as f:
-                    self.wfile.write(f.read())
+                self.wfile.write(data[first:last + 1])
         else:
             self.send_error(404)
 
@@ -78,7 +140,13 @@ def run_server():
 
 
 def main():
-    make_package()
+    global PACKAGE_FILE
+    package_format = sys.argv[1] if len(sys.argv) > 1 else 'zip'
+    if package_format not in PACKAGE_FORMATS:
+        print('Unknown package format: ' + package_format)
+        sys.exit(1)
+    PACKAGE_FILE = 'package.' + package_format
+    make_package(package_format)
     run_server()
 
 
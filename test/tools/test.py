@@ -15,11 +15,20 @@ if sys.platform == 'win32':
     OLD_FILENAME += '.exe'
     TARGET_FILENAME += '.exe'
 TEST_DIR = 'test'
+VERSIONS_DIR = TEST_DIR + '.versions'
+PACKAGE_VERSION = '1.0'
+
+
+def remove(path):
+    if os.path.islink(path) or os.path.isfile(path):
+        os.remove(path)
+    elif os.path.exists(path):
+        shutil.rmtree(path)
 
 
 def copy_files():
-    if os.path.exists(TEST_DIR):
-        shutil.rmtree(TEST_DIR)
+    for suffix in ['', '.versions', '.trash', '.old', '.new']:
+        remove(TEST_DIR + suffix)
     os.makedirs(TEST_DIR)
     shutil.copy(
         OLD_FILENAME,
@@ -27,8 +36,8 @@ def copy_files():
     )
 
 
-def run_server():
-    cmd = ['python', 'server.py']
+def run_server(package_format='zip'):
+    cmd = ['python', 'server.py', package_format]
     print(' '.join(cmd))
     return subprocess.Popen(cmd,
                             stdout=subprocess.PIPE,
@@ -58,14 +67,76 @@ def test():
         lines) - 1].endswith('This is the first launching since upgraded. Force updated: 0')
 
 
+def check_active_version(version):
+    assert os.path.islink(TEST_DIR)
+    assert os.readlink(TEST_DIR) == VERSIONS_DIR + '/' + version
+    assert os.path.isfile(os.path.join(TEST_DIR, TARGET_FILENAME))
+
+
+def test_versions():
+    # Versioned installs use symlinks, which are not supported on Windows.
+    if sys.platform == 'win32':
+        return
+    copy_files()
+
+    # The installation in place is kept as the initial version.
+    result = cmd([os.path.join(TEST_DIR, TARGET_FILENAME), '--keep-versions', '2'])
+    print(result)
+    check_active_version(PACKAGE_VERSION)
+    assert os.path.isdir(os.path.join(VERSIONS_DIR, 'initial'))
+
+    # Reinstalling the active version goes next to it, and the initial version is collected.
+    result = cmd([os.path.join(VERSIONS_DIR, 'initial', TARGET_FILENAME), '--keep-versions', '2'])
+    print(result)
+    check_active_version(PACKAGE_VERSION + '-1')
+    assert sorted(name for name in os.listdir(VERSIONS_DIR) if not name.startswith('.')) == [
+        PACKAGE_VERSION, PACKAGE_VERSION + '-1']
+
+    result = cmd([os.path.join(TEST_DIR, TARGET_FILENAME), '--rollback'])
+    print(result)
+    assert result.splitlines()[-1].endswith('Rolled back: 1')
+    check_active_version(PACKAGE_VERSION)
+
+    # Installing in place again turns the installation back into a directory, keeping extra files.
+    os.remove(os.path.join(TEST_DIR, TARGET_FILENAME))
+    shutil.copy(OLD_FILENAME, os.path.join(TEST_DIR, TARGET_FILENAME))
+    with open(os.path.join(TEST_DIR, 'extra.txt'), 'w') as f:
+        f.write('extra')
+    result = cmd(os.path.join(TEST_DIR, TARGET_FILENAME))
+    print(result)
+    assert result.splitlines()[-1].endswith('This is the first launching since upgraded. Force updated: 0')
+    assert not os.path.islink(TEST_DIR)
+    assert os.path.isfile(os.path.join(TEST_DIR, TARGET_FILENAME))
+    assert os.path.isfile(os.path.join(TEST_DIR, 'extra.txt'))
+    assert not os.path.exists(VERSIONS_DIR)
+
+
+def test_package_formats():
+    for package_format in ['tar.zst', 'delta']:
+        if package_format == 'tar.zst' and shutil.which('zstd') is None:
+            print('zstd not found, skipping tar.zst packages')
+            continue
+        copy_files()
+        process = run_server(package_format)
+        time.sleep(3)
+        try:
+            test()
+        finally:
+            process.kill()
+            process.wait()
+
+
 def main():
     copy_files()
     process = run_server()
     time.sleep(3)
     try:
         test()
+        test_versions()
     finally:
         process.kill()
+        process.wait()
+    test_package_formats()
 
 
 if __name__ == '__main__':